@@ -8,8 +8,12 @@
 #include <vector>
 #include <algorithm>
 #include <unordered_map>
+#include <map>
+#include <list>
 #include <queue>
 #include <ctime>
+#include <chrono>
+#include <fstream>
 
 using namespace std;
 
@@ -19,6 +23,12 @@ using namespace std;
 #define CPU         "CPU"
 #define INPUT       "INPUT"
 #define IO          "I/O"
+#define DEVICE      "DEVICE"
+
+// Queue disciplines an I/O device can be declared with
+#define FIFO        "FIFO"
+#define SCAN        "SCAN"
+#define DEADLINE    "DEADLINE"
 
 #define MAX_CPU                 4U
 #define MAX_IO                  1U
@@ -29,6 +39,9 @@ using namespace std;
 #define RESOURCE_UNAVAILABLE    -1
 #define RESOURCE_NOT_NEEDED     -1
 
+#define DEVICE_BLOCK_SEPARATOR  '@'
+#define DEVICE_DEADLINE         50U    // ms a request may wait on a DEADLINE device before it is served out of order
+
 #define SAMPLING_TIME    0.001
 
 // Represent the state of a given process loaded in memory
@@ -57,6 +70,55 @@ enum class ProcessState
     Terminated
 };
 
+// Order in which an I/O device serves its waiting requests
+enum class QueueDiscipline
+{
+    Invalid = -1,
+    Fifo,       // arrival order
+    Scan,       // elevator: sweep the requested blocks in one direction, then reverse
+    Deadline    // elevator order, unless the oldest request has waited longer than DEVICE_DEADLINE
+};
+
+QueueDiscipline StringToQueueDiscipline(string discipline)
+{
+    if (discipline == FIFO)
+    {
+        return QueueDiscipline::Fifo;
+    }
+    else if (discipline == SCAN)
+    {
+        return QueueDiscipline::Scan;
+    }
+    else if (discipline == DEADLINE)
+    {
+        return QueueDiscipline::Deadline;
+    }
+
+    return QueueDiscipline::Invalid;
+}
+
+string QueueDisciplineToString(QueueDiscipline discipline)
+{
+    string name = "";
+    switch (discipline)
+    {
+        case QueueDiscipline::Fifo:
+        {
+            name = FIFO;
+        } break;
+        case QueueDiscipline::Scan:
+        {
+            name = SCAN;
+        } break;
+        case QueueDiscipline::Deadline:
+        {
+            name = DEADLINE;
+        } break;
+    }
+
+    return name;
+}
+
 // Converter from TimelineState to ProcessState
 ProcessState TimelineStateToProcessState(TimelineState timeline_state)
 {
@@ -158,6 +220,7 @@ struct ProcessInfo
         cpu_core_used = RESOURCE_NOT_NEEDED;
         input_resource_used = RESOURCE_NOT_NEEDED;
         io_resource_used = RESOURCE_NOT_NEEDED;
+        io_device_used = "";
     }
 
     unsigned int process_id;
@@ -165,35 +228,404 @@ struct ProcessInfo
     int cpu_core_used;
     int input_resource_used;
     int io_resource_used;
+    string io_device_used;
     unsigned long long elapsed_processor_time;
     unsigned long long elapsed_input_time;
     unsigned long long elapsed_io_time;
     ProcessState state;
 };
 
+// Busy / idle states of the units of one resource type (the CPU cores, the input units, or the units of an I/O device)
+class ResourceSlots
+{
+    vector<bool> m_states;
+    unsigned int m_in_service;
+
+public:
+    ResourceSlots(unsigned int count = 0) :
+        m_states(count, false),
+        m_in_service(0)
+    {
+
+    }
+
+    unsigned int Size() const
+    {
+        return m_states.size();
+    }
+
+    unsigned int InService() const
+    {
+        return m_in_service;
+    }
+
+    bool IsAvailable() const
+    {
+        return m_in_service < m_states.size();
+    }
+
+    bool IsBusy(unsigned int identifier) const
+    {
+        assert(identifier < m_states.size() && L"The integer identifying the resource should be within range of the maximum available resources");
+        return m_states[identifier];
+    }
+
+    // Marks the first idle unit busy and returns its identifier
+    int Acquire()
+    {
+        if (!IsAvailable())
+        {
+            return RESOURCE_UNAVAILABLE;
+        }
+
+        for (unsigned int i = 0; i < m_states.size(); i++)
+        {
+            if (m_states[i] == false)
+            {
+                m_states[i] = true;
+                ++m_in_service;
+                return i;
+            }
+        }
+
+        return RESOURCE_UNAVAILABLE;
+    }
+
+    void Release(unsigned int identifier)
+    {
+        assert(identifier < m_states.size() && L"The integer identifying the resource should be within range of the maximum available resources");
+
+        if (m_states[identifier])
+        {
+            m_states[identifier] = false;
+            --m_in_service;
+        }
+        // else, no-op
+    }
+};
+
+// Keywords of the queries that can be run against a completed simulation
+#define QUERY_WAITING       "WAITING"
+#define QUERY_STALL         "STALL"
+#define QUERY_UTILIZATION   "UTIL"
+
+bool IsWaitState(TimelineState timeline_state)
+{
+    return timeline_state == TimelineState::CPU_Ready ||
+        timeline_state == TimelineState::Input_Wait ||
+        timeline_state == TimelineState::IO_Wait;
+}
+
+// Keeps a completed simulation around so it can be queried without running it again. Every resource gets its own
+// interval tree of [start, end) intervals, one per procedure that ran or waited on it. The intervals are stored
+// column by column and sorted by start time, and the tree is implicit over that order: the interval in the middle
+// of a range is the root of the range, and max_end holds the latest end time in each subtree.
+class SimulationIndex
+{
+    struct IntervalColumns
+    {
+        vector<unsigned long long> start;
+        vector<unsigned long long> end;
+        vector<unsigned long long> max_end;
+        vector<unsigned int> process_id;
+        vector<int> unit;
+        vector<TimelineState> state;
+    };
+
+    map<string, IntervalColumns> m_resources;
+
+    // The longest single stretch a process spent in the CPU ready queue
+    unsigned int m_longest_stall_process_id;
+    unsigned long long m_longest_stall_start;
+    unsigned long long m_longest_stall_duration;
+
+    bool m_built;
+
+    unsigned long long BuildMaxEnd(IntervalColumns& columns, size_t low, size_t high)
+    {
+        if (low >= high)
+        {
+            return 0;
+        }
+
+        size_t mid = low + (high - low) / 2;
+        unsigned long long left_max_end = BuildMaxEnd(columns, low, mid);
+        unsigned long long right_max_end = BuildMaxEnd(columns, mid + 1, high);
+        columns.max_end[mid] = max(columns.end[mid], max(left_max_end, right_max_end));
+
+        return columns.max_end[mid];
+    }
+
+    // Collects the positions of the intervals in [low, high) that overlap [query_start, query_end)
+    void FindOverlapping(const IntervalColumns& columns, size_t low, size_t high, unsigned long long query_start, unsigned long long query_end, vector<size_t>& positions)
+    {
+        if (low >= high)
+        {
+            return;
+        }
+
+        size_t mid = low + (high - low) / 2;
+
+        // Nothing in this subtree ends after the query starts
+        if (columns.max_end[mid] <= query_start)
+        {
+            return;
+        }
+
+        FindOverlapping(columns, low, mid, query_start, query_end, positions);
+
+        // Everything to the right starts no earlier than the root
+        if (columns.start[mid] < query_end)
+        {
+            if (columns.end[mid] > query_start)
+            {
+                positions.push_back(mid);
+            }
+
+            FindOverlapping(columns, mid + 1, high, query_start, query_end, positions);
+        }
+    }
+
+public:
+    SimulationIndex() :
+        m_longest_stall_process_id(0),
+        m_longest_stall_start(0),
+        m_longest_stall_duration(0),
+        m_built(false)
+    {
+
+    }
+
+    void AddInterval(string resource, unsigned int process_id, TimelineState state, int unit, unsigned long long start, unsigned long long end)
+    {
+        assert(!m_built && "Intervals should be added before SimulationIndex::Build() is called");
+
+        // Zero-length procedures never held or waited on anything
+        if (start >= end)
+        {
+            return;
+        }
+
+        IntervalColumns& columns = m_resources[resource];
+        columns.start.push_back(start);
+        columns.end.push_back(end);
+        columns.process_id.push_back(process_id);
+        columns.unit.push_back(unit);
+        columns.state.push_back(state);
+
+        if (state == TimelineState::CPU_Ready && end - start > m_longest_stall_duration)
+        {
+            m_longest_stall_process_id = process_id;
+            m_longest_stall_start = start;
+            m_longest_stall_duration = end - start;
+        }
+    }
+
+    // Sorts every resource's columns by start time and builds the trees
+    void Build()
+    {
+        for (auto it = m_resources.begin(); it != m_resources.end(); ++it)
+        {
+            IntervalColumns& columns = it->second;
+            size_t count = columns.start.size();
+
+            vector<size_t> order(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                order[i] = i;
+            }
+
+            stable_sort(order.begin(), order.end(), [&columns](size_t a, size_t b) { return columns.start[a] < columns.start[b]; });
+
+            IntervalColumns sorted;
+            for each (size_t i in order)
+            {
+                sorted.start.push_back(columns.start[i]);
+                sorted.end.push_back(columns.end[i]);
+                sorted.process_id.push_back(columns.process_id[i]);
+                sorted.unit.push_back(columns.unit[i]);
+                sorted.state.push_back(columns.state[i]);
+            }
+
+            sorted.max_end.assign(count, 0);
+            BuildMaxEnd(sorted, 0, count);
+            columns = sorted;
+        }
+
+        m_built = true;
+    }
+
+    // Processes waiting on the resource (ready queue for the CPU) at the given time
+    vector<unsigned int> GetWaitingProcesses(string resource, unsigned long long time)
+    {
+        assert(m_built && "SimulationIndex::Build() should be called before the index is queried");
+        vector<unsigned int> waiting_processes;
+
+        auto it = m_resources.find(resource);
+        if (it == m_resources.end())
+        {
+            return waiting_processes;
+        }
+
+        const IntervalColumns& columns = it->second;
+        vector<size_t> positions;
+        FindOverlapping(columns, 0, columns.start.size(), time, time + 1, positions);
+
+        for each (size_t i in positions)
+        {
+            if (IsWaitState(columns.state[i]))
+            {
+                waiting_processes.push_back(columns.process_id[i]);
+            }
+        }
+
+        return waiting_processes;
+    }
+
+    // Returns false if no process ever waited in the CPU ready queue
+    bool GetLongestReadyQueueStall(unsigned int& process_id, unsigned long long& start, unsigned long long& duration)
+    {
+        assert(m_built && "SimulationIndex::Build() should be called before the index is queried");
+        process_id = m_longest_stall_process_id;
+        start = m_longest_stall_start;
+        duration = m_longest_stall_duration;
+
+        return m_longest_stall_duration > 0;
+    }
+
+    // Fraction of [start, end) during which the given unit of the resource was busy
+    double GetUtilization(string resource, int unit, unsigned long long start, unsigned long long end)
+    {
+        assert(m_built && "SimulationIndex::Build() should be called before the index is queried");
+
+        auto it = m_resources.find(resource);
+        if (it == m_resources.end() || start >= end)
+        {
+            return 0.0;
+        }
+
+        const IntervalColumns& columns = it->second;
+        vector<size_t> positions;
+        FindOverlapping(columns, 0, columns.start.size(), start, end, positions);
+
+        unsigned long long busy_time = 0;
+        for each (size_t i in positions)
+        {
+            if (columns.unit[i] == unit && !IsWaitState(columns.state[i]))
+            {
+                busy_time += min(columns.end[i], end) - max(columns.start[i], start);
+            }
+        }
+
+        return busy_time / (double)(end - start);
+    }
+
+    // Answers one query per line:
+    //   WAITING <resource> <time>                 processes waiting on the resource at the given time
+    //   STALL                                     longest stretch a process spent in the CPU ready queue
+    //   UTIL <resource> <unit> <start> <end>      utilization of one unit of the resource over [start, end)
+    void RunQueries(istream& queries)
+    {
+        cout << "\t-- QUERIES --" << endl << endl;
+
+        string keyword;
+        queries >> keyword;
+        while (queries)
+        {
+            auto query_start_time = chrono::steady_clock::now();
+
+            if (keyword == QUERY_WAITING)
+            {
+                string resource;
+                unsigned long long time;
+                queries >> resource >> time;
+
+                vector<unsigned int> waiting_processes = GetWaitingProcesses(resource, time);
+                cout << "\tWaiting on " << resource << " at " << time << " ms:";
+
+                if (waiting_processes.empty())
+                {
+                    cout << " <None>";
+                }
+
+                for each (unsigned int process_id in waiting_processes)
+                {
+                    cout << " PID " << process_id;
+                }
+
+                cout << endl;
+            }
+            else if (keyword == QUERY_STALL)
+            {
+                unsigned int process_id;
+                unsigned long long start, duration;
+
+                if (GetLongestReadyQueueStall(process_id, start, duration))
+                {
+                    cout << "\tLongest ready queue stall: PID " << process_id << " waited " << duration << " ms from " << start << " ms" << endl;
+                }
+                else
+                {
+                    cout << "\tLongest ready queue stall: <None>" << endl;
+                }
+            }
+            else if (keyword == QUERY_UTILIZATION)
+            {
+                string resource;
+                int unit;
+                unsigned long long start, end;
+                queries >> resource >> unit >> start >> end;
+
+                cout << "\tUtilization of " << resource << " " << unit << " over [" << start << ", " << end << ") ms: "
+                    << 100.0 * GetUtilization(resource, unit, start, end) << "%" << endl;
+            }
+            else
+            {
+                cout << "\tUnknown query: " << keyword << endl;
+                string rest_of_line;
+                getline(queries, rest_of_line);
+            }
+
+            auto query_time = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - query_start_time);
+            cout << "\t  (answered in " << query_time.count() << " us)" << endl;
+
+            queries >> keyword;
+        }
+
+        cout << endl;
+    }
+};
+
 // Strictly for debugging, tracks outstanding allocations that have not been freed
 // If the value is 0, then all outstanding allocations that the variable represents have been freed.
 static int procedure_alloc_diff = 0;
 static int timeline_entry_alloc_diff = 0;
 
 // The orchestrator of the simulation. Controls the process manager and resource manager, and
-// and also provides the data structure that is somewhat mapped to the input file
+// and also provides the data structure that is somewhat mapped to the input file.
+// The topology (CPU cores, units of the default I/O device, input units) is given at construction.
 class TimelineBuilder
 {
 private:
     // Represents a given unit of workbreakdown for a particular process (e.g. CPU 30ms)
     struct Procedure
     {
-        Procedure(TimelineState _state, unsigned long long _duration)
+        Procedure(TimelineState _state, unsigned long long _duration, string _device = "", unsigned long long _block = 0)
         {
             state = _state;
             duration = _duration;
+            device = _device;
+            block = _block;
+            resource_identifier = RESOURCE_NOT_NEEDED;
             next_proc = nullptr;
         }
 
         Procedure* next_proc;
         TimelineState state;
         unsigned long long duration;
+        string device;              // Only used by I/O procedures: the device the request targets
+        unsigned long long block;   // Only used by I/O procedures: the block the request targets (e.g. disk0@120)
+        int resource_identifier;    // The unit the procedure ran on, recorded when the unit is released
     };
 
     // Represents an entry for each process
@@ -205,18 +637,55 @@ private:
         Procedure* start_procedure;
     };
 
+    // A request parked in an I/O device queue. The wait procedure is grown by one tick for every
+    // tick the request is passed over by the device's dispatcher
+    struct DeviceRequest
+    {
+        ProcessTimelineEntry * entry;
+        Procedure * wait_procedure;
+        unsigned long long block;
+        unsigned long long enqueue_time;
+    };
+
+    // An I/O device (e.g. disk0, nvme1) with its own units, request queue and queue discipline
+    struct IODevice
+    {
+        IODevice(string _name, QueueDiscipline _discipline, unsigned int units)
+        {
+            name = _name;
+            discipline = _discipline;
+            unit_slots = ResourceSlots(units);
+            head_position = 0;
+            scanning_up = true;
+            busy_unit_time = 0;
+            sampled_time = 0;
+        }
+
+        string name;
+        QueueDiscipline discipline;
+        ResourceSlots unit_slots;
+        list<DeviceRequest> queue;
+
+        // Elevator state used by the SCAN and DEADLINE disciplines
+        unsigned long long head_position;
+        bool scanning_up;
+
+        // Statistics sampled once per tick
+        unsigned long long busy_unit_time;
+        unsigned long long sampled_time;
+        vector<unsigned long long> queue_depth_histogram;  // index is the queue depth, value is the number of ticks
+    };
+
     // Manages the resources states, and assign the available cores to
     // requesting resources. If resources are not available, the ResourceManager
     // does not issue any resources [blocks]
     class ResourceManager
     {
-        unsigned int m_used_cores;
-        unsigned int m_input_requests_in_service;
-        unsigned int m_io_requests_in_service;
+        ResourceSlots m_cpu_slots;
+        ResourceSlots m_input_slots;
 
-        bool m_cpu_states[MAX_CPU];
-        bool m_input_states[MAX_INPUT];
-        bool m_io_states[MAX_IO];
+        // I/O devices keyed by name. The default device is named I/O and serves un-named I/O requests
+        map<string, IODevice *> m_devices;
 
         string ResourceStateToString(bool state)
         {
@@ -228,94 +697,148 @@ private:
             return "IDLE";
         }
 
-    public:
-        ResourceManager() :
-            m_used_cores(0),
-            m_input_requests_in_service(0),
-            m_io_requests_in_service(0)
+        // Picks the queued request closest to the head in the current sweep direction, reversing the sweep
+        // when nothing is left ahead of the head. Ties are broken in arrival order
+        list<DeviceRequest>::iterator FindNextElevatorRequest(IODevice * device)
         {
-            for (int i = 0; i < MAX_CPU; i++)
+            for (int sweep = 0; sweep < 2; sweep++)
             {
-                m_cpu_states[i] = false;
-            }
+                auto next_request = device->queue.end();
+                for (auto it = device->queue.begin(); it != device->queue.end(); ++it)
+                {
+                    bool ahead_of_head = device->scanning_up ? it->block >= device->head_position : it->block <= device->head_position;
+                    if (!ahead_of_head)
+                    {
+                        continue;
+                    }
 
-            for (int i = 0; i < MAX_INPUT; i++)
-            {
-                m_input_states[i] = false;
+                    if (next_request == device->queue.end() ||
+                        (device->scanning_up && it->block < next_request->block) ||
+                        (!device->scanning_up && it->block > next_request->block))
+                    {
+                        next_request = it;
+                    }
+                }
+
+                if (next_request != device->queue.end())
+                {
+                    return next_request;
+                }
+
+                device->scanning_up = !device->scanning_up;
             }
 
-            for (int i = 0; i < MAX_IO; i++)
+            assert(device->queue.empty() && "The elevator should always find a request in a non-empty queue");
+            return device->queue.end();
+        }
+
+    public:
+        ResourceManager(unsigned int cpu_count, unsigned int io_count, unsigned int input_count) :
+            m_cpu_slots(cpu_count),
+            m_input_slots(input_count)
+        {
+            RegisterDevice(IO, QueueDiscipline::Fifo, io_count);
+        }
+
+        ~ResourceManager()
+        {
+            for (auto it = m_devices.begin(); it != m_devices.end(); ++it)
             {
-                m_io_states[i] = false;
+                delete it->second;
             }
+
+            m_devices.clear();
         }
 
-        int RequestResource(string resource)
+        // Declares a device, or re-declares an existing one as long as none of its units have been handed out
+        bool RegisterDevice(string name, QueueDiscipline discipline, unsigned int units)
         {
-            int available_slot = RESOURCE_UNAVAILABLE;
+            if (name == CPU || name == INPUT || discipline == QueueDiscipline::Invalid || units == 0)
+            {
+                return false;
+            }
 
-            if (resource == CPU)
+            auto it = m_devices.find(name);
+            if (it != m_devices.end())
             {
-                if (m_used_cores == MAX_CPU)
+                if (it->second->unit_slots.InService() != RESOURCE_NOT_IN_USE || !it->second->queue.empty())
                 {
-                    return RESOURCE_UNAVAILABLE;
+                    return false;
                 }
 
-                unsigned int i = RESOURCE_NOT_IN_USE;
-                do
-                {
-                    if (m_cpu_states[i] == false)
-                    {
-                        available_slot = i;
-                        m_cpu_states[i] = true;
-                    }
+                delete it->second;
+                m_devices.erase(it);
+            }
 
-                    i++;
-                } while (available_slot == RESOURCE_UNAVAILABLE && i < MAX_CPU);
+            m_devices.insert(make_pair(name, new IODevice(name, discipline, units)));
+            return true;
+        }
 
-                ++m_used_cores;
-            }
-            else if (resource == IO)
+        bool IsDevice(string resource)
+        {
+            return m_devices.find(resource) != m_devices.end();
+        }
+
+        IODevice * GetDevice(string name)
+        {
+            auto it = m_devices.find(name);
+            if (it == m_devices.end())
             {
-                if (m_io_requests_in_service == MAX_IO)
-                {
-                    return RESOURCE_UNAVAILABLE;
-                }
+                return nullptr;
+            }
 
-                unsigned int i = RESOURCE_NOT_IN_USE;
-                do
-                {
-                    if (m_io_states[i] == false)
-                    {
-                        available_slot = i;
-                        m_io_states[i] = true;
-                    }
+            return it->second;
+        }
 
-                    i++;
-                } while (available_slot == RESOURCE_UNAVAILABLE && i < MAX_IO);
+        map<string, IODevice *>& GetDevices()
+        {
+            return m_devices;
+        }
+
+        // Removes the request the device's queue discipline serves next. Returns false if the queue is empty
+        bool PopNextDeviceRequest(IODevice * device, unsigned long long time, DeviceRequest& request)
+        {
+            if (device->queue.empty())
+            {
+                return false;
+            }
 
-                ++m_io_requests_in_service;
+            auto next_request = device->queue.begin();
+            if (device->discipline == QueueDiscipline::Scan)
+            {
+                next_request = FindNextElevatorRequest(device);
             }
-            else if (resource == INPUT)
+            else if (device->discipline == QueueDiscipline::Deadline)
             {
-                if (m_input_requests_in_service == MAX_INPUT)
+                // The front of the queue is the oldest request. Serve it first once its deadline has expired
+                bool deadline_expired = time - next_request->enqueue_time >= DEVICE_DEADLINE;
+                if (!deadline_expired)
                 {
-                    return RESOURCE_UNAVAILABLE;
+                    next_request = FindNextElevatorRequest(device);
                 }
+            }
 
-                unsigned int i = RESOURCE_NOT_IN_USE;
-                do
-                {
-                    if (m_input_states[i] == false)
-                    {
-                        available_slot = i;
-                        m_input_states[i] = true;
-                    }
+            request = *next_request;
+            device->head_position = request.block;
+            device->queue.erase(next_request);
+            return true;
+        }
 
-                    i++;
-                } while (available_slot == RESOURCE_UNAVAILABLE && i < MAX_INPUT);
+        int RequestResource(string resource)
+        {
+            int available_slot = RESOURCE_UNAVAILABLE;
 
-                ++m_input_requests_in_service;
+            if (resource == CPU)
+            {
+                available_slot = m_cpu_slots.Acquire();
+            }
+            else if (resource == INPUT)
+            {
+                available_slot = m_input_slots.Acquire();
+            }
+            else if (IsDevice(resource))
+            {
+                available_slot = GetDevice(resource)->unit_slots.Acquire();
             }
             else
             {
@@ -323,7 +846,6 @@ private:
                 throw new exception("Unexpected resource type");
             }
             
-            assert(available_slot != RESOURCE_UNAVAILABLE && "There should be an available resource to satisfy the request");
             return available_slot;
         }
 
@@ -332,45 +854,15 @@ private:
         {
             if (resource == CPU)
             {
-                if (m_used_cores > RESOURCE_NOT_IN_USE)
-                {
-                    assert(identifier <= MAX_CPU && L"The integer identifying the resource should be within range of the maximum available resources");
-
-                    if (m_cpu_states[identifier])
-                    {
-                        m_cpu_states[identifier] = false;
-                        --m_used_cores;
-                    }
-                    // else, no-op
-                }
+                m_cpu_slots.Release(identifier);
             }
-            else if (resource == IO)
+            else if (resource == INPUT)
             {
-                if (m_io_requests_in_service > RESOURCE_NOT_IN_USE)
-                {
-                    assert(identifier <= MAX_IO && L"The integer identifying the resource should be within range of the maximum available resources");
-
-                    if (m_io_states[identifier])
-                    {
-                        m_io_states[identifier] = false;
-                        --m_io_requests_in_service;
-                    }
-                    // else, no-op
-                }
+                m_input_slots.Release(identifier);
             }
-            else if (resource == INPUT)
+            else if (IsDevice(resource))
             {
-                if (m_input_requests_in_service > RESOURCE_NOT_IN_USE)
-                {
-                    assert(identifier <= MAX_INPUT && L"The integer identifying the resource should be within range of the maximum available resources");
-
-                    if (m_input_states[identifier])
-                    {
-                        m_input_states[identifier] = false;
-                        --m_input_requests_in_service;
-                    }
-                    // else, no-op
-                }
+                GetDevice(resource)->unit_slots.Release(identifier);
             }
             else
             {
@@ -385,16 +877,15 @@ private:
 
             if (resource == CPU)
             {
-                is_available = m_used_cores < MAX_CPU;
+                is_available = m_cpu_slots.IsAvailable();
             }
-            else if (resource == IO)
+            else if (resource == INPUT)
             {
-                is_available = m_io_requests_in_service < MAX_IO;
-
+                is_available = m_input_slots.IsAvailable();
             }
-            else if (resource == INPUT)
+            else if (IsDevice(resource))
             {
-                is_available = m_input_requests_in_service < MAX_INPUT;
+                is_available = GetDevice(resource)->unit_slots.IsAvailable();
             }
             else
             {
@@ -411,19 +902,15 @@ private:
 
             if (resource == CPU)
             {
-                assert(identifier <= MAX_CPU && L"The integer identifying the resource should be within range of the maximum available resources");
-                is_available = m_cpu_states[identifier];
+                is_available = m_cpu_slots.IsBusy(identifier);
             }
-            else if (resource == IO)
+            else if (resource == INPUT)
             {
-                assert(identifier <= MAX_IO && L"The integer identifying the resource should be within range of the maximum available resources");
-                is_available = m_io_states[identifier];
-
+                is_available = m_input_slots.IsBusy(identifier);
             }
-            else if (resource == INPUT)
+            else if (IsDevice(resource))
             {
-                assert(identifier <= MAX_INPUT && L"The integer identifying the resource should be within range of the maximum available resources");
-                is_available = m_input_states[identifier];
+                is_available = GetDevice(resource)->unit_slots.IsBusy(identifier);
             }
             else
             {
@@ -440,23 +927,71 @@ private:
             
             cout << "\tCPU\tStatus" << endl;
             
-            for (int i = 0; i < MAX_CPU; i++)
+            for (int i = 0; i < m_cpu_slots.Size(); i++)
             {
-                cout << "\t" << i << "\t" << ResourceStateToString(m_cpu_states[i]) << endl;
+                cout << "\t" << i << "\t" << ResourceStateToString(m_cpu_slots.IsBusy(i)) << endl;
             }
 
-            cout << endl << "\tI/O\tStatus" << endl;
-
-            for (int i = 0; i < MAX_IO; i++)
+            for each (auto device_kvp in m_devices)
             {
-                cout << "\t" << i << "\t" << ResourceStateToString(m_io_states[i]) << endl;
+                IODevice * device = device_kvp.second;
+                cout << endl << "\t" << device->name << "\tStatus" << endl;
+
+                for (int i = 0; i < device->unit_slots.Size(); i++)
+                {
+                    cout << "\t" << i << "\t" << ResourceStateToString(device->unit_slots.IsBusy(i)) << endl;
+                }
             }
 
             cout << endl << "\tInput\tStatus" << endl;
 
-            for (int i = 0; i < MAX_INPUT; i++)
+            for (int i = 0; i < m_input_slots.Size(); i++)
+            {
+                cout << "\t" << i << "\t" << ResourceStateToString(m_input_slots.IsBusy(i)) << endl;
+            }
+
+            cout << endl;
+        }
+
+        void PrintDeviceStatistics()
+        {
+            cout << "\t-- I/O DEVICE STATISTICS --" << endl << endl;
+            cout << "\tDevice\tDiscipline\tUnits\tUtilization\tMean Queue Depth\tMax Queue Depth" << endl;
+
+            for each (auto device_kvp in m_devices)
+            {
+                IODevice * device = device_kvp.second;
+                double utilization = 0.0;
+                double mean_queue_depth = 0.0;
+
+                if (device->sampled_time > 0)
+                {
+                    utilization = 100.0 * device->busy_unit_time / (double)(device->sampled_time * device->unit_slots.Size());
+
+                    for (int depth = 0; depth < device->queue_depth_histogram.size(); depth++)
+                    {
+                        mean_queue_depth += depth * device->queue_depth_histogram[depth];
+                    }
+
+                    mean_queue_depth /= device->sampled_time;
+                }
+
+                size_t max_queue_depth = device->queue_depth_histogram.empty() ? EMPTY_QUEUE : device->queue_depth_histogram.size() - 1;
+
+                cout << "\t" << device->name << "\t" << QueueDisciplineToString(device->discipline) << "\t\t" << device->unit_slots.Size()
+                    << "\t" << utilization << "%\t\t" << mean_queue_depth << "\t\t\t" << max_queue_depth << endl;
+            }
+
+            for each (auto device_kvp in m_devices)
             {
-                cout << "\t" << i << "\t" << ResourceStateToString(m_input_states[i]) << endl;
+                IODevice * device = device_kvp.second;
+                cout << endl << "\t" << device->name << " Queue Depth Histogram" << endl;
+                cout << "\tDepth\tTime (ms)" << endl;
+
+                for (int depth = 0; depth < device->queue_depth_histogram.size(); depth++)
+                {
+                    cout << "\t" << depth << "\t" << device->queue_depth_histogram[depth] << endl;
+                }
             }
 
             cout << endl;
@@ -521,7 +1056,7 @@ private:
         }
 
         // Called periodically to ensure that the process state is always up-to-date
-        void UpdateProcessState(unsigned int process_id, TimelineState timeline_state, int resource_identifier)
+        void UpdateProcessState(unsigned int process_id, TimelineState timeline_state, int resource_identifier, string device = "")
         {
             auto it = m_process_table.find(process_id);
             bool process_exists = it != m_process_table.end();
@@ -536,6 +1071,7 @@ private:
                 process_to_update->cpu_core_used = RESOURCE_NOT_NEEDED;
                 process_to_update->input_resource_used = RESOURCE_NOT_NEEDED;
                 process_to_update->io_resource_used = RESOURCE_NOT_NEEDED;
+                process_to_update->io_device_used = "";
                 
                 if (timeline_state == TimelineState::CPU_Bound)
                 {
@@ -548,6 +1084,7 @@ private:
                 else if (timeline_state == TimelineState::IO_Bound)
                 {
                     process_to_update->io_resource_used = resource_identifier;
+                    process_to_update->io_device_used = device;
                 }
             }
         }
@@ -592,7 +1129,7 @@ private:
                 }
                 else
                 {
-                    cout << info->io_resource_used;
+                    cout << info->io_device_used << ":" << info->io_resource_used;
                 }
 
                 cout << "\t";
@@ -630,15 +1167,20 @@ private:
     ProcessManager * m_process_manager;
     vector<ProcessTimelineEntry *> m_all_proc_timeline;
     list<unsigned int> m_ready_queue;
-    list<unsigned int> m_io_queue;
     list<unsigned int> m_input_queue;
     unsigned long long m_total_length_of_timeline;
 
     // Useful debugging flags
     bool m_initialized;
 
+    // Unit counts the resource manager gets created with
+    unsigned int m_cpu_count;
+    unsigned int m_io_count;
+    unsigned int m_input_count;
+
     // Based on the data collected so far, this helper method, returns the amount of time
-    // a ready process will have to wait until it can use a CPU core.
+    // a ready process will have to wait until it can use a CPU core. I/O device waits are not
+    // predicted, they are resolved tick by tick by DispatchDeviceQueues()
     unsigned long long ComputeWaitTimeForResource(string resource, unsigned int excluded_proc_id, unsigned long long currentTime)
     {
         assert(m_all_proc_timeline.size() > 0 && "The process timeline data structure should have been initialized");
@@ -648,8 +1190,7 @@ private:
         vector<unsigned long long> wait_times;
 
         if ((resource == CPU && m_resource_manager->IsResourceAvailable(CPU)) ||
-            (resource == INPUT && m_resource_manager->IsResourceAvailable(INPUT)) ||
-            (resource == IO && m_resource_manager->IsResourceAvailable(IO)))
+            (resource == INPUT && m_resource_manager->IsResourceAvailable(INPUT)))
         {
             return NO_WAIT_TIME;
         }
@@ -705,21 +1246,6 @@ private:
                     wait_times.push_back(total_wait);
                 }
             }
-            else if (resource == IO)
-            {
-                if (current_procedure->state == TimelineState::IO_Bound)
-                {
-                    wait_times.push_back(elapsed_time - currentTime);
-                }
-                else if (current_procedure->state == TimelineState::IO_Wait)
-                {
-                    // wait time = wait time for existing waiter + resource usage time (after wait) of existing waiter
-                    unsigned long long wait_time_left_in_queue = (elapsed_time - currentTime);
-                    maximum_wait_time_for_existing_resource_waiters = max(maximum_wait_time_for_existing_resource_waiters, wait_time_left_in_queue);
-                    unsigned long long total_wait = wait_time_left_in_queue + current_procedure->next_proc->duration;
-                    wait_times.push_back(total_wait);
-                }
-            }
             else
             {
                 // Throw exception to catch implementation bugs
@@ -847,6 +1373,49 @@ private:
         return procedure;
     }
 
+    // I/O procedures run on the device named in the input, every other procedure maps onto its state's resource
+    string ProcedureToAssociatedResource(Procedure * procedure)
+    {
+        assert(procedure && "The pointer argument should not be null");
+        if (procedure->state == TimelineState::IO_Bound || procedure->state == TimelineState::IO_Wait)
+        {
+            return procedure->device;
+        }
+
+        return TimelineStateToAssociatedResourceType(procedure->state);
+    }
+
+    // Reads the operands of an I/O line, which are either "<duration>" for the default device or
+    // "<device>[@<block>] <duration>" (e.g. I/O disk0@120 40). Undeclared devices are created on first use
+    void ReadIORequest(string& device, unsigned long long& block, unsigned long long& duration)
+    {
+        string operand;
+        cin >> operand;
+
+        device = IO;
+        block = 0;
+
+        if (!operand.empty() && all_of(operand.begin(), operand.end(), ::isdigit))
+        {
+            duration = stoull(operand);
+            return;
+        }
+
+        size_t separator = operand.find(DEVICE_BLOCK_SEPARATOR);
+        device = operand.substr(0, separator);
+        if (separator != string::npos)
+        {
+            block = stoull(operand.substr(separator + 1));
+        }
+
+        cin >> duration;
+
+        if (!m_resource_manager->IsDevice(device))
+        {
+            m_resource_manager->RegisterDevice(device, QueueDiscipline::Fifo, MAX_IO);
+        }
+    }
+
     void FreeProcessTimelineEntries()
     {
         for each(ProcessTimelineEntry * entry in m_all_proc_timeline)
@@ -876,11 +1445,14 @@ private:
         --procedure_alloc_diff;
     }
 public:
-    TimelineBuilder() :
+    TimelineBuilder(unsigned int cpu_count = MAX_CPU, unsigned int io_count = MAX_IO, unsigned int input_count = MAX_INPUT) :
         m_process_manager(nullptr),
         m_resource_manager(nullptr),
         m_total_length_of_timeline(0),
-        m_initialized(false)
+        m_initialized(false),
+        m_cpu_count(cpu_count),
+        m_io_count(io_count),
+        m_input_count(input_count)
     {
 
     }
@@ -913,6 +1485,9 @@ public:
     // the data structure that is the heart of this application. Other data structures stem from this foundation. The
     // structure essentially places the process entries in sequential order in a linked list, to make it convenient
     // to traverse and make changes as needed.
+    //
+    // Besides the process keywords, the input may declare I/O devices up front with "DEVICE <name> <FIFO|SCAN|DEADLINE> <units>"
+    // and target them with "I/O <name>[@<block>] <duration>". A plain "I/O <duration>" runs on the default I/O device.
     bool Initialize()
     {
         assert(!m_initialized && "TimelineBuilder::Initialize() should not be called more than once");
@@ -921,12 +1496,43 @@ public:
         
         string keyword;
         unsigned long long value;
+        string device;
+        unsigned long long block;
 
-        cin >> keyword >> value;
+        // Devices are registered while parsing, so the resource manager has to exist up front
+        m_resource_manager = new ResourceManager(m_cpu_count, m_io_count, m_input_count);
+
+        cin >> keyword;
         while (cin)
         {
             int operating_index = m_all_proc_timeline.size() - 1;
 
+            if (keyword == DEVICE)
+            {
+                string discipline;
+                unsigned int units;
+                cin >> device >> discipline >> units;
+
+                if (cin && !m_resource_manager->RegisterDevice(device, StringToQueueDiscipline(discipline), units))
+                {
+                    cout << "Ignoring invalid device declaration: " << device << " " << discipline << " " << units << endl;
+                }
+            }
+            else if (keyword == IO)
+            {
+                ReadIORequest(device, block, value);
+            }
+            else
+            {
+                cin >> value;
+            }
+
+            // The last line was incomplete
+            if (!cin)
+            {
+                break;
+            }
+
             if (keyword == NEW)
             {
                 if (operating_index >= 0)
@@ -967,12 +1573,12 @@ public:
             else if (keyword == IO)
             {
                 Procedure* lastProcedure = TraverseToLastProcedure(m_all_proc_timeline[operating_index]->start_procedure);
-                lastProcedure->next_proc = new Procedure(TimelineState::IO_Bound, value);
+                lastProcedure->next_proc = new Procedure(TimelineState::IO_Bound, value, device, block);
                 ++procedure_alloc_diff;
                 process_elapsed_time += value;
             }
 
-            cin >> keyword >> value;
+            cin >> keyword;
         }
         
         // Remember that this function has been called
@@ -990,7 +1596,6 @@ public:
             m_all_proc_timeline[index]->total_proc_time = process_elapsed_time;
             m_total_length_of_timeline = max(m_total_length_of_timeline, process_elapsed_time);
 
-            m_resource_manager = new ResourceManager();
             m_process_manager = new ProcessManager();
         }
 
@@ -1001,7 +1606,6 @@ public:
     void ProcessTimerTick(unsigned long long elapsed_time)
     {
         queue<ProcessTimelineEntry *> delayed_schedulable_process_from_cpu_queue;
-        queue<ProcessTimelineEntry *> delayed_schedulable_process_from_io_queue;
         queue<ProcessTimelineEntry *> delayed_schedulable_process_from_input_queue;
         queue<ProcessTimelineEntry *> pending_process_queue;
         queue<ProcessTimelineEntry *> terminated_process_queue;
@@ -1039,7 +1643,7 @@ public:
                     timeline_state == TimelineState::Input_Bound ||
                     timeline_state == TimelineState::IO_Bound)
                 {
-                    string resource = TimelineStateToAssociatedResourceType(timeline_state);
+                    string resource = ProcedureToAssociatedResource(GetProcedureAtTime(entry, elapsed_time));
 
                     if (previous_procedure->state == TimelineState::Start)
                     {
@@ -1048,13 +1652,22 @@ public:
                     
                     assert(resource != "" && "The resource type for the associated timeline state should not be null");
 
-                    if (previous_procedure->state == TimelineState::CPU_Ready)
+                    if (m_resource_manager->IsDevice(resource))
                     {
-                        unsigned int process_id = m_ready_queue.front();
-                        assert(process_id == entry->process_id && "The process_id should be match the popped entry's process_id");
-                        delayed_schedulable_process_from_cpu_queue.push(entry);
-                        m_ready_queue.pop_front();
-                        
+                        IODevice * device = m_resource_manager->GetDevice(resource);
+                        assert(previous_procedure->state != TimelineState::IO_Wait && "Device waits are ended by DispatchDeviceQueues()");
+
+                        if (device->queue.empty() && m_resource_manager->IsResourceAvailable(resource))
+                        {
+                            AcquireResource(resource, entry->process_id);
+                            device->head_position = GetProcedureAtTime(entry, elapsed_time)->block;
+                        }
+                        else
+                        {
+                            // Queued requests are served in the device's queue discipline order, never bypassed
+                            WaitForResource(resource, entry, elapsed_time, previous_procedure);
+                        }
+
                         if (hijackedPointerDueToZeroIOTime)
                         {
                             entry->next_update_time += previous_procedure->next_proc->next_proc->duration;
@@ -1064,12 +1677,12 @@ public:
                             entry->next_update_time += previous_procedure->next_proc->duration;
                         }
                     }
-                    else if (previous_procedure->state == TimelineState::Input_Wait)
+                    else if (previous_procedure->state == TimelineState::CPU_Ready)
                     {
-                        unsigned int process_id = m_input_queue.front();
+                        unsigned int process_id = m_ready_queue.front();
                         assert(process_id == entry->process_id && "The process_id should be match the popped entry's process_id");
-                        delayed_schedulable_process_from_input_queue.push(entry);
-                        m_input_queue.pop_front();
+                        delayed_schedulable_process_from_cpu_queue.push(entry);
+                        m_ready_queue.pop_front();
                         
                         if (hijackedPointerDueToZeroIOTime)
                         {
@@ -1080,12 +1693,12 @@ public:
                             entry->next_update_time += previous_procedure->next_proc->duration;
                         }
                     }
-                    else if (previous_procedure->state == TimelineState::IO_Wait)
+                    else if (previous_procedure->state == TimelineState::Input_Wait)
                     {
-                        unsigned int process_id = m_io_queue.front();
+                        unsigned int process_id = m_input_queue.front();
                         assert(process_id == entry->process_id && "The process_id should be match the popped entry's process_id");
-                        delayed_schedulable_process_from_io_queue.push(entry);
-                        m_io_queue.pop_front();
+                        delayed_schedulable_process_from_input_queue.push(entry);
+                        m_input_queue.pop_front();
                         
                         if (hijackedPointerDueToZeroIOTime)
                         {
@@ -1097,14 +1710,12 @@ public:
                         }
                     }
                     else if ((resource == CPU && delayed_schedulable_process_from_cpu_queue.size() > 0) ||
-                            (resource == INPUT && delayed_schedulable_process_from_input_queue.size() > 0) ||
-                            (resource == IO && delayed_schedulable_process_from_io_queue.size() > 0))
+                            (resource == INPUT && delayed_schedulable_process_from_input_queue.size() > 0))
                     {
                         pending_process_queue.push(entry);
                     }
                     else if ((resource == CPU && m_ready_queue.size() > 0) ||
-                            (resource == INPUT && m_input_queue.size() > 0) ||
-                            (resource == IO && m_io_queue.size() > 0))
+                            (resource == INPUT && m_input_queue.size() > 0))
                     {
                         pending_process_queue.push(entry);
                     }
@@ -1157,9 +1768,9 @@ public:
 
         ProcessDelayedSchedulableQueue(delayed_schedulable_process_from_cpu_queue, elapsed_time);
         ProcessDelayedSchedulableQueue(delayed_schedulable_process_from_input_queue, elapsed_time);
-        ProcessDelayedSchedulableQueue(delayed_schedulable_process_from_io_queue, elapsed_time);
         ProcessPendingQueue(pending_process_queue, elapsed_time);
         ProcessTerminatedQueue(terminated_process_queue, elapsed_time);
+        DispatchDeviceQueues(elapsed_time);
     }
 
     void AcquireResource(string resource, unsigned int process_id)
@@ -1177,7 +1788,7 @@ public:
         {
             timeline_state = TimelineState::Input_Bound;
         }
-        else if (resource == IO)
+        else if (m_resource_manager->IsDevice(resource))
         {
             timeline_state = TimelineState::IO_Bound;
         }
@@ -1187,7 +1798,7 @@ public:
             throw new exception("Unexpected resource type");
         }
 
-        m_process_manager->UpdateProcessState(process_id, timeline_state, resource_identifier);
+        m_process_manager->UpdateProcessState(process_id, timeline_state, resource_identifier, resource);
     }
 
     void ReleaseResourceIfAny(Procedure * completed_procedure, unsigned int process_id)
@@ -1223,8 +1834,9 @@ public:
         // No-op if no resource was found
         if (resource_id != RESOURCE_NOT_NEEDED)
         {
-            string resource = TimelineStateToAssociatedResourceType(procedure_state);
+            string resource = ProcedureToAssociatedResource(completed_procedure);
             m_resource_manager->ReleaseResource(resource, (unsigned int)resource_id);
+            completed_procedure->resource_identifier = resource_id;
             UpdateResourceUsageTime(procedure_state, process_id);
         }
     }
@@ -1236,6 +1848,29 @@ public:
             most_recently_completed_procedure = GetMostRecentlyCompletedProcedureAtOrBeforeTime(entry, current_time);
         }
 
+        // Device waits are not predicted up front. The wait starts out one tick long and DispatchDeviceQueues()
+        // grows it by a tick for every tick the request is passed over, so the device's queue discipline decides
+        // when it ends
+        if (m_resource_manager->IsDevice(resource))
+        {
+            Procedure * io_procedure = GetProcedureAtTime(entry, current_time);
+            Procedure * wait_procedure = new Procedure(TimelineState::IO_Wait, 1, resource, io_procedure->block);
+            ++procedure_alloc_diff;
+            Procedure * previous_next_procedure = most_recently_completed_procedure->next_proc;
+            most_recently_completed_procedure->next_proc = wait_procedure;
+            wait_procedure->next_proc = previous_next_procedure;
+
+            entry->total_proc_time += wait_procedure->duration;
+            m_total_length_of_timeline = max(m_total_length_of_timeline, entry->total_proc_time);
+
+            DeviceRequest request = { entry, wait_procedure, wait_procedure->block, current_time };
+            m_resource_manager->GetDevice(resource)->queue.push_back(request);
+
+            m_process_manager->UpdateProcessState(entry->process_id, TimelineState::IO_Wait, RESOURCE_UNAVAILABLE);
+
+            return true;
+        }
+
         if (resource == CPU)
         {
             m_ready_queue.push_back(entry->process_id);
@@ -1244,10 +1879,6 @@ public:
         {
             m_input_queue.push_back(entry->process_id);
         }
-        else if (resource == IO)
-        {
-            m_io_queue.push_back(entry->process_id);
-        }
         else
         {
             // Throw exception to catch implementation bugs
@@ -1267,10 +1898,6 @@ public:
             {
                 m_input_queue.pop_back();
             }
-            else if (resource == IO)
-            {
-                m_io_queue.pop_back();
-            }
             else
             {
                 // Throw exception to catch implementation bugs
@@ -1290,10 +1917,6 @@ public:
         {
             wait_state = TimelineState::Input_Wait;
         }
-        else if (resource == IO)
-        {
-            wait_state = TimelineState::IO_Wait;
-        }
         else
         {
             // Throw exception to catch implementation bugs
@@ -1314,6 +1937,65 @@ public:
         return true;
     }
 
+    // Runs at the end of every tick, once all units released during the tick are back. Every idle device unit is handed
+    // to the request its device's queue discipline picks, and that request's wait is trimmed to end at the current tick.
+    // Requests that are passed over wait one more tick. Also samples the per-device statistics.
+    void DispatchDeviceQueues(unsigned long long time)
+    {
+        bool wait_trimmed = false;
+
+        for each (auto device_kvp in m_resource_manager->GetDevices())
+        {
+            IODevice * device = device_kvp.second;
+            DeviceRequest request;
+
+            while (m_resource_manager->IsResourceAvailable(device->name) && m_resource_manager->PopNextDeviceRequest(device, time, request))
+            {
+                int resource_id = m_resource_manager->RequestResource(device->name);
+                assert(resource_id != RESOURCE_UNAVAILABLE && "The device should have an idle unit to hand out");
+
+                // The wait currently runs through the end of this tick. Trim it so the I/O starts now, the same way
+                // a process that finds an idle unit starts right away
+                Procedure * io_procedure = request.wait_procedure->next_proc;
+                assert(io_procedure && io_procedure->state == TimelineState::IO_Bound && "A device wait should be followed by its I/O request");
+                --request.wait_procedure->duration;
+                --request.entry->total_proc_time;
+                request.entry->next_update_time = time + io_procedure->duration;
+                wait_trimmed = true;
+
+                m_process_manager->UpdateProcessState(request.entry->process_id, TimelineState::IO_Bound, resource_id, device->name);
+            }
+
+            for (auto it = device->queue.begin(); it != device->queue.end(); ++it)
+            {
+                ++it->wait_procedure->duration;
+                ++it->entry->total_proc_time;
+                ++it->entry->next_update_time;
+                m_total_length_of_timeline = max(m_total_length_of_timeline, it->entry->total_proc_time);
+            }
+
+            size_t queue_depth = device->queue.size();
+            if (device->queue_depth_histogram.size() <= queue_depth)
+            {
+                device->queue_depth_histogram.resize(queue_depth + 1, 0);
+            }
+
+            ++device->queue_depth_histogram[queue_depth];
+            device->busy_unit_time += device->unit_slots.InService();
+            ++device->sampled_time;
+        }
+
+        // A trimmed wait might have belonged to the process that ends last
+        if (wait_trimmed)
+        {
+            m_total_length_of_timeline = 0;
+            for each (ProcessTimelineEntry * entry in m_all_proc_timeline)
+            {
+                m_total_length_of_timeline = max(m_total_length_of_timeline, entry->total_proc_time);
+            }
+        }
+    }
+
     void ProcessDelayedSchedulableQueue(queue<ProcessTimelineEntry *>& entries, unsigned long long time)
     {
         while (!entries.empty())
@@ -1398,29 +2080,39 @@ public:
         
         cout << endl << endl;
 
-        cout << "\tI/O Queue" << endl;
-        size_of_queue = m_io_queue.size();
-        cout << "\t";
-        i = 1;
-
-        if (size_of_queue == EMPTY_QUEUE)
-        {
-            cout << "<Empty>";
-        }
-        else
+        // Device queues are listed in arrival order; the device's discipline decides the service order
+        for each (auto device_kvp in m_resource_manager->GetDevices())
         {
-            for each (auto pid in m_io_queue)
+            IODevice * device = device_kvp.second;
+            cout << "\t" << device->name << " Queue (" << QueueDisciplineToString(device->discipline) << ")" << endl;
+            size_of_queue = device->queue.size();
+            cout << "\t";
+            i = 1;
+
+            if (size_of_queue == EMPTY_QUEUE)
             {
-                cout << "(" << i << ") PID " << pid;
-                if (i < size_of_queue)
+                cout << "<Empty>";
+            }
+            else
+            {
+                for each (auto request in device->queue)
                 {
-                    cout << "  <<  ";
+                    cout << "(" << i << ") PID " << request.entry->process_id;
+                    if (request.block != 0)
+                    {
+                        cout << " @" << request.block;
+                    }
+
+                    if (i < size_of_queue)
+                    {
+                        cout << "  <<  ";
+                    }
+                    i++;
                 }
-                i++;
             }
-        }
 
-        cout << endl << endl;
+            cout << endl << endl;
+        }
 
         cout << "\tInput Queue" << endl;
         size_of_queue = m_input_queue.size();
@@ -1458,6 +2150,41 @@ public:
         m_process_manager->PrintCurrentProcessReport();
     }
 
+    // Hands every procedure of the completed simulation over to the index, so the run can still be
+    // queried once the timeline is freed
+    void BuildSimulationIndex(SimulationIndex& index)
+    {
+        assert(m_initialized && "TimelineBuilder::BuildSimulationIndex() should be called after the builder has been initialized");
+
+        for each (ProcessTimelineEntry * entry in m_all_proc_timeline)
+        {
+            // The start procedure only marks when the process gets loaded
+            unsigned long long time = entry->start_procedure->duration;
+            Procedure * procedure = entry->start_procedure->next_proc;
+
+            while (procedure != nullptr)
+            {
+                string resource = ProcedureToAssociatedResource(procedure);
+                if (resource != "")
+                {
+                    index.AddInterval(resource, entry->process_id, procedure->state, procedure->resource_identifier, time, time + procedure->duration);
+                }
+
+                time += procedure->duration;
+                procedure = procedure->next_proc;
+            }
+        }
+
+        index.Build();
+    }
+
+    // Utilization and queue depth histograms for every I/O device, over the whole simulation
+    void PrintDeviceStatistics()
+    {
+        assert(m_initialized && "TimelineBuilder::PrintDeviceStatistics() should be called after the builder has been initialized");
+        m_resource_manager->PrintDeviceStatistics();
+    }
+
     void UpdateResourceUsageTime(TimelineState timeline_state, unsigned int process_id)
     {
         if (timeline_state == TimelineState::CPU_Bound)
@@ -1482,12 +2209,40 @@ public:
 };
 
 void WaitForNextSample();
-int main()
+
+// Usage: process_scheduler [--topology <cpus> <io units> <input units>] [query_file] < input_file
+// When a query file is given, its queries are answered against the completed simulation (see SimulationIndex::RunQueries())
+int main(int argc, char* argv[])
 {
+    unsigned int cpu_count = MAX_CPU;
+    unsigned int io_count = MAX_IO;
+    unsigned int input_count = MAX_INPUT;
+    const char* query_file = nullptr;
+
+    int arg = 1;
+    if (arg + 3 < argc && string(argv[arg]) == "--topology")
+    {
+        cpu_count = strtoul(argv[arg + 1], NULL, 0);
+        io_count = strtoul(argv[arg + 2], NULL, 0);
+        input_count = strtoul(argv[arg + 3], NULL, 0);
+        arg += 4;
+    }
+
+    if (arg < argc)
+    {
+        query_file = argv[arg++];
+    }
+
+    if (arg < argc || cpu_count == 0 || io_count == 0 || input_count == 0)
+    {
+        cout << "Usage: " << argv[0] << " [--topology <cpus> <io units> <input units>] [query_file] < input_file" << endl;
+        return -1;
+    }
+
     {
         cout << endl;
 
-        TimelineBuilder timelineBuilder;
+        TimelineBuilder timelineBuilder(cpu_count, io_count, input_count);
 
         // On-demand population (or parsing) of the input provided by the user.
         if (!timelineBuilder.Initialize())
@@ -1517,6 +2272,22 @@ int main()
                 simulation_complete = true;
             }
         }
+
+        timelineBuilder.PrintDeviceStatistics();
+
+        if (query_file != nullptr)
+        {
+            ifstream queries(query_file);
+            if (!queries)
+            {
+                cout << "Could not open query file: " << query_file << endl;
+                return -1;
+            }
+
+            SimulationIndex simulationIndex;
+            timelineBuilder.BuildSimulationIndex(simulationIndex);
+            simulationIndex.RunQueries(queries);
+        }
     }
 
     return 0;
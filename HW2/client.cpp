@@ -4,31 +4,879 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <iostream>
 #include <assert.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <random>
+#include <algorithm>
+
+#include "plaza_protocol.h"
+#include "timer_wheel.h"
 
 using namespace std;
 
 #define PORTNUM 50000
+#define FIRST_RETRANSMIT_TIMEOUT    100     // milliseconds, doubled after every retransmission
+#define MAX_RETRANSMIT_TIMEOUT      2000    // milliseconds
+#define MAX_DEPARTURE_RETRANSMITS   10      // the server evicts people whose departure never arrives
 
-// Helper method to simulate time delay
-void Delay(double delayInSeconds)
+#define MAX_LOAD_SOCKETS            64
+#define LOAD_DATAGRAMS_PER_WAKEUP   64
+#define LOAD_TIMER_SLOTS            4096
+#define LOAD_TIMER_TICK             1000    // microseconds
+#define LOAD_DRAIN_TIME             10      // seconds the load generator waits for the last people to leave
+
+#define SERVER_START_ATTEMPTS       50      // stats queries sent to a server started with --server before giving up
+#define SERVER_START_POLL           100     // milliseconds each of them waits for the answer
+#define BASELINE_LATENCY_SLACK      100     // microseconds a latency may exceed its baseline limit, against timer noise
+#define BASELINE_COUNT_SLACK        0.001   // fraction of the messages sent that drops may exceed their baseline limit
+
+bool use_text_protocol = false; // --text: speak the original "A Romeo Montague" protocol
+uint32_t plaza_id = 0;          // --plaza: the plaza everybody in the input goes to
+double loss_percent = 0;        // --loss: percentage of received ACKs to drop, for testing the retransmissions
+
+// Load generator mode (--load): simulated people arrive at the given rate, spread over a few sockets
+bool query_stats = false;       // --stats: print the server's stats instead of sending people
+double time_scale = 1;          // --time-scale: seconds of real time per second of input time, to replay faster or slower
+
+double load_rate = 0;           // --load: arrivals per second, as a Poisson process, 0 to read people from stdin
+double load_duration = 10;      // --duration: seconds to keep people arriving
+int load_sockets = 4;           // --sockets
+bool use_tcp = false;           // --tcp: multiplex the people over --sockets persistent TCP connections
+double load_stay = 100;         // --stay: mean milliseconds a person spends in the plaza, exponentially distributed
+uint32_t load_plazas = 1;       // --plazas: people pick a plaza at random from plaza_id up
+double load_montagues = 50;     // --montagues: percentage of the people who are Montagues
+uint64_t load_seed = 0;         // --seed: makes the generated trace repeatable, 0 for a different one every run
+string trace_path;              // --trace: replay the arrivals recorded in this file instead of generating them
+string record_path;             // --record: write the arrivals of the run to this file
+string server_command;          // --server: start this server command for the run and stop it afterwards
+string baseline_path;           // --baseline: fail when the results regress against this file
+string save_baseline_path;      // --save-baseline: write the results to this file as the new baseline
+double baseline_tolerance = 10; // --tolerance: percentage a result may be worse than its baseline
+
+enum LoadState : uint8_t
+{
+    Arriving,       // waiting for the entry ACK
+    Inside,
+    Departing,      // waiting for the departure ACK
+    Done
+};
+
+// The start of a message split between two reads of a TCP connection
+struct StreamPartial
+{
+    char bytes[PLAZA_MESSAGE_SIZE];
+    size_t length;
+};
+
+// One arrival of a load trace. Generated traces and trace files are the same list, so a recorded run replays
+// exactly
+struct TraceArrival
+{
+    double time;                // seconds from the start of the run
+    double stay;                // seconds in the plaza
+    uint32_t plaza_id;
+    PlazaFamily family;
+};
+
+// What a load run measured, for the report and the baseline
+struct LoadResults
+{
+    double arrival_rate;        // arrivals per second
+    double latencies[4];        // microseconds: p50, p99, p99.9 and max of the admission latency
+    unsigned long messages_sent;
+    long dropped;               // datagrams the server did not receive, -1 when it did not answer the stats query
+    unsigned long given_up;     // people who gave up their departure or never finished
+    unsigned long rejected;     // people the server turned away
+};
+
+// A simulated person of the load generator. Its timer is either the departure or the next retransmission,
+// whichever the state calls for; a timer whose deadline does not match the person's is stale
+struct LoadPerson
+{
+    uint64_t first_sent;        // microseconds
+    uint64_t deadline;          // microseconds
+    uint32_t plaza_id;
+    uint32_t timeout;           // microseconds until the next retransmission
+    uint16_t attempts;
+    PlazaFamily family;
+    LoadState state;
+};
+
+// Sends an arrival, departure or exit message to the server in the protocol in use
+int SendPlazaMessage(int s, char type, string person, string family, uint32_t sequence, struct sockaddr_in * server)
+{
+    if (use_text_protocol)
+    {
+        string message = string(1, type) + " " + person + " " + family + " " + to_string(plaza_id);
+        return sendto(s, message.c_str(), message.length(), 0, (struct sockaddr *)server, sizeof(sockaddr_in));
+    }
+
+    PlazaMessage message;
+    EncodePlazaMessage(&message, type, PlazaFamilyFromName(family), PlazaPersonIdFromName(person), sequence, plaza_id);
+    return sendto(s, &message, sizeof(message), 0, (struct sockaddr *)server, sizeof(sockaddr_in));
+}
+
+// Sends a message and waits for the server's ACK of that message, resending it with the same sequence number
+// whenever the ACK takes too long. An arrival is resent for as long as it takes, since the person may have to
+// wait for the other family; a departure is given up on after MAX_DEPARTURE_RETRANSMITS. ACKs for other
+// messages are ignored. The text protocol has no sequence numbers, so it sends once and waits for the 'E' only.
+// An arrival the server rejects is not resent. Returns 0 once acknowledged and -1 on failure
+int SendReliably(int s, char type, char ack_type, string person, string family, uint32_t sequence, struct sockaddr_in * server)
+{
+    int timeout = FIRST_RETRANSMIT_TIMEOUT;
+    uint64_t person_id = PlazaPersonIdFromName(person);
+
+    for (int attempt = 0; type == PLAZA_ARRIVAL || attempt <= MAX_DEPARTURE_RETRANSMITS; attempt++)
+    {
+        if (SendPlazaMessage(s, type, person, family, sequence, server) < 0)
+        {
+            fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (use_text_protocol && type != PLAZA_ARRIVAL)
+        {
+            return 0;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        while (true)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+
+            // The text protocol is never resent
+            struct pollfd fd = { s, POLLIN, 0 };
+            int ready = poll(&fd, 1, use_text_protocol ? -1 : (elapsed < timeout ? timeout - elapsed : 0));
+            if (ready < 0 && errno == EINTR)
+            {
+                // A signal is not a timeout, so the message is not resent: poll again for the time that is left
+                continue;
+            }
+            else if (ready < 0)
+            {
+                fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+                return -1;
+            }
+            else if (ready == 0)
+            {
+                break;
+            }
+
+            alignas(8) char ack_message[PLAZA_MESSAGE_SIZE];
+            int ack_length = recv(s, ack_message, sizeof(ack_message), 0);
+            if (ack_length < 0)
+            {
+                fprintf(stderr, "recvfrom() did not get a valid message: %s\n", strerror(errno));
+                return -1;
+            }
+            else if (DropDatagram(loss_percent))
+            {
+                continue;
+            }
+            else if (use_text_protocol)
+            {
+                string message = "Unexpected ACK message from server: " + string(1, ack_message[0]);
+                assert((ack_message[0] == PLAZA_ENTRY_ACK || ack_message[0] == PLAZA_REJECT) && message.c_str());
+                if (ack_message[0] == PLAZA_ENTRY_ACK)
+                {
+                    return 0;
+                }
+
+                fprintf(stderr, "%s %s was turned away by the server\n", family.c_str(), person.c_str());
+                errno = EBUSY;
+                return -1;
+            }
+
+            const PlazaMessage * ack = DecodePlazaMessage(ack_message, ack_length);
+            assert(ack != NULL && (ack->type == PLAZA_ENTRY_ACK || ack->type == PLAZA_DEPARTURE_ACK || ack->type == PLAZA_REJECT) && "Unexpected ACK message from server");
+            assert(PlazaPersonId(ack) == person_id && "The server acknowledged somebody else");
+
+            // A late ACK of an earlier message
+            if (ack->type == ack_type && PlazaSequence(ack) == sequence)
+            {
+                return 0;
+            }
+            else if (ack->type == PLAZA_REJECT && PlazaSequence(ack) == sequence)
+            {
+                fprintf(stderr, "%s %s was turned away by the server\n", family.c_str(), person.c_str());
+                errno = EBUSY;
+                return -1;
+            }
+        }
+
+        timeout = timeout * 2 < MAX_RETRANSMIT_TIMEOUT ? timeout * 2 : MAX_RETRANSMIT_TIMEOUT;
+    }
+
+    fprintf(stderr, "%s %s got no ACK from the server\n", family.c_str(), person.c_str());
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// Asks the server for its stats, the JSON text it answers with. The server only answers queries from its own host
+int FetchStats(in_addr_t server_addr, string& json, int timeout)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s == -1)
+    {
+        fprintf(stderr, "socket() Socket was not created: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORTNUM);
+    server.sin_addr.s_addr = server_addr;
+
+    if (SendPlazaMessage(s, PLAZA_STATS_QUERY, "Dummy", "Dummy", 0, &server) < 0)
+    {
+        fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    struct pollfd fd = { s, POLLIN, 0 };
+    if (poll(&fd, 1, timeout) <= 0)
+    {
+        close(s);
+        return -1;
+    }
+
+    char stats[65536];
+    int stats_length = recv(s, stats, sizeof(stats) - 1, 0);
+    close(s);
+    if (stats_length < 0)
+    {
+        return -1;
+    }
+
+    stats[stats_length] = '\0';
+    json = stats;
+    return 0;
+}
+
+// Prints the server's stats
+int QueryStats(in_addr_t server_addr)
+{
+    string json;
+    if (FetchStats(server_addr, json, MAX_RETRANSMIT_TIMEOUT) < 0)
+    {
+        fprintf(stderr, "The server did not answer the stats query\n");
+        return -1;
+    }
+
+    cout << json << flush;
+    return 0;
+}
+
+// Reads a top level number out of the stats JSON. Returns -1 when it is not there
+double StatsValue(const string& json, const char * name)
+{
+    string key = string("\"") + name + "\":";
+    size_t position = json.find(key);
+    return position == string::npos ? -1 : atof(json.c_str() + position + key.length());
+}
+
+// Messages the server has received so far, -1 when it does not answer
+long ServerMessagesReceived(in_addr_t server_addr)
+{
+    string json;
+    return FetchStats(server_addr, json, MAX_RETRANSMIT_TIMEOUT) < 0 ? -1 : (long) StatsValue(json, "messages_received");
+}
+
+// Starts the server command for a benchmark run, with its output thrown away, and waits until it answers stats
+// queries. Returns the server's process id, or -1 when it does not come up
+pid_t StartServer(in_addr_t server_addr)
+{
+    // The server sockets share their port, so a server that is still running would take half of the traffic
+    string json;
+    if (FetchStats(server_addr, json, SERVER_START_POLL) == 0)
+    {
+        fprintf(stderr, "A server is already running on port %d\n", PORTNUM);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", ("exec " + server_command).c_str(), (char *) NULL);
+        fprintf(stderr, "Failed to start the server: %s\n", strerror(errno));
+        _exit(1);
+    }
+    else if (pid < 0)
+    {
+        fprintf(stderr, "Failed to fork new process: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < SERVER_START_ATTEMPTS; attempt++)
+    {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid)
+        {
+            fprintf(stderr, "The server exited before it was ready\n");
+            return -1;
+        }
+
+        if (FetchStats(server_addr, json, SERVER_START_POLL) == 0)
+        {
+            return pid;
+        }
+    }
+
+    fprintf(stderr, "The server did not answer within %d ms\n", SERVER_START_ATTEMPTS * SERVER_START_POLL);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+void StopServer(pid_t pid)
 {
-    clock_t before = clock();
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+uint64_t NowMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// Load generator person ids are the person's index in the table, tagged with the process id so that
+// several load generators can share a server
+uint64_t LoadPersonId(unsigned int index)
+{
+    return ((uint64_t) getpid() << 32) | (index + 1);
+}
+
+int SendLoadMessage(int s, char type, const LoadPerson& person, unsigned int index, uint32_t sequence)
+{
+    PlazaMessage message;
+    EncodePlazaMessage(&message, type, person.family, LoadPersonId(index), sequence, person.plaza_id);
+    return send(s, &message, sizeof(message), MSG_NOSIGNAL);
+}
+
+// Reads a TCP connection into buffer, after the start of a message the last call left over, and returns the
+// number of whole messages at the start of the buffer. What follows them is kept in partial for the next call.
+// Returns -1 with errno EAGAIN when there is nothing to read, and ECONNRESET when the server hung up
+int ReceiveStream(int s, char * buffer, size_t size, StreamPartial& partial)
+{
+    memcpy(buffer, partial.bytes, partial.length);
+    size_t length = partial.length;
+
     while (true)
     {
-        clock_t now = clock();
-        double time = (now - before) / (double)CLOCKS_PER_SEC;
+        ssize_t received = recv(s, buffer + length, size - length, MSG_DONTWAIT);
+        if (received == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        else if (received < 0)
+        {
+            return -1;
+        }
 
-        // Break out of loop, if approximately one ms has elapsed;
-        if (time >= delayInSeconds)
+        length += received;
+        int message_count = length / PLAZA_MESSAGE_SIZE;
+        partial.length = length - message_count * PLAZA_MESSAGE_SIZE;
+        memcpy(partial.bytes, buffer + message_count * PLAZA_MESSAGE_SIZE, partial.length);
+        if (message_count > 0)
         {
-            break;
+            return message_count;
+        }
+    }
+}
+
+// Builds the arrivals of a load run: read from --trace, or generated as a Poisson process at load_rate per second
+// for load_duration seconds, with exponentially distributed stays. The same seed gives the same trace. With
+// --record the trace is written out as well, one "<time s> <family> <plaza id> <stay s>" line per arrival
+int MakeLoadTrace(vector<TraceArrival>& trace)
+{
+    if (!trace_path.empty())
+    {
+        ifstream trace_file(trace_path.c_str());
+        if (!trace_file)
+        {
+            fprintf(stderr, "Failed to open the trace %s\n", trace_path.c_str());
+            return -1;
+        }
+
+        TraceArrival arrival;
+        string family;
+        while (trace_file >> arrival.time >> family >> arrival.plaza_id >> arrival.stay)
+        {
+            arrival.family = PlazaFamilyFromName(family);
+            if (arrival.family == NoFamily || (!trace.empty() && arrival.time < trace.back().time))
+            {
+                fprintf(stderr, "The trace %s is not a list of arrivals in time order\n", trace_path.c_str());
+                return -1;
+            }
+            trace.push_back(arrival);
+        }
+    }
+    else
+    {
+        mt19937_64 generator(load_seed != 0 ? load_seed : getpid() ^ NowMicroseconds());
+        exponential_distribution<double> interarrival(load_rate);
+        exponential_distribution<double> stay(1000.0 / load_stay);
+        uniform_int_distribution<uint32_t> plaza_choice(0, load_plazas - 1);
+        uniform_real_distribution<double> family_choice(0, 100);
+
+        trace.reserve(load_rate * load_duration * 1.1 + 16);
+        for (double time = interarrival(generator); time < load_duration; time += interarrival(generator))
+        {
+            TraceArrival arrival;
+            arrival.time = time;
+            arrival.family = family_choice(generator) < load_montagues ? Montague : Capulet;
+            arrival.plaza_id = plaza_id + plaza_choice(generator);
+            arrival.stay = load_stay > 0 ? stay(generator) : 0;
+            trace.push_back(arrival);
         }
     }
+
+    if (!record_path.empty())
+    {
+        FILE * record_file = fopen(record_path.c_str(), "w");
+        if (record_file == NULL)
+        {
+            fprintf(stderr, "Failed to create %s: %s\n", record_path.c_str(), strerror(errno));
+            return -1;
+        }
+
+        for (size_t i = 0; i < trace.size(); i++)
+        {
+            fprintf(record_file, "%.6f %s %u %.6f\n", trace[i].time, PlazaFamilyName(trace[i].family).c_str(), trace[i].plaza_id, trace[i].stay);
+        }
+        fclose(record_file);
+    }
+
+    return 0;
+}
+
+// Open-loop load generator: the people of the trace arrive at their time whatever the server does, go through the
+// same arrive - enter - depart cycle with retransmissions as the forked clients, and are multiplexed over
+// load_sockets sockets by one event loop, or TCP connections with --tcp, which need no retransmissions.
+// --time-scale stretches or squeezes the trace. Retransmissions and departures are driven by a timer wheel. Prints
+// the achieved rates, the admission latency percentiles (first arrival sent to entry ACK received) and the
+// datagrams the server never got, and returns them in results
+int RunLoadGenerator(in_addr_t server_addr, const vector<TraceArrival>& trace, LoadResults& results)
+{
+    int sockets[MAX_LOAD_SOCKETS];
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        fprintf(stderr, "epoll_create1() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORTNUM);
+    server.sin_addr.s_addr = server_addr;
+
+    // Messages on a connection are sent with blocking send()s, so none is ever cut short. Receiving never blocks
+    StreamPartial stream_partials[MAX_LOAD_SOCKETS];
+    for (int i = 0; i < load_sockets; i++)
+    {
+        sockets[i] = socket(AF_INET, use_tcp ? SOCK_STREAM : SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (sockets[i] == -1)
+        {
+            fprintf(stderr, "socket() Socket was not created: %s\n", strerror(errno));
+            return -1;
+        }
+
+        // A connected socket only receives from the server and needs no address per send
+        if (connect(sockets[i], (struct sockaddr *)&server, sizeof(server)) < 0)
+        {
+            fprintf(stderr, "connect() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (use_tcp)
+        {
+            const int optVal = 1;
+            setsockopt(sockets[i], IPPROTO_TCP, TCP_NODELAY, (void*)&optVal, sizeof(optVal));
+            stream_partials[i].length = 0;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockets[i], &event) < 0)
+        {
+            fprintf(stderr, "epoll_ctl() failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    vector<LoadPerson> people;
+    vector<uint32_t> latencies;     // microseconds
+    vector<TimerWheel::Timer> expired;
+    people.reserve(trace.size());
+    latencies.reserve(trace.size());
+
+    // Messages the server got before the run, to tell how many of the run's it never got
+    long server_messages = ServerMessagesReceived(server_addr);
+
+    double trace_duration = trace.empty() ? 0 : trace.back().time;
+    uint64_t start = NowMicroseconds();
+    uint64_t arrivals_end = start + trace_duration * time_scale * 1000000.0;
+    uint64_t drain_end = arrivals_end + LOAD_DRAIN_TIME * 1000000ULL;
+    TimerWheel timers(LOAD_TIMER_SLOTS, LOAD_TIMER_TICK, start);
+
+    unsigned long active = 0, messages_sent = 0, retransmissions = 0, acks_received = 0, departed = 0, given_up = 0, rejected = 0;
+
+    // Datagrams are received one per buffer, the stream of a connection into all of them
+    alignas(8) char messages[LOAD_DATAGRAMS_PER_WAKEUP][PLAZA_MESSAGE_SIZE];
+    struct iovec message_iovecs[LOAD_DATAGRAMS_PER_WAKEUP];
+    struct mmsghdr message_headers[LOAD_DATAGRAMS_PER_WAKEUP];
+    for (int i = 0; i < LOAD_DATAGRAMS_PER_WAKEUP; i++)
+    {
+        message_iovecs[i].iov_base = messages[i];
+        message_iovecs[i].iov_len = PLAZA_MESSAGE_SIZE;
+        memset(&message_headers[i], 0, sizeof(message_headers[i]));
+        message_headers[i].msg_hdr.msg_iov = &message_iovecs[i];
+        message_headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t now = start;
+    while (now < drain_end && (people.size() < trace.size() || active > 0))
+    {
+        // Start everybody whose arrival time has come, whatever state the server is in
+        while (people.size() < trace.size() && start + trace[people.size()].time * time_scale * 1000000.0 <= now)
+        {
+            unsigned int index = people.size();
+            LoadPerson person;
+            person.first_sent = now;
+            person.plaza_id = trace[index].plaza_id;
+            person.family = trace[index].family;
+            person.state = Arriving;
+            person.attempts = 1;
+            person.timeout = FIRST_RETRANSMIT_TIMEOUT * 1000;
+            person.deadline = now + person.timeout;
+            people.push_back(person);
+
+            if (SendLoadMessage(sockets[index % load_sockets], PLAZA_ARRIVAL, person, index, 1) < 0 && errno != EAGAIN)
+            {
+                fprintf(stderr, "send() failed: %s\n", strerror(errno));
+                return -1;
+            }
+
+            messages_sent++;
+            active++;
+            if (!use_tcp)
+            {
+                timers.Schedule(index, person.deadline);
+            }
+        }
+
+        expired.clear();
+        timers.Advance(now, expired);
+        for (size_t i = 0; i < expired.size(); i++)
+        {
+            unsigned int index = expired[i].id;
+            LoadPerson& person = people[index];
+            if (person.state == Done || person.deadline != expired[i].deadline)
+            {
+                continue;
+            }
+
+            int s = sockets[index % load_sockets];
+            if (person.state == Inside)
+            {
+                person.state = Departing;
+                person.attempts = 0;
+                person.timeout = FIRST_RETRANSMIT_TIMEOUT * 1000;
+            }
+            else if (person.state == Departing && person.attempts > MAX_DEPARTURE_RETRANSMITS)
+            {
+                person.state = Done;
+                active--;
+                given_up++;
+                continue;
+            }
+            else
+            {
+                person.timeout = min(person.timeout * 2, MAX_RETRANSMIT_TIMEOUT * 1000U);
+                retransmissions++;
+            }
+
+            char type = person.state == Arriving ? PLAZA_ARRIVAL : PLAZA_DEPARTURE;
+            if (SendLoadMessage(s, type, person, index, person.state == Arriving ? 1 : 2) < 0 && errno != EAGAIN)
+            {
+                fprintf(stderr, "send() failed: %s\n", strerror(errno));
+                return -1;
+            }
+
+            messages_sent++;
+            person.attempts++;
+            person.deadline = now + person.timeout;
+            if (!use_tcp)
+            {
+                timers.Schedule(index, person.deadline);
+            }
+        }
+
+        // Sleep until the next arrival or timer tick, whichever is first
+        uint64_t wait = timers.Empty() ? drain_end - now : timers.TimeToNextTick(now);
+        if (people.size() < trace.size())
+        {
+            uint64_t next_arrival = start + trace[people.size()].time * time_scale * 1000000.0;
+            wait = min(wait, next_arrival > now ? next_arrival - now : 0);
+        }
+
+        struct epoll_event events[MAX_LOAD_SOCKETS];
+        int ready_count = epoll_wait(epoll_fd, events, MAX_LOAD_SOCKETS, (wait + 999) / 1000);
+        if (ready_count < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        now = NowMicroseconds();
+        for (int i = 0; i < ready_count; i++)
+        {
+            int socket_index = events[i].data.u32;
+            int message_count;
+            while ((message_count = use_tcp ?
+                    ReceiveStream(sockets[socket_index], messages[0], sizeof(messages), stream_partials[socket_index]) :
+                    recvmmsg(sockets[socket_index], message_headers, LOAD_DATAGRAMS_PER_WAKEUP, 0, NULL)) > 0)
+            {
+                for (int j = 0; j < message_count; j++)
+                {
+                    const PlazaMessage * ack = use_tcp ?
+                        DecodePlazaMessage(messages[0] + j * PLAZA_MESSAGE_SIZE, PLAZA_MESSAGE_SIZE) :
+                        DecodePlazaMessage(messages[j], message_headers[j].msg_len);
+                    // Nothing retransmits over TCP, so the loss shim leaves connections alone
+                    if (ack == NULL || (!use_tcp && DropDatagram(loss_percent)))
+                    {
+                        continue;
+                    }
+
+                    acks_received++;
+                    uint64_t person_id = PlazaPersonId(ack);
+                    unsigned int index = (uint32_t) person_id - 1;
+                    if ((person_id >> 32) != (uint64_t) getpid() || index >= people.size())
+                    {
+                        continue;
+                    }
+
+                    LoadPerson& person = people[index];
+                    if (person.state == Arriving && ack->type == PLAZA_ENTRY_ACK && PlazaSequence(ack) == 1)
+                    {
+                        latencies.push_back(now - person.first_sent);
+                        person.state = Inside;
+                        person.deadline = now + trace[index].stay * time_scale * 1000000.0;
+                        timers.Schedule(index, person.deadline);
+                    }
+                    else if (person.state == Departing && ack->type == PLAZA_DEPARTURE_ACK && PlazaSequence(ack) == 2)
+                    {
+                        person.state = Done;
+                        active--;
+                        departed++;
+                    }
+                    else if (person.state == Arriving && ack->type == PLAZA_REJECT && PlazaSequence(ack) == 1)
+                    {
+                        person.state = Done;
+                        active--;
+                        rejected++;
+                    }
+                }
+            }
+
+            if (message_count < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                fprintf(stderr, "Receiving the ACKs failed: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+    }
+
+    double elapsed = (now - start) / 1000000.0;
+    double arrival_time = max((min(now, arrivals_end) - start) / 1000000.0, 0.000001);
+    sort(latencies.begin(), latencies.end());
+
+    if (server_messages >= 0)
+    {
+        long server_messages_after = ServerMessagesReceived(server_addr);
+        server_messages = server_messages_after < 0 ? -1 : server_messages_after - server_messages;
+    }
+
+    results.arrival_rate = people.size() / arrival_time;
+    results.messages_sent = messages_sent;
+    results.dropped = server_messages < 0 ? -1 : max((long) messages_sent - server_messages, 0L);
+    results.given_up = given_up + active;
+    results.rejected = rejected;
+
+    if (trace_path.empty())
+    {
+        cout << "Offered " << load_rate << " arrivals/s for " << load_duration << " s over " << load_sockets << (use_tcp ? " connections and " : " sockets and ")
+             << load_plazas << " plazas" << endl;
+    }
+    else
+    {
+        cout << "Replayed " << trace.size() << " arrivals of " << trace_path << " over " << trace_duration * time_scale << " s and "
+             << load_sockets << (use_tcp ? " connections" : " sockets") << endl;
+    }
+    cout << "Arrivals " << people.size() << " (" << (unsigned long) results.arrival_rate << "/s), entered "
+         << latencies.size() << ", departed " << departed << ", rejected " << rejected << ", gave up " << given_up << ", unfinished " << active << endl;
+    cout << "Messages sent " << messages_sent << " (" << (unsigned long) (messages_sent / elapsed) << "/s), retransmissions "
+         << retransmissions << ", ACKs received " << acks_received << " (" << (unsigned long) (acks_received / elapsed) << "/s)" << endl;
+
+    if (results.dropped >= 0)
+    {
+        cout << "Datagrams the server did not receive " << results.dropped << endl;
+    }
+
+    memset(results.latencies, 0, sizeof(results.latencies));
+    if (!latencies.empty())
+    {
+        const double percentiles[] = { 0.5, 0.99, 0.999 };
+        cout << "Admission latency:";
+        for (int i = 0; i < 3; i++)
+        {
+            results.latencies[i] = latencies[min(latencies.size() - 1, (size_t) (percentiles[i] * latencies.size()))];
+            cout << " p" << percentiles[i] * 100 << " " << results.latencies[i] << " us,";
+        }
+        results.latencies[3] = latencies.back();
+        cout << " max " << latencies.back() << " us" << endl;
+    }
+
+    for (int i = 0; i < load_sockets; i++)
+    {
+        close(sockets[i]);
+    }
+    close(epoll_fd);
+
+    return 0;
+}
+
+// Writes the results as a baseline file, one "<metric> <value>" line each
+int SaveBaseline(const LoadResults& results)
+{
+    FILE * baseline_file = fopen(save_baseline_path.c_str(), "w");
+    if (baseline_file == NULL)
+    {
+        fprintf(stderr, "Failed to create %s: %s\n", save_baseline_path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    fprintf(baseline_file, "arrivals_per_s %.0f\n", results.arrival_rate);
+    fprintf(baseline_file, "p50_us %.0f\np99_us %.0f\np999_us %.0f\n", results.latencies[0], results.latencies[1], results.latencies[2]);
+    if (results.dropped >= 0)
+    {
+        fprintf(baseline_file, "dropped %ld\n", results.dropped);
+    }
+    fprintf(baseline_file, "gave_up %lu\n", results.given_up);
+    fprintf(baseline_file, "rejected %lu\n", results.rejected);
+    fclose(baseline_file);
+    return 0;
+}
+
+// Checks the results against the baseline file. Throughput may fall and the latencies and counts may grow by
+// baseline_tolerance percent, plus a little slack for timer noise and for baselines of 0. Returns 1 when a result
+// regressed, 0 when none did and -1 when the baseline cannot be read
+int CompareWithBaseline(const LoadResults& results)
+{
+    ifstream baseline_file(baseline_path.c_str());
+    if (!baseline_file)
+    {
+        fprintf(stderr, "Failed to open the baseline %s\n", baseline_path.c_str());
+        return -1;
+    }
+
+    map<string, double> baseline;
+    string metric;
+    double value;
+    while (baseline_file >> metric >> value)
+    {
+        baseline[metric] = value;
+    }
+
+    struct
+    {
+        const char * name;
+        double value;
+        bool higher_is_better;
+        double slack;
+    } metrics[] = {
+        { "arrivals_per_s", results.arrival_rate, true, 0 },
+        { "p50_us", results.latencies[0], false, BASELINE_LATENCY_SLACK },
+        { "p99_us", results.latencies[1], false, BASELINE_LATENCY_SLACK },
+        { "p999_us", results.latencies[2], false, BASELINE_LATENCY_SLACK },
+        { "dropped", (double) results.dropped, false, results.messages_sent * BASELINE_COUNT_SLACK },
+        { "gave_up", (double) results.given_up, false, 0 },
+        { "rejected", (double) results.rejected, false, 0 },
+    };
+
+    int regressions = 0;
+    cout << "Against the baseline " << baseline_path << " (" << baseline_tolerance << "% tolerance):" << endl;
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++)
+    {
+        // Drops are unknown when the server did not answer the stats queries
+        if (baseline.count(metrics[i].name) == 0 || metrics[i].value < 0)
+        {
+            continue;
+        }
+
+        double base = baseline[metrics[i].name];
+        double limit = metrics[i].higher_is_better ? base * (1 - baseline_tolerance / 100) : base * (1 + baseline_tolerance / 100) + metrics[i].slack;
+        bool regressed = metrics[i].higher_is_better ? metrics[i].value < limit : metrics[i].value > limit;
+        regressions += regressed;
+
+        printf("  %-15s %12.0f  baseline %12.0f  limit %12.0f  %s\n", metrics[i].name, metrics[i].value, base, limit, regressed ? "REGRESSED" : "ok");
+    }
+
+    return regressions > 0 ? 1 : 0;
+}
+
+// Returns the CLOCK_MONOTONIC time the given number of seconds after start
+struct timespec TimeAfter(const struct timespec& start, double seconds)
+{
+    long long nanoseconds = start.tv_nsec + (long long) (seconds * 1000000000.0);
+
+    struct timespec time;
+    time.tv_sec = start.tv_sec + nanoseconds / 1000000000;
+    time.tv_nsec = nanoseconds % 1000000000;
+    return time;
+}
+
+// Sleeps until the given CLOCK_MONOTONIC time. Sleeping to an absolute time does not drift when the process is
+// scheduled late, and unlike clock() the monotonic clock keeps going while the process is not running
+void SleepUntil(const struct timespec& deadline)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+}
+
+// Helper method to simulate time delay
+void Delay(double delayInSeconds)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    SleepUntil(TimeAfter(now, delayInSeconds));
 }
 
 int main(int argc, char *argv[])
@@ -37,27 +885,179 @@ int main(int argc, char *argv[])
     struct sockaddr_in server;
     int server_addr = INADDR_ANY;
 
-    if (argc > 2)
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
     {
-        fprintf(stderr, "Usage: %s [optional: server IP]\n", argv[0]);
+        if (strcmp(argv[arg], "--text") == 0)
+        {
+            use_text_protocol = true;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "--plaza") == 0 && arg + 1 < argc)
+        {
+            plaza_id = strtoul(argv[arg + 1], NULL, 10);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--loss") == 0 && arg + 1 < argc)
+        {
+            loss_percent = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--stats") == 0)
+        {
+            query_stats = true;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "--time-scale") == 0 && arg + 1 < argc)
+        {
+            time_scale = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--load") == 0 && arg + 1 < argc)
+        {
+            load_rate = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--duration") == 0 && arg + 1 < argc)
+        {
+            load_duration = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--sockets") == 0 && arg + 1 < argc)
+        {
+            load_sockets = atoi(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--stay") == 0 && arg + 1 < argc)
+        {
+            load_stay = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--plazas") == 0 && arg + 1 < argc)
+        {
+            load_plazas = strtoul(argv[arg + 1], NULL, 10);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--tcp") == 0)
+        {
+            use_tcp = true;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "--montagues") == 0 && arg + 1 < argc)
+        {
+            load_montagues = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+        {
+            load_seed = strtoull(argv[arg + 1], NULL, 10);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+        {
+            trace_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc)
+        {
+            record_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--server") == 0 && arg + 1 < argc)
+        {
+            server_command = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--baseline") == 0 && arg + 1 < argc)
+        {
+            baseline_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--save-baseline") == 0 && arg + 1 < argc)
+        {
+            save_baseline_path = argv[arg + 1];
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "--tolerance") == 0 && arg + 1 < argc)
+        {
+            baseline_tolerance = atof(argv[arg + 1]);
+            arg += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // A trace replaces the generated arrivals, and everything that makes or judges a load run needs one
+    bool load_mode = load_rate > 0 || !trace_path.empty();
+    bool load_only = use_tcp || !record_path.empty() || !server_command.empty() || !baseline_path.empty() || !save_baseline_path.empty();
+    bool bad_options = time_scale <= 0 || (load_only && !load_mode) || (load_mode && (use_text_protocol || load_duration <= 0 ||
+        load_sockets < 1 || load_sockets > MAX_LOAD_SOCKETS || load_stay < 0 || load_plazas < 1 ||
+        load_montagues < 0 || load_montagues > 100 || baseline_tolerance < 0));
+    if (argc - arg > 1 || (arg < argc && strncmp(argv[arg], "--", 2) == 0) || bad_options)
+    {
+        fprintf(stderr, "Usage: %s [--text] [--plaza <id>] [--loss <percent>] [--time-scale <factor>] [optional: server IP]\n"
+                "       %s --stats [optional: server IP]\n"
+                "       %s --load <arrivals/s> | --trace <file> [--duration <s>] [--sockets <1-%d>] [--tcp] [--stay <ms>]\n"
+                "           [--plaza <first id>] [--plazas <count>] [--montagues <percent>] [--seed <n>] [--record <file>]\n"
+                "           [--time-scale <factor>] [--loss <percent>] [--server \"<server command>\"]\n"
+                "           [--baseline <file>] [--tolerance <percent>] [--save-baseline <file>] [optional: server IP]\n",
+                argv[0], argv[0], argv[0], MAX_LOAD_SOCKETS);
         exit(1);
     }
 
-    if (argc == 2)
+    if (arg < argc)
+    {
+        server_addr = inet_addr(argv[arg]);
+    }
+
+    if (query_stats)
+    {
+        return QueryStats(server_addr) < 0 ? 1 : 0;
+    }
+
+    if (load_mode)
     {
-        server_addr = inet_addr(argv[1]);
+        vector<TraceArrival> trace;
+        if (MakeLoadTrace(trace) < 0)
+        {
+            return 1;
+        }
+
+        pid_t server_pid = -1;
+        if (!server_command.empty() && (server_pid = StartServer(server_addr)) < 0)
+        {
+            return 1;
+        }
+
+        LoadResults results;
+        int ret_val = RunLoadGenerator(server_addr, trace, results);
+        if (server_pid > 0)
+        {
+            StopServer(server_pid);
+        }
+
+        if (ret_val < 0 || (!save_baseline_path.empty() && SaveBaseline(results) < 0))
+        {
+            return 1;
+        }
+
+        // The benchmark gate: a regression fails the run
+        return !baseline_path.empty() && CompareWithBaseline(results) != 0 ? 1 : 0;
     }
 
     string family, person;
-    int arrival, departure;
-    int last_arrival = 0;
+    double arrival, departure;     // seconds of input time, arrivals counted from the start
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t visit = 0;     // numbers the input lines, so every visit of a person gets its own sequence numbers
     cin >> family >> person >> arrival >> departure;
 
     while (cin)
     {
-        int arrival_diff = arrival - last_arrival;
-        // Apply delay between arrivals if necessary
-        Delay(arrival_diff);
+        // Wait for the person's arrival time, if it has not passed yet
+        SleepUntil(TimeAfter(start, arrival * time_scale));
 
         // Fork a new process for each person arriving in the plaza
         int pid = fork();
@@ -74,46 +1074,31 @@ int main(int argc, char *argv[])
             server.sin_port = htons(PORTNUM);
             server.sin_addr.s_addr = INADDR_ANY; // server should be running on the same machine
 
-            // Send arrival message
-            string arrival_message = "A " + person + " " + family;
-            if (sendto(s, arrival_message.c_str(), arrival_message.length(), 0, (struct sockaddr *)&server, sizeof(sockaddr_in)) < 0)
+            // Send arrival message and wait for signal from the server that the person has entered the plaza
+            if (SendReliably(s, PLAZA_ARRIVAL, PLAZA_ENTRY_ACK, person, family, 2 * visit + 1, &server) < 0)
             {
-                fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
                 exit(1);
             }
 
-            // Wait for signal from the server that the person has entered the plaza
-            char ack_message;
-            int addr_len = sizeof(sockaddr_in);
-            if (recvfrom(s, &ack_message, sizeof(char), 0, (struct sockaddr *)&server, &addr_len) < 0)
-            {
-                fprintf(stderr, "recvfrom() did not get a valid message: %s\n", strerror(errno));
-                exit(1);
-            }
-            else
-            {
-                string message = "Unexpected ACK message from server: " + ack_message;
-                assert(ack_message == 'E' && message.c_str());
-            }
-
             // Apply delay simulating the time the person spent in the plaza
-            Delay(departure);
+            Delay(departure * time_scale);
 
             // Send a departure message to the server
-            string departure_message = "D " + person + " " + family;
-            if (sendto(s, departure_message.c_str(), departure_message.length(), 0, (struct sockaddr *)&server, sizeof(sockaddr_in)) < 0)
+            if (SendReliably(s, PLAZA_DEPARTURE, PLAZA_DEPARTURE_ACK, person, family, 2 * visit + 2, &server) < 0)
             {
-                fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
                 exit(1);
             }
 
             if (close(s) < 0)
                 fprintf(stderr, "close(s) failed.\n");
 
-            return 0;
+            // exit() would rewind the stdin shared with the parent to where this child's copy of it was,
+            // and the parent would read the people after this one again
+            _exit(0);
         }
         else if (pid > 0)
         {
+            visit++;
             cin >> family >> person >> arrival >> departure;
         }
         else
@@ -135,8 +1120,7 @@ int main(int argc, char *argv[])
     server.sin_addr.s_addr = INADDR_ANY;
 
     // Send exit message
-    string exit_message = "X Dummy Dummy";
-    if (sendto(s, exit_message.c_str(), exit_message.length(), 0, (struct sockaddr *)&server, sizeof(sockaddr_in)) < 0)
+    if (SendPlazaMessage(s, PLAZA_EXIT, "Dummy", "Dummy", 0, &server) < 0)
     {
         fprintf(stderr, "sendto() failed: %s\n", strerror(errno));
         exit(1);
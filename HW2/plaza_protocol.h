@@ -0,0 +1,189 @@
+#ifndef PLAZA_PROTOCOL_H
+#define PLAZA_PROTOCOL_H
+
+// Wire format shared by the plaza server and client.
+//
+// Every message is a fixed 24 byte datagram, all fields in network byte order:
+//
+//   byte  0        protocol version (PLAZA_PROTOCOL_VERSION)
+//   byte  1        message type ('A' arrival, 'D' departure, 'X' exit, 'E' entry ACK, 'K' departure ACK,
+//                  'R' arrival rejected, 'S' stats query)
+//   byte  2        family (PlazaFamily): any group of people 1 - 255 that must not share a plaza with another,
+//                  Montague and Capulet being 1 and 2; 0 in messages that are not about a person
+//   byte  3        flags, reserved and sent as 0
+//   bytes 4 - 7    sequence number, counted per person
+//   bytes 8 - 15   person id
+//   bytes 16 - 19  plaza id
+//   bytes 20 - 23  reserved, sent as 0
+//
+// Version 1 messages are the first 16 bytes only and always mean plaza 0.
+//
+// The server also listens for TCP connections on the same port. A connection carries the messages of any number
+// of people back to back, every frame a whole 24 byte version 2 message, and the replies come back on it the same
+// way. Nothing is retransmitted over TCP.
+//
+// Delivery is made reliable by the client: it resends an arrival until it gets the 'E' and a departure until it
+// gets the 'K', with the same sequence number. The server answers duplicates from its per-person session instead
+// of acting on them twice. Sequence number 0 (the text protocol) opts out of all of this.
+// An arrival the server has no room to queue is answered with an 'R' instead, and the client stops resending it.
+// A stats query from the server's own host is answered with one datagram of JSON text instead of a message.
+// The layout is naturally aligned, so a received datagram is read in place through a PlazaMessage pointer.
+// The original text protocol ("A Romeo Montague [plaza]") is still accepted by both programs with --text
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+
+#define PLAZA_PROTOCOL_VERSION  2
+#define PLAZA_MESSAGE_SIZE      24
+#define PLAZA_V1_MESSAGE_SIZE   16
+#define PLAZA_ID_OFFSET         16
+#define NO_PLAZA                0xFFFFFFFFU   // not a valid plaza id, marks free slots in plaza tables
+
+#define PLAZA_ARRIVAL       'A'
+#define PLAZA_DEPARTURE     'D'
+#define PLAZA_EXIT          'X'
+#define PLAZA_ENTRY_ACK     'E'
+#define PLAZA_DEPARTURE_ACK 'K'
+#define PLAZA_REJECT        'R'
+#define PLAZA_STATS_QUERY   'S'
+
+enum PlazaFamily : uint8_t
+{
+    NoFamily = 0,
+    Montague = 1,
+    Capulet = 2
+};
+
+struct PlazaMessage
+{
+    uint8_t version;
+    uint8_t type;
+    uint8_t family;
+    uint8_t flags;
+    uint32_t sequence;
+    uint64_t person_id;
+    uint32_t plaza_id;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(PlazaMessage) == PLAZA_MESSAGE_SIZE, "PlazaMessage must match the wire layout");
+
+inline uint32_t PlazaSequence(const PlazaMessage * message)
+{
+    return be32toh(message->sequence);
+}
+
+inline uint64_t PlazaPersonId(const PlazaMessage * message)
+{
+    return be64toh(message->person_id);
+}
+
+inline uint32_t PlazaId(const PlazaMessage * message)
+{
+    return message->version == 1 ? 0 : be32toh(message->plaza_id);
+}
+
+inline PlazaFamily PlazaMessageFamily(const PlazaMessage * message)
+{
+    return (PlazaFamily) message->family;
+}
+
+inline void EncodePlazaMessage(PlazaMessage * message, char type, PlazaFamily family, uint64_t person_id, uint32_t sequence, uint32_t plaza_id = 0)
+{
+    message->version = PLAZA_PROTOCOL_VERSION;
+    message->type = (uint8_t) type;
+    message->family = family;
+    message->flags = 0;
+    message->sequence = htobe32(sequence);
+    message->person_id = htobe64(person_id);
+    message->plaza_id = htobe32(plaza_id);
+    message->reserved = 0;
+}
+
+// Returns a view of the message in the receive buffer, or NULL when the datagram is not a valid message.
+// The buffer must be 8 byte aligned
+inline const PlazaMessage * DecodePlazaMessage(const char * buffer, size_t length)
+{
+    if (length != PLAZA_MESSAGE_SIZE && length != PLAZA_V1_MESSAGE_SIZE)
+    {
+        return NULL;
+    }
+
+    const PlazaMessage * message = (const PlazaMessage *) buffer;
+    int version = length == PLAZA_V1_MESSAGE_SIZE ? 1 : PLAZA_PROTOCOL_VERSION;
+    if (message->version != version || PlazaId(message) == NO_PLAZA)
+    {
+        return NULL;
+    }
+
+    return message;
+}
+
+// Families past the first two are named by number, "Group3" to "Group255"
+inline PlazaFamily PlazaFamilyFromName(const std::string& family)
+{
+    if (strcmp(family.c_str(), "Montague") == 0)
+    {
+        return Montague;
+    }
+    else if (strcmp(family.c_str(), "Capulet") == 0)
+    {
+        return Capulet;
+    }
+    else if (family.compare(0, 5, "Group") == 0 && family.length() > 5 && family.length() <= 8 &&
+        family.find_first_not_of("0123456789", 5) == std::string::npos)
+    {
+        int group = atoi(family.c_str() + 5);
+        return group > Capulet && group <= 255 ? (PlazaFamily) group : NoFamily;
+    }
+
+    return NoFamily;
+}
+
+inline std::string PlazaFamilyName(PlazaFamily family)
+{
+    switch (family)
+    {
+    case NoFamily:
+        return "Nobody";
+    case Montague:
+        return "Montague";
+    case Capulet:
+        return "Capulet";
+    default:
+        return "Group" + std::to_string((int) family);
+    }
+}
+
+// Person ids for the text protocol and the client's input file: a 64 bit FNV-1a hash of the person's name
+inline uint64_t PlazaPersonIdFromName(const std::string& person)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < person.length(); i++)
+    {
+        hash ^= (unsigned char) person[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Packet loss shim for testing the retransmissions on loopback (--loss <percent>): returns true for the given
+// percentage of calls, and the caller drops the datagram it just received
+inline bool DropDatagram(double loss_percent)
+{
+    static thread_local unsigned int seed = 0;
+    if (seed == 0)
+    {
+        seed = (unsigned int) (uintptr_t) &seed ^ (unsigned int) getpid();
+    }
+
+    return loss_percent > 0 && rand_r(&seed) < loss_percent / 100.0 * RAND_MAX;
+}
+
+#endif
@@ -1,302 +1,4194 @@
+// Build with: g++ -std=c++17 -pthread -o server server.cpp
+
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <queue>
+#include <deque>
 #include <sstream>
 #include <map>
 #include <assert.h>
 #include <iostream>
 #include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <signal.h>
+
+#include "plaza_protocol.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 using namespace std;
 
 #define PORTNUM             50000
 #define MAX_MESSAGE_SIZE    1024
+#define UNIX_SOCKET_PATH    "/tmp/plaza_server.sock"
+
+#define MAX_SOCKETS                 3   // IPv4, IPv6 and Unix datagram sockets
+#define MAX_DATAGRAMS_PER_WAKEUP    64  // upper bound on datagrams drained from one socket per epoll wakeup
+#define MAX_DATAGRAMS_PER_SEND      1024    // sendmmsg() accepts at most UIO_MAXIOV messages per call
+#define MAX_EVENTS_PER_WAKEUP       64
+
+#define URING_ENTRIES       256     // submission queue entries of a worker's io_uring
+#define URING_BUFFERS       1024    // provided receive buffers per worker, a power of two
+#define URING_BUFFER_SIZE   (sizeof(struct io_uring_recvmsg_out) + sizeof(sockaddr_storage) + MAX_MESSAGE_SIZE)
+
+#define TCP_BACKLOG             128
+#define MAX_CONNECTION_OUTPUT   (1 << 20)   // bytes of replies a connection may have unread before it is dropped
+#define AF_PLAZA_STREAM         AF_MAX      // address family of StreamAddress, not used by any real socket
+
+#define MAX_WAITERS             65536   // people waiting to enter a plaza, split between the workers' pools
+#define MIN_WAITERS_PER_WORKER  1024
+#define NO_WAITER               -1
+
+#define RATE_LIMIT_BITS         12      // a worker keeps token buckets for up to 2^12 client addresses
+#define RATE_LIMIT_PROBES       8       // slots looked at for an address before the stalest bucket is reused
+
+#define MAX_WORKERS             64
+#define INITIAL_PLAZA_SLOTS     64      // starting size of a worker's plaza table, doubled when 3/4 full
+
+#define BENCHMARK_OPERATIONS    2000000 // arrivals per thread in the --bench-state benchmark
+#define BENCHMARK_PLAZAS        16      // plazas per thread in the --bench-state benchmark
+#define BENCHMARK_OCCUPANTS     64      // people a benchmark thread keeps in its plazas at a time
+
+#define INITIAL_SESSION_SLOTS   64      // starting size of a worker's session table, doubled when 3/4 full
+#define NO_PERSON               0       // marks free slots in session tables, so person 0 gets no session
+#define DEFAULT_LEASE_SECONDS   300     // people still in a plaza after this long are taken to have left
+#define SESSION_LINGER          10000   // milliseconds a session outlives its departure, to answer retransmissions
+#define TIMER_TICK              100     // milliseconds
+#define TIMER_SLOTS             1024
+
+#define LOG_RING_SIZE       8192    // records per thread's log ring, a power of two
+#define LOG_IDLE_SLEEP      1       // milliseconds the log writer sleeps when every ring is empty
+
+#define JOURNAL_SNAPSHOT_RECORDS    100000  // journal records after which a worker snapshots its shard
+#define SNAPSHOT_MAGIC              0x504C415A41534E32ULL   // "PLAZASN2"
+
+#define HISTOGRAM_SUB_BITS  3   // every power of two is split into 2^3 histogram buckets, 12.5% wide at most
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// A plaza's state word: bits 0 - 23 hold the people in the plaza, bits 24 - 31 the family in the plaza
+// (NoFamily when it is empty)
+#define OCCUPANT_BITS   24
+#define FAMILY_SHIFT    OCCUPANT_BITS
+
+#define NO_FAMILY_QUEUE -1
+#define OTHER_FAMILIES  NoFamily    // stats slot shared by the families after Capulet
+
+// Where to send a client's reply: the socket the client's message came in on, and the client's address.
+// The person id, sequence number and plaza id are echoed back in the binary entry ACK
+struct ClientAddress
+{
+    uint64_t person_id;
+    uint32_t sequence;
+    int socket;
+    socklen_t length;
+    uint32_t plaza_id;
+    uint64_t arrival_time;      // microseconds, for the wait-time histograms and the strict arrival order
+    sockaddr_storage address;
+};
+
+// The address of a client on a TCP connection: the connection and the worker serving it. It travels in the
+// sockaddr_storage of a ClientAddress or HandOff like any other address, so waiters and hand-offs need nothing
+// special, and only sending the reply looks inside
+struct StreamAddress
+{
+    sa_family_t family;         // AF_PLAZA_STREAM
+    uint16_t worker;
+    int fd;
+    uint64_t connection_id;     // tells a connection from a later one that got the same descriptor
+};
+
+// The token bucket of one client address: it holds up to --burst arrivals and fills at --rate-limit per second.
+// A new address takes the stalest of the slots it probes. A bucket idle long enough to be full again is no
+// different from a new one, so the table ages without a sweep
+struct RateBucket
+{
+    uint64_t address_hash;      // 0 for a slot never used
+    uint64_t last_refill;       // microseconds
+    double tokens;
+};
+
+// A person waiting to enter a plaza. Waiters live in a preallocated pool and are linked by index into either
+// their family's FIFO queue or the free list, so arrivals and releases never touch the heap
+struct Waiter
+{
+    ClientAddress client;
+    int next;
+};
+
+struct WaiterQueue
+{
+    int head;
+    int tail;
+    unsigned int count;
+};
+
+// The people of one family waiting for one plaza. The queues come from a pool in the shard like the waiters, and
+// the shard finds them by plaza and family in a hash table, so admitting and releasing people costs the same
+// however many families there are
+struct FamilyQueue
+{
+    uint32_t plaza_id;
+    PlazaFamily family;
+    WaiterQueue waiters;
+    int next;                   // the plaza's family queue after this one, or the next free queue
+    int previous;
+};
+
+// Everything the server keeps about one plaza, so an idle venue costs 24 bytes. A turn is the time one family
+// holds the plaza without it emptying. The families waiting for the plaza are linked in the order they get it
+struct Plaza
+{
+    uint32_t id;
+    uint32_t state;
+    uint32_t turn_admissions;   // people the family in the plaza has let in this turn
+    uint32_t turn_start;        // milliseconds, when this turn started
+    int first_family;           // family queues, NO_FAMILY_QUEUE when nobody waits
+    int last_family;
+};
+
+// HDR-style histogram: values below 2^HISTOGRAM_SUB_BITS get a bucket each, larger values share log-linear buckets.
+// Only the worker that owns it records into it, with plain loads and stores, and any thread may read it
+struct Histogram
+{
+    atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+};
+
+// A copy of one or more histograms added together, to report from
+struct HistogramSnapshot
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+// What a worker measures for one family
+struct FamilyStats
+{
+    Histogram waits;            // microseconds from the arrival until the entry ACK is sent
+    Histogram stays;            // microseconds from entering to leaving, for clients using sequence numbers
+    Histogram queue_lengths;    // people already waiting when a person joins the queue
+    atomic<uint64_t> waiting;   // people waiting now
+};
+
+// Who gets into a plaza while other families are waiting:
+//  Greedy       the family in the plaza keeps letting its people in, as the original plaza did
+//  TurnTaking   once another family is waiting, newcomers of the family in the plaza wait for the next turn
+//  StrictOrder  people get in in the order they arrived, a family only enters together with those that arrived
+//               before the first waiting person of any other family
+// Under the first two the waiting families get the plaza in the order they started waiting, under strict order in
+// the order of their first waiters. --max-batch and --time-slice end a family's turn early under every policy, and
+// cap how many waiters one turn lets in. --capacity caps the people in a plaza
+enum AdmissionPolicy
+{
+    Greedy,
+    TurnTaking,
+    StrictOrder
+};
+
+enum SessionState : uint8_t
+{
+    Waiting_To_Enter,
+    Inside,
+    Departed
+};
+
+// What the server remembers about a person using sequence numbers, to answer retransmitted messages without
+// acting on them twice and to evict people who never depart. Sessions live in an open-addressing table per shard
+// and expire SESSION_LINGER after the person leaves
+struct Session
+{
+    uint64_t person_id;
+    uint64_t deadline;          // milliseconds: the lease end while inside, when the session is dropped once departed
+    uint64_t entered;           // microseconds, 0 while not inside
+    uint32_t plaza_id;
+    uint32_t last_sequence;
+    PlazaFamily family;
+    SessionState state;
+};
+
+enum JournalRecordType : uint8_t
+{
+    JournalArrival = 1,
+    JournalDeparture,
+    JournalEviction
+};
+
+// One change to a shard, as it is appended to the worker's journal. Records are fixed size and numbered without
+// gaps, so recovery finds a torn write at the end of the journal by its size or its number
+struct JournalRecord
+{
+    uint64_t lsn;
+    uint64_t time;              // microseconds
+    uint64_t person_id;
+    uint32_t plaza_id;
+    uint32_t sequence;
+    JournalRecordType type;
+    PlazaFamily family;
+    uint16_t reserved;
+    uint32_t address_length;    // arrivals only: where to send the entry ACK
+    sockaddr_storage address;
+};
+
+// A worker's write-ahead journal (--journal). Records collect in pending while the worker handles a wakeup and are
+// written and synced together before that wakeup's ACKs go out
+struct PlazaJournal
+{
+    int fd;                     // -1 without --journal
+    int id;                     // the worker's id, in the file names
+    uint32_t generation;        // bumped by every recovery, in the file names
+    vector<JournalRecord> pending;
+    uint64_t lsn;               // number of the last record appended
+    uint64_t records_since_snapshot;
+    uint64_t last_sync;         // milliseconds
+    bool unsynced;
+};
+
+// A snapshot file is the header followed by the plazas that are not empty, their waiters and the sessions
+struct SnapshotHeader
+{
+    uint64_t magic;
+    uint64_t lsn;               // the last journal record the snapshot includes
+    uint32_t worker_count;      // workers of the generation the snapshot belongs to
+    uint32_t plaza_count;
+    uint32_t waiter_count;
+    uint32_t session_count;
+};
+
+struct SnapshotWaiter
+{
+    uint32_t plaza_id;
+    PlazaFamily family;
+    ClientAddress client;
+};
+
+// The plazas one worker owns, in an open-addressing table with linear probing, and the pool their waiters come
+// from. Plaza ids are sharded over the workers (plaza id % workers), and only the owner touches a shard
+struct PlazaShard
+{
+    vector<Plaza> plazas;
+    unsigned int plaza_bits;    // the table has 1 << plaza_bits slots
+    unsigned int plaza_count;
+    vector<Waiter> waiter_pool;
+    WaiterQueue free_waiters;
+    vector<FamilyQueue> family_queues;  // as many as waiters, every queue has someone in it
+    int free_family_queues;
+    vector<int> family_queue_table;     // open addressing by plaza and family, twice the pool so never full
+    unsigned int family_queue_bits;
+    atomic<unsigned long> occupants;    // people in the shard's plazas, only written by the owner
+    FamilyStats family_stats[Capulet + 1];  // indexed by PlazaFamily, OTHER_FAMILIES for the families after Capulet
+    atomic<uint64_t> messages_received;
+    atomic<uint64_t> messages_unknown;      // dropped, of a type no client sends the server
+    atomic<uint64_t> messages_malformed;    // dropped, an arrival or departure naming no family the server knows
+    atomic<uint64_t> arrivals_rejected;     // answered with an 'R', their line or the waiter pool was full
+    atomic<uint64_t> arrivals_rate_limited; // dropped, their client address was over --rate-limit
+    atomic<uint64_t> arrivals_shed;         // dropped, they came off a receive queue past --shed
+    atomic<uint64_t> departures_unmatched;  // dropped, from a plaza that did not hold the person's family
+    atomic<uint64_t> acks_dropped;          // lost, their client's address could not take them
+
+    vector<Session> sessions;
+    unsigned int session_bits;  // the table has 1 << session_bits slots
+    unsigned int session_count;
+    TimerWheel timers = TimerWheel(TIMER_SLOTS, TIMER_TICK, 0);  // lease and session expiry, by person id
+
+    PlazaJournal journal;
+};
+
+enum LogLevel
+{
+    LogQuiet,       // no person events
+    LogInfo,        // entries, departures and evictions
+    LogDebug        // arrivals as well
+};
+
+enum LogEvent : uint8_t
+{
+    PersonArrives,
+    PersonEnters,
+    PersonLeaves,
+    PersonIsEvicted
+};
+
+// A person event on its way to the log writer. Records are fixed size and hold no strings, so logging one is
+// a copy into the thread's ring; the text is only made up by the log writer
+struct LogRecord
+{
+    uint64_t time;              // microseconds, to merge the rings in order
+    uint64_t person_id;
+    uint32_t plaza_id;
+    PlazaFamily family;
+    LogEvent event;
+};
+
+// Single producer, single consumer ring of log records: the thread that owns it pushes, the log writer pops.
+// The indexes only grow, and each sits on its own cache line so the two threads do not share one
+struct LogRing
+{
+    alignas(64) atomic<uint64_t> head;  // next record to pop, written by the log writer
+    alignas(64) atomic<uint64_t> tail;  // next free slot, written by the owner
+    atomic<uint64_t> dropped;           // records lost to a full ring, written by the owner
+    LogRecord records[LOG_RING_SIZE];
+};
+
+enum ArrivalResult
+{
+    Admitted,
+    Waiting,
+    TurnedAway
+};
+
+// A reply held back until the end of the wakeup, when the journal records it depends on are durable
+struct PendingAck
+{
+    PlazaMessage message;
+    size_t length;
+    int socket;
+    socklen_t address_length;
+    sockaddr_storage address;
+};
+
+// A persistent TCP connection, served by the worker that accepted it. Many people's messages are multiplexed on
+// it, each a whole binary message: the stream is a sequence of PLAZA_MESSAGE_SIZE frames, and the person id and
+// sequence number in each tell the requests apart. Replies are pushed back on the same connection
+struct Connection
+{
+    int fd;
+    uint64_t id;
+    StreamAddress address;
+    vector<char> output;        // replies not written yet, from output_start on
+    size_t output_start;
+    bool want_write;            // EPOLLOUT is on while output is left
+    char partial[PLAZA_MESSAGE_SIZE];   // the start of a message split between reads
+    size_t partial_length;
+};
+
+// A message that reached a worker that does not own its plaza, on its way to the owner. Replies to a TCP client
+// travel the same way back to the worker serving the client's connection
+struct HandOff
+{
+    PlazaMessage message;
+    int socket;
+    socklen_t length;
+    sockaddr_storage address;
+};
+
+// A worker thread serves its own set of sockets and owns one shard of the plazas. The IPv4 and IPv6 sockets of
+// all workers share the port through SO_REUSEPORT, and a socket filter steers each binary message to the socket
+// of the worker owning its plaza. Messages that still land elsewhere (Unix socket, text protocol) are handed off
+// through the owner's inbox
+struct Worker
+{
+    int id;
+    int sockets[MAX_SOCKETS];
+    int socket_count;
+    int ipv4_socket;
+    int ipv6_socket;
+    int unix_socket;            // worker 0 only, -1 for the others
+    int tcp_socket;             // listening socket, -1 with the text protocol
+    map<int, Connection *> connections; // by descriptor
+    int epoll_fd;
+    thread worker_thread;
+    PlazaShard shard;
+
+    int inbox_fd;               // eventfd signalled when the inbox gets messages
+    mutex inbox_lock;
+    vector<HandOff> inbox;
+
+    // Receive buffers for one recvmmsg() batch. Each datagram gets its own buffer and address, with room
+    // left for a terminating null character. Binary messages are read in place, so the buffers are 8 byte aligned
+    alignas(8) char messages[MAX_DATAGRAMS_PER_WAKEUP][MAX_MESSAGE_SIZE];
+    sockaddr_storage client_addresses[MAX_DATAGRAMS_PER_WAKEUP];
+    struct iovec message_iovecs[MAX_DATAGRAMS_PER_WAKEUP];
+    struct mmsghdr message_headers[MAX_DATAGRAMS_PER_WAKEUP];
+
+    vector<RateBucket> rate_buckets;    // by client address, empty without --rate-limit
+    bool shedding[MAX_SOCKETS];         // --io uring: the socket's receive queue was past --shed this wakeup
+
+    // With --io uring the datagram sockets are read by multishot receives instead, and the ring polls the epoll
+    // descriptor for everything else. NULL with epoll
+    Uring * uring;
+    struct msghdr receive_headers[MAX_SOCKETS];         // templates of the multishot receives
+    vector<struct io_uring_cqe> deferred_completions;   // reaped while waiting for sends, not handled yet
+    bool epoll_pending;                                 // epoll may have events the ring's poll will not report
+};
+
+enum UringRequest : uint64_t
+{
+    UringReceive = 1ULL << 32,  // the low 32 bits are the socket's index in Worker::sockets
+    UringPoll = 2ULL << 32,
+    UringSend = 3ULL << 32
+};
 
-bool IsAMontague(string family);
-bool IsACapulet(string family);
 bool IsArrivalMessage(char message_type);
 bool IsDepatureMessage(char message_type);
 bool IsExitMessage(char message_type);
-int HandleArrivalMessage(int socket, string person, string family, struct sockaddr * client_address);
-int HandleDepatureMessage(int socket, string person, string family);
+bool IsStatsQuery(char message_type);
+bool IsKnownMessage(char message_type);
+int OpenInetSocket(int address_family, int type, bool announce);
+int OpenUnixSocket(const char * path);
+int AttachPlazaSteering(int socket, int worker_count);
+void ServeWorker(Worker * worker);
+void ReceiveDatagram(Worker * worker, int socket, char * message, size_t length, struct sockaddr * client_address, socklen_t client_address_length, bool shed);
+bool ReceiveQueueDeep(int socket);
+bool AcceptArrival(Worker * worker, bool shed, const struct sockaddr * client_address, socklen_t client_address_length);
+uint64_t ClientAddressHash(const struct sockaddr * address, socklen_t address_length);
+bool TakeToken(Worker * worker, const struct sockaddr * client_address, socklen_t client_address_length, uint64_t now);
+int WaitUring(Worker * worker, struct epoll_event * events, int timeout);
+void ReceiveUringDatagram(Worker * worker, const struct io_uring_cqe& completion);
+int SendUring(Worker * worker, int socket, vector<struct mmsghdr>& headers);
+bool IsDestinationError(int error);
+void DrainInbox(Worker * worker);
+void DispatchRequest(Worker * worker, int socket, const PlazaMessage * request, struct sockaddr * client_address, socklen_t client_address_length);
+void HandOffRequest(Worker * owner, int socket, const PlazaMessage * request, struct sockaddr * client_address, socklen_t client_address_length);
+bool AllPlazasEmpty();
+void StopWorkers();
+int BenchmarkPlazaState(int max_threads, int families);
+const PlazaMessage * ParseTextMessage(const char * text, PlazaMessage * message);
+string PersonName(uint64_t person_id);
+bool LogPersonEvent(uint32_t plaza_id, PlazaFamily family, uint64_t person_id, LogEvent event);
+void ForgetPersonName(uint64_t person_id);
+LogRing * ThreadLogRing();
+void WriteLog();
+uint64_t DroppedLogRecords();
+void ChangeLogLevel(int signal_number);
+unsigned int PlazaOccupants(uint32_t state);
+PlazaFamily PlazaInsideFamily(uint32_t state);
+uint32_t MakePlazaState(unsigned int occupants, PlazaFamily family);
+uint64_t NowMicroseconds();
+uint64_t NowMilliseconds();
+void InitializeShard(PlazaShard& shard, unsigned int waiter_capacity);
+Plaza& FindPlaza(PlazaShard& shard, uint32_t plaza_id);
+Plaza * LookupPlaza(PlazaShard& shard, uint32_t plaza_id);
+void CountOccupants(PlazaShard& shard, long change);
+FamilyStats& StatsOf(PlazaShard& shard, PlazaFamily family);
+FamilyQueue * FindFamilyQueue(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family);
+FamilyQueue * WaitingFamily(PlazaShard& shard, Plaza& plaza, PlazaFamily family);
+FamilyQueue * AddFamilyQueue(PlazaShard& shard, Plaza& plaza, PlazaFamily family);
+void RemoveFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue);
+void UnlinkFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue);
+void LinkFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue);
+bool OthersWaiting(PlazaShard& shard, Plaza& plaza, PlazaFamily family);
+bool TurnIsOver(Plaza& plaza, uint64_t now);
+bool CanEnterPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, uint64_t now);
+void ReleaseFromQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue, unsigned int limit, uint64_t arrived_before, bool keep_place, WaiterQueue& released, uint64_t now);
+void StartTurn(Plaza& plaza, PlazaFamily family, unsigned int admissions, uint64_t now);
+ArrivalResult ArriveAtPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, ClientAddress& client, uint64_t now);
+PlazaFamily DepartFromPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, WaiterQueue& released, uint64_t now);
+void AddToCounter(atomic<uint64_t>& counter, int64_t change);
+void ClearHistogram(Histogram& histogram);
+int HistogramBucket(uint64_t value);
+uint64_t HistogramBucketLimit(int bucket);
+void RecordValue(Histogram& histogram, uint64_t value);
+void AddHistogram(HistogramSnapshot& total, const Histogram& histogram);
+uint64_t HistogramPercentile(const HistogramSnapshot& histogram, double fraction);
+void PrintWaitHistograms(HistogramSnapshot * histograms, const char * unit);
+bool IsLocalAddress(const struct sockaddr * address);
+string HistogramJson(const HistogramSnapshot& histogram);
+string StatsJson();
+int SendStats(int socket, struct sockaddr * client_address, socklen_t client_address_length);
+Session * FindSession(PlazaShard& shard, uint64_t person_id, bool create);
+void RemoveSession(PlazaShard& shard, uint64_t person_id);
+void ScheduleSession(PlazaShard& shard, Session& session, uint64_t deadline);
+int ExpireSessions(PlazaShard& shard, uint64_t now);
+int HandleArrivalMessage(PlazaShard& shard, int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length);
+int HandleDepatureMessage(PlazaShard& shard, int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length);
+ArrivalResult ApplyArrival(PlazaShard& shard, ClientAddress& client, PlazaFamily family, uint64_t now);
+int ApplyDeparture(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family, uint64_t person_id, uint32_t sequence, LogEvent event, uint64_t now);
+int LeavePlaza(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family, uint64_t person_id, LogEvent event, uint64_t now);
+int SendEntryAck(int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length);
+int SendDepartureAck(int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length);
+int SendReject(int socket, const PlazaMessage * message, const struct sockaddr * client_address, socklen_t client_address_length);
+int SendEntryAcks(PlazaShard& shard, WaiterQueue& queue);
+vector<PendingAck>& PendingAcks();
+void QueueAck(int socket, const void * ack, size_t ack_length, const struct sockaddr * client_address, socklen_t client_address_length);
+int FlushAcks(Worker * worker);
+void AcceptConnections(Worker * worker);
+int ReadConnection(Worker * worker, Connection * connection);
+int WriteConnection(Worker * worker, Connection * connection);
+void CloseConnection(Worker * worker, Connection * connection);
+string JournalPath(uint32_t generation, int id, const char * suffix);
+bool WriteFully(int fd, const void * data, size_t length);
+int ReadWholeFile(const string& path, vector<char>& contents);
+int SyncJournalDirectory();
+void AppendJournal(PlazaShard& shard, JournalRecordType type, PlazaFamily family, uint64_t person_id, uint32_t plaza_id, uint32_t sequence, uint64_t time, const struct sockaddr * address, socklen_t address_length);
+int CommitJournal(PlazaShard& shard, uint64_t now);
+int SnapshotIfDue(PlazaShard& shard);
+int WriteSnapshot(PlazaShard& shard);
+int SocketForAddress(Worker * owner, int address_family);
+int RestoreSnapshot(const vector<char>& contents, uint64_t& lsn);
+void ReplayJournalRecord(const JournalRecord& record);
+void RescheduleReplayedSession(PlazaShard& shard, uint64_t person_id);
+int RecoverPlazas();
+FamilyQueue * EnqueueWaiter(PlazaShard& shard, Plaza& plaza, PlazaFamily family);
+void ReleaseWaiters(PlazaShard& shard, WaiterQueue& queue);
+
+bool use_text_protocol = false; // --text: speak the original "A Romeo Montague" protocol
+bool use_uring = false;         // --io uring: serve the datagram sockets with io_uring instead of epoll
 
-vector<string> waitingMontagues;
-vector<string> waitingCapulets;
-map<string, sockaddr_storage *> montague_client_addresses;
-map<string, sockaddr_storage *> capulet_client_addresses;
-unsigned int montaguesInPlaza = 0;
-unsigned int capulatesInPlaza = 0;
+AdmissionPolicy admission_policy = Greedy;  // --policy greedy|turns|fifo
+unsigned int max_batch = 0;                 // --max-batch: people a family lets in per turn, 0 for no limit
+unsigned int time_slice = 0;                // --time-slice: milliseconds a family's turn lasts, 0 for no limit
+unsigned int plaza_capacity = 0;            // --capacity: people a plaza holds at a time, 0 for no limit
+unsigned int max_waiting = 0;               // --max-waiting: people of one family that may wait for a plaza, 0 for
+                                            // no limit but the waiter pool
+double rate_limit = 0;                      // --rate-limit: arrivals per second one client address may send, 0 for
+                                            // no limit
+double rate_burst = 0;                      // --burst: arrivals a client address may send at once, defaults to
+                                            // one second's worth
+unsigned int shed_percent = 0;              // --shed: how full a receive queue may get, in percent of the socket
+                                            // buffer, before new arrivals are dropped; 0 never sheds
+unsigned int lease_seconds = DEFAULT_LEASE_SECONDS; // --lease: seconds before a person who never departs is evicted
+double loss_percent = 0;                    // --loss: percentage of received datagrams to drop, for testing
+string journal_directory;                   // --journal: where the workers keep their journals and snapshots
+unsigned int sync_interval = 0;             // --sync-interval: milliseconds between journal syncs, 0 to sync
+                                            // before every wakeup's ACKs
+
+vector<Worker *> workers;
+atomic<uint64_t> last_connection_id(0);
+atomic<bool> shouldExit(false);
+atomic<bool> serverFinished(false);
+int wakeup_fd = -1;             // eventfd that wakes every worker up once the server has finished
+uint64_t server_start;          // microseconds
+
+mutex stats_lock;               // guards the previous stats query, for the recent message rate
+uint64_t last_stats_time;
+uint64_t last_stats_messages;
+
+atomic<int> log_level(LogDebug);    // --log-level quiet|info|debug, SIGUSR1 raises it and SIGUSR2 lowers it
+atomic<bool> logFinished(false);
+mutex log_rings_lock;
+vector<LogRing *> log_rings;        // one per thread that has logged, never freed
+mutex person_names_lock;
+map<uint64_t, string> person_names; // names of the people in or waiting for a plaza, text protocol only
 
 const char ack_message = 'E'; // reply to clients that they have successfully entered the plaza
 
-int main() {
-    int s;
-    socklen_t addrlen;
-    struct sockaddr_in server_addr;
-    bool shouldExit = false;
-    memset(&server_addr, 0, sizeof(struct sockaddr_in)); // clear out address
+int main(int argc, char *argv[]) {
+    int worker_count = 1;
+    int benchmark_threads = 0;
+    int benchmark_families = 2;
 
-    char message[MAX_MESSAGE_SIZE];
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--text") == 0)
+        {
+            use_text_protocol = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            worker_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench-state") == 0 && i + 1 < argc)
+        {
+            benchmark_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench-families") == 0 && i + 1 < argc)
+        {
+            benchmark_families = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc && strcmp(argv[i + 1], "greedy") == 0)
+        {
+            admission_policy = Greedy;
+            i++;
+        }
+        else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc && strcmp(argv[i + 1], "turns") == 0)
+        {
+            admission_policy = TurnTaking;
+            i++;
+        }
+        else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc && strcmp(argv[i + 1], "fifo") == 0)
+        {
+            admission_policy = StrictOrder;
+            i++;
+        }
+        else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc)
+        {
+            max_batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time-slice") == 0 && i + 1 < argc)
+        {
+            time_slice = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc)
+        {
+            plaza_capacity = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-waiting") == 0 && i + 1 < argc)
+        {
+            max_waiting = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc)
+        {
+            rate_limit = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc)
+        {
+            rate_burst = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--shed") == 0 && i + 1 < argc)
+        {
+            shed_percent = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--lease") == 0 && i + 1 < argc)
+        {
+            lease_seconds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc)
+        {
+            loss_percent = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc)
+        {
+            journal_directory = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sync-interval") == 0 && i + 1 < argc)
+        {
+            sync_interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc && strcmp(argv[i + 1], "epoll") == 0)
+        {
+            use_uring = false;
+            i++;
+        }
+        else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc && strcmp(argv[i + 1], "uring") == 0)
+        {
+            use_uring = true;
+            i++;
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && strcmp(argv[i + 1], "quiet") == 0)
+        {
+            log_level = LogQuiet;
+            i++;
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && strcmp(argv[i + 1], "info") == 0)
+        {
+            log_level = LogInfo;
+            i++;
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && strcmp(argv[i + 1], "debug") == 0)
+        {
+            log_level = LogDebug;
+            i++;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--text] [--threads <workers>] [--policy greedy|turns|fifo] [--max-batch <people>]\n"
+                "    [--time-slice <ms>] [--capacity <people>] [--max-waiting <people>] [--lease <seconds>]\n"
+                "    [--rate-limit <arrivals/s> [--burst <arrivals>]] [--shed <percent>] [--loss <percent>]\n"
+                "    [--log-level quiet|info|debug] [--journal <directory>] [--sync-interval <ms>] [--io epoll|uring]\n"
+                "    [--bench-state <max threads> [--bench-families <2-255>]]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    //create socket
-    s = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s < 0) 
+    if (worker_count < 1 || worker_count > MAX_WORKERS)
     {
-        fprintf(stderr, "socket() Socket was not created: %s\n", strerror(errno));
-        exit(2);
+        fprintf(stderr, "The number of workers must be between 1 and %d\n", MAX_WORKERS);
+        exit(1);
     }
 
-    // ensure that the same IP address can be reused after for the socket in a single terminal instance
-    const int optVal = 1;
-    const socklen_t optLen = sizeof(optVal);
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void*)&optVal, optLen) != 0) 
+    if (rate_limit < 0 || rate_burst < 0 || shed_percent > 100)
     {
-        fprintf(stderr, "setsockopt() Error setting reuse-address option: %s\n", strerror(errno));
-        exit(2);
+        fprintf(stderr, "The rate limit and the burst cannot be negative, and --shed is a percentage\n");
+        exit(1);
     }
 
-    //server socket properties
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORTNUM);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    // A client may send a second's worth of arrivals at once, and at least one
+    if (rate_burst == 0)
+    {
+        rate_burst = max(rate_limit, 1.0);
+    }
 
-    // bind() associate socket with port on the machine
-    addrlen = sizeof(server_addr);
-    if (bind(s, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) 
+    if (benchmark_families < 2 || benchmark_families > 255)
     {
-        close(s);
-        fprintf(stderr, "bind() Error binding server: %s\n", strerror(errno));
+        fprintf(stderr, "The number of benchmark families must be between 2 and 255\n");
         exit(1);
     }
 
-    // retrieve resolved server socket information
-    if (getsockname(s, (struct sockaddr *) &server_addr, &addrlen) < 0) 
+    if (benchmark_threads > 0)
     {
-        fprintf(stderr, "getsockname() failed to get port number: %s\n", strerror(errno));
+        exit(BenchmarkPlazaState(benchmark_threads, benchmark_families) < 0 ? 1 : 0);
+    }
+
+    server_start = last_stats_time = NowMicroseconds();
+    wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (wakeup_fd < 0)
+    {
+        fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
         exit(1);
     }
 
-    fprintf(stdout, "The assigned port is %d\n", ntohs(server_addr.sin_port));
-    cout << endl;
+    for (int w = 0; w < worker_count; w++)
+    {
+        Worker * worker = new Worker;
+        worker->id = w;
+        worker->socket_count = 0;
+        InitializeShard(worker->shard, max(MAX_WAITERS / worker_count, MIN_WAITERS_PER_WORKER));
 
-    istringstream input_stream;
-    char message_type;
-    string person;
-    string family;
+        for (int i = 0; i < MAX_DATAGRAMS_PER_WAKEUP; i++)
+        {
+            worker->message_iovecs[i].iov_base = worker->messages[i];
+            worker->message_iovecs[i].iov_len = MAX_MESSAGE_SIZE - 1;
+        }
 
-    while (true)
-    {
-        sockaddr_storage client_addr;
-        socklen_t addr_len = sizeof(sockaddr_storage);
-        
-        // clean up message buffer
-        memset(message, 0, MAX_MESSAGE_SIZE);
-        // Wait for new message, and retrieve client information
-        if (recvfrom(s, message, sizeof(message), 0, (struct sockaddr *)&client_addr, &addr_len) < 0)
+        // Every slot starts out stale, so the first addresses take them in probe order
+        RateBucket empty_bucket;
+        memset(&empty_bucket, 0, sizeof(empty_bucket));
+        worker->rate_buckets.assign(rate_limit > 0 ? 1U << RATE_LIMIT_BITS : 0, empty_bucket);
+        memset(worker->shedding, 0, sizeof(worker->shedding));
+
+        // One socket per transport. Clients may reach the plaza over IPv4, IPv6 or, when they run on the
+        // same machine, a Unix datagram socket
+        int s = OpenInetSocket(AF_INET, SOCK_DGRAM, w == 0);
+        if (s < 0)
         {
-            fprintf(stderr, "recvfrom() did not get a valid message: %s\n", strerror(errno));
             exit(1);
         }
+        worker->sockets[worker->socket_count++] = s;
+        worker->ipv4_socket = s;
 
-        // Parse message
-        input_stream.clear();
-        input_stream.str(message);
-        input_stream >> message_type >> person >> family;
+        // IPv6 is optional, the plaza still runs on IPv4 only hosts
+        s = OpenInetSocket(AF_INET6, SOCK_DGRAM, w == 0);
+        if (s >= 0)
+        {
+            worker->sockets[worker->socket_count++] = s;
+        }
+        worker->ipv6_socket = s;
 
-        if (IsArrivalMessage(message_type))
+        worker->unix_socket = -1;
+        if (w == 0)
         {
-            if (HandleArrivalMessage(s, person, family, (struct sockaddr *)&client_addr) < 0)
+            s = OpenUnixSocket(UNIX_SOCKET_PATH);
+            if (s < 0)
             {
-                fprintf(stderr, "HandleArrivalMessage() failed: %s\n", strerror(errno));
                 exit(1);
             }
+            worker->sockets[worker->socket_count++] = s;
+            worker->unix_socket = s;
         }
-        else if (IsDepatureMessage(message_type))
+
+        // Persistent TCP connections for clients behind proxies, binary protocol only. The workers' listening
+        // sockets share the port, and the kernel spreads the connections over them
+        worker->tcp_socket = -1;
+        if (!use_text_protocol)
         {
-            if (HandleDepatureMessage(s, person, family) < 0)
+            s = OpenInetSocket(AF_INET, SOCK_STREAM, w == 0);
+            if (s < 0)
             {
-                fprintf(stderr, "HandleDepatureMessage() failed: %s\n", strerror(errno));
                 exit(1);
             }
+            worker->tcp_socket = s;
+        }
 
-            // No more clients to process
-            if (montaguesInPlaza == 0 && capulatesInPlaza == 0 && shouldExit)
+        worker->inbox_fd = eventfd(0, EFD_NONBLOCK);
+        worker->epoll_fd = epoll_create1(0);
+        if (worker->inbox_fd < 0 || worker->epoll_fd < 0)
+        {
+            fprintf(stderr, "Failed to create the worker's event descriptors: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // The kernel may be too old for io_uring, or not allow it. The worker then stays with epoll
+        worker->uring = NULL;
+        worker->epoll_pending = false;
+        if (use_uring)
+        {
+            worker->uring = new Uring;
+            if (worker->uring->Open(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) < 0)
             {
-                break;
+                fprintf(stderr, "io_uring is not available (%s), worker %d serves with epoll\n", strerror(errno), w);
+                delete worker->uring;
+                worker->uring = NULL;
             }
         }
-        else if (IsExitMessage(message_type))
+
+        int watched[MAX_SOCKETS + 3];
+        int watched_count = 0;
+        for (int i = 0; i < worker->socket_count && worker->uring == NULL; i++)
         {
-            shouldExit = true;
+            watched[watched_count++] = worker->sockets[i];
         }
-        else
+        if (worker->tcp_socket >= 0)
         {
-            break;
+            watched[watched_count++] = worker->tcp_socket;
         }
-    }
-
-    if (close(s) < 0)
-        fprintf(stderr, "close(s) failed.\n");
+        watched[watched_count++] = worker->inbox_fd;
+        watched[watched_count++] = wakeup_fd;
 
-    cout << endl << "Server finished" << endl;
-    
-    exit(0);
-}
-
-bool IsAMontague(string family)
-{
-    return strcmp(family.c_str(), "Montague") == 0;
-}
+        for (int i = 0; i < watched_count; i++)
+        {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = watched[i];
 
-bool IsACapulet(string family)
-{
-    return strcmp(family.c_str(), "Capulet") == 0;
-}
+            if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, watched[i], &event) < 0)
+            {
+                fprintf(stderr, "epoll_ctl() failed to watch socket: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
 
-bool IsArrivalMessage(char message_type)
-{
-    return toupper(message_type) == 'A';
-}
+        if (worker->uring != NULL)
+        {
+            for (int i = 0; i < worker->socket_count; i++)
+            {
+                memset(&worker->receive_headers[i], 0, sizeof(struct msghdr));
+                worker->receive_headers[i].msg_namelen = sizeof(sockaddr_storage);
+                worker->uring->ReceiveMultishot(worker->sockets[i], &worker->receive_headers[i], UringReceive | i);
+            }
+            worker->uring->PollMultishot(worker->epoll_fd, UringPoll);
+        }
 
-bool IsDepatureMessage(char message_type)
-{
-    return toupper(message_type) == 'D';
-}
+        workers.push_back(worker);
+    }
 
-bool IsExitMessage(char message_type)
-{
-    return toupper(message_type) == 'X';
-}
+    if (workers[0]->uring != NULL)
+    {
+        fprintf(stdout, "Serving the datagram sockets with io_uring\n");
+    }
 
-int HandleArrivalMessage(int socket, string person, string family, struct sockaddr * _client_addr)
-{
-    if (IsAMontague(family))
+    // Text messages cannot be steered by the kernel, they are all handed off by whichever worker reads them
+    if (worker_count > 1 && !use_text_protocol)
     {
-        cout << "Montague " << person << " arrives" << endl;
-        if (capulatesInPlaza == 0)
-        {
-            montaguesInPlaza++;
-            cout << "Montague " << person << " enters the plaza" << endl;
-            // Notify client right away
-            return sendto(socket, &ack_message, sizeof(char), 0, _client_addr, sizeof(sockaddr_storage));
-        }
-        else
+        AttachPlazaSteering(workers[0]->ipv4_socket, worker_count);
+        if (workers[0]->ipv6_socket >= 0)
         {
-            // At least one capulete is in the plaza so the montague will have to wait until
-            // the plaza is empty
-            waitingMontagues.push_back(person);
-
-            // snap-off a copy of the client's address on the heap to be used to notify the client
-            // when it is able to enter the plaza
-            sockaddr_storage * client_addr = new sockaddr_storage;
-            memcpy(client_addr, _client_addr, sizeof(sockaddr_storage));
-            montague_client_addresses.insert(make_pair(person, client_addr));
+            AttachPlazaSteering(workers[0]->ipv6_socket, worker_count);
         }
     }
-    else if (IsACapulet(family))
+
+    if (worker_count > 1)
     {
-        cout << "Capulet " << person << " arrives" << endl;
-        if (montaguesInPlaza == 0)
-        {
-            capulatesInPlaza++;
-            cout << "Capulet " << person << " enters the plaza" << endl;
-            return sendto(socket, &ack_message, sizeof(char), 0, _client_addr, sizeof(sockaddr_storage));
-        }
-        else
-        {
-            // At least one montague is in the plaza so the capulet will have to wait until
-            // the plaza is empty
-            waitingCapulets.push_back(person);
+        fprintf(stdout, "Serving the plazas with %d workers\n", worker_count);
+    }
 
-            // snap-off a copy of the client's address on the heap to be used to notify the client
-            // when it is able to enter the plaza
-            sockaddr_storage * client_addr = new sockaddr_storage;
-            memcpy(client_addr, _client_addr, sizeof(sockaddr_storage));
-            capulet_client_addresses.insert(make_pair(person, client_addr));
-        }
+    if (!journal_directory.empty() && RecoverPlazas() < 0)
+    {
+        exit(1);
     }
-    else
+
+    cout << endl;
+
+    struct sigaction log_level_action;
+    memset(&log_level_action, 0, sizeof(log_level_action));
+    log_level_action.sa_handler = ChangeLogLevel;
+    log_level_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &log_level_action, NULL);
+    sigaction(SIGUSR2, &log_level_action, NULL);
+
+    thread log_thread(WriteLog);
+
+    for (int w = 0; w < worker_count; w++)
     {
-        string message = "Invalid input. The family name is not recognized: " + family;
-        assert(false && message.c_str());
+        workers[w]->worker_thread = thread(ServeWorker, workers[w]);
     }
 
-    return 0;
-}
+    HistogramSnapshot wait_histograms[Capulet + 1];
+    memset(wait_histograms, 0, sizeof(wait_histograms));
 
-int HandleDepatureMessage(int socket, string person, string family)
-{
-    if (IsAMontague(family))
+    for (int w = 0; w < worker_count; w++)
     {
-        assert(montaguesInPlaza > 0 && L"There should be at least one montague in the plaza");
-        montaguesInPlaza--;
-        cout << "Montague " << person << " leaves the plaza" << endl;
+        workers[w]->worker_thread.join();
+    }
+
+    // The log writer empties the rings before it stops
+    logFinished = true;
+    log_thread.join();
 
-        if (montaguesInPlaza == 0 && waitingCapulets.size() > 0)
+    for (int w = 0; w < worker_count; w++)
+    {
+        for (int family = NoFamily; family <= Capulet; family++)
         {
-            // If no montagues are no longer in the plaza, allow all waiting capulets to
-            // get in the plaza
-            for (int i = 0; i < waitingCapulets.size(); i++)
-            {
-                string capulet = waitingCapulets[i];
-                std::map<string, sockaddr_storage* >::iterator it = capulet_client_addresses.find(capulet);
-                cout << "Capulet " << capulet << " enters the plaza" << endl;
-                capulatesInPlaza++;
-                int ret_val = sendto(socket, &ack_message, sizeof(char), 0, (struct sockaddr *) it->second, sizeof(sockaddr_storage));
-                if (ret_val < 0)
-                {
-                    return ret_val;
-                }
+            AddHistogram(wait_histograms[family], workers[w]->shard.family_stats[family].waits);
+        }
 
-                delete it->second;
-                capulet_client_addresses.erase(capulet);
-            }
+        // Closing the ring cancels its receives, before their sockets go
+        delete workers[w]->uring;
 
-            waitingCapulets.empty();
-            capulet_client_addresses.empty(); // should already be empty right before this call
+        for (int i = 0; i < workers[w]->socket_count; i++)
+        {
+            if (close(workers[w]->sockets[i]) < 0)
+                fprintf(stderr, "close(s) failed.\n");
         }
-    }
-    else if (IsACapulet(family))
-    {
-        assert(capulatesInPlaza > 0 && L"There should be at least one capulet in the plaza");
-        capulatesInPlaza--;
-        cout << "Capulet " << person << " leaves the plaza" << endl;
 
-        if (capulatesInPlaza == 0 && waitingMontagues.size() > 0)
+        while (!workers[w]->connections.empty())
         {
-            // If no capulets are no longer in the plaza, allow all waiting montagues to
-            // get in the plaza
-            for (int i = 0; i < waitingMontagues.size(); i++)
-            {
-                string montague = waitingMontagues[i];
-                std::map<string, sockaddr_storage* >::iterator it = montague_client_addresses.find(montague);
-                cout << "Montague " << montague << " enters the plaza" << endl;
-                montaguesInPlaza++;
-                int ret_val = sendto(socket, &ack_message, sizeof(char), 0, (struct sockaddr *) it->second, sizeof(sockaddr_storage));
-                if (ret_val < 0)
-                {
-                    return ret_val;
-                }
+            CloseConnection(workers[w], workers[w]->connections.begin()->second);
+        }
 
-                delete it->second;
-                montague_client_addresses.erase(montague);
-            }
+        if (workers[w]->tcp_socket >= 0)
+        {
+            close(workers[w]->tcp_socket);
+        }
+
+        if (workers[w]->shard.journal.fd >= 0)
+        {
+            close(workers[w]->shard.journal.fd);
+        }
+
+        close(workers[w]->inbox_fd);
+        close(workers[w]->epoll_fd);
+        delete workers[w];
+    }
+
+    close(wakeup_fd);
+    unlink(UNIX_SOCKET_PATH);
+
+    cout << endl;
+    PrintWaitHistograms(wait_histograms, "us");
+
+    if (DroppedLogRecords() > 0)
+    {
+        cout << endl << DroppedLogRecords() << " log records were dropped, the log writer could not keep up" << endl;
+    }
+
+    cout << endl << "Server finished" << endl;
+    
+    exit(0);
+}
+
+// Event loop of one worker thread: drains its ready sockets and inbox and runs the plaza protocol until the
+// server finishes
+void ServeWorker(Worker * worker)
+{
+    struct epoll_event events[MAX_EVENTS_PER_WAKEUP];
+
+    while (!serverFinished)
+    {
+        // Wake up for the timer wheel while sessions are pending, and for the journal sync that is due
+        PlazaShard& shard = worker->shard;
+        uint64_t now = NowMilliseconds();
+        int timeout = shard.timers.Empty() ? -1 : (int) shard.timers.TimeToNextTick(now);
+        if (shard.journal.unsynced)
+        {
+            int sync_timeout = shard.journal.last_sync + sync_interval > now ? (int) (shard.journal.last_sync + sync_interval - now) : 0;
+            timeout = timeout < 0 ? sync_timeout : min(timeout, sync_timeout);
+        }
+
+        int ready_count = worker->uring != NULL ?
+            WaitUring(worker, events, timeout) :
+            epoll_wait(worker->epoll_fd, events, MAX_EVENTS_PER_WAKEUP, timeout);
+        if (ready_count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            fprintf(stderr, "Waiting for events failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (!shard.timers.Empty())
+        {
+            int evicted = ExpireSessions(shard, NowMilliseconds());
+            if (evicted < 0)
+            {
+                fprintf(stderr, "ExpireSessions() failed: %s\n", strerror(errno));
+                exit(1);
+            }
+
+            // No more clients to process
+            if (evicted > 0 && shouldExit && AllPlazasEmpty())
+            {
+                StopWorkers();
+            }
+        }
+
+        for (int i = 0; i < ready_count && !serverFinished; i++)
+        {
+            int socket = events[i].data.fd;
+            if (socket == wakeup_fd)
+            {
+                continue;
+            }
+
+            if (socket == worker->inbox_fd)
+            {
+                DrainInbox(worker);
+                continue;
+            }
+
+            if (socket == worker->tcp_socket)
+            {
+                AcceptConnections(worker);
+                continue;
+            }
+
+            map<int, Connection *>::iterator connection = worker->connections.find(socket);
+            if (connection != worker->connections.end())
+            {
+                if (((events[i].events & EPOLLOUT) && WriteConnection(worker, connection->second) < 0) ||
+                    ((events[i].events & ~EPOLLOUT) && ReadConnection(worker, connection->second) < 0))
+                {
+                    CloseConnection(worker, connection->second);
+                }
+                continue;
+            }
+
+            // Drain a bounded batch of datagrams with a single syscall, so one busy socket cannot starve the
+            // others. The socket stays readable, so whatever is left over is picked up on the next wakeup
+            struct mmsghdr * message_headers = worker->message_headers;
+            memset(message_headers, 0, sizeof(worker->message_headers));
+            for (int j = 0; j < MAX_DATAGRAMS_PER_WAKEUP; j++)
+            {
+                message_headers[j].msg_hdr.msg_name = &worker->client_addresses[j];
+                message_headers[j].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                message_headers[j].msg_hdr.msg_iov = &worker->message_iovecs[j];
+                message_headers[j].msg_hdr.msg_iovlen = 1;
+            }
+
+            int message_count = recvmmsg(socket, message_headers, MAX_DATAGRAMS_PER_WAKEUP, MSG_DONTWAIT, NULL);
+            if (message_count < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "recvmmsg() did not get a valid message: %s\n", strerror(errno));
+                exit(1);
+            }
+
+            AddToCounter(worker->shard.messages_received, message_count);
+
+            // Only a full batch can have left a long queue behind, so the queue is only measured then
+            bool shed = shed_percent > 0 && message_count == MAX_DATAGRAMS_PER_WAKEUP && ReceiveQueueDeep(socket);
+
+            for (int j = 0; j < message_count && !serverFinished; j++)
+            {
+                ReceiveDatagram(worker, socket, worker->messages[j], message_headers[j].msg_len,
+                    (struct sockaddr *) &worker->client_addresses[j], message_headers[j].msg_hdr.msg_namelen, shed);
+            }
+        }
+
+        // The ACKs of this wakeup go out once the journal records they confirm are durable
+        if (CommitJournal(shard, NowMilliseconds()) < 0)
+        {
+            fprintf(stderr, "Writing the journal failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (FlushAcks(worker) < 0)
+        {
+            fprintf(stderr, "Sending the ACKs failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // A snapshot scans and syncs the whole shard, so it waits until the wakeup's ACKs are out
+        if (SnapshotIfDue(shard) < 0)
+        {
+            fprintf(stderr, "Writing the snapshot failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+// Decodes one received datagram and runs it. The buffer has room for a terminating null character after the
+// datagram, and is 8 byte aligned. shed tells that the datagram came off a receive queue past --shed
+void ReceiveDatagram(Worker * worker, int socket, char * message, size_t length, struct sockaddr * client_addr, socklen_t addr_len, bool shed)
+{
+    message[length] = '\0';
+
+    // Binary messages are decoded in place; text messages are parsed into a local binary message
+    PlazaMessage text_message;
+    const PlazaMessage * request = use_text_protocol ?
+        ParseTextMessage(message, &text_message) :
+        DecodePlazaMessage(message, length);
+
+    if (request == NULL)
+    {
+        fprintf(stderr, "Dropped a malformed message of %zu bytes\n", length);
+        return;
+    }
+
+    // The exit message is not retransmitted, so the loss shim leaves it alone
+    if (request->type != PLAZA_EXIT && DropDatagram(loss_percent))
+    {
+        return;
+    }
+
+    if (IsArrivalMessage(request->type) && !AcceptArrival(worker, shed, client_addr, addr_len))
+    {
+        // A text client never resends, and would wait for an arrival that was dropped forever
+        if (PlazaSequence(request) == 0)
+        {
+            SendReject(socket, request, client_addr, addr_len);
+        }
+        return;
+    }
+
+    DispatchRequest(worker, socket, request, client_addr, addr_len);
+}
+
+// Tells whether the socket's receive queue holds more than --shed percent of what its buffer takes
+bool ReceiveQueueDeep(int socket)
+{
+    uint32_t memory[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(memory);
+    if (getsockopt(socket, SOL_SOCKET, SO_MEMINFO, memory, &length) < 0 || length <= SK_MEMINFO_RCVBUF * sizeof(uint32_t))
+    {
+        return false;
+    }
+
+    return memory[SK_MEMINFO_RMEM_ALLOC] * 100ULL > (uint64_t) memory[SK_MEMINFO_RCVBUF] * shed_percent;
+}
+
+// Decides whether a received arrival is run at all. New arrivals are the work that can wait: while the receive
+// queue is past --shed they are dropped, so the departures queued behind them get through sooner, and so are the
+// arrivals of a client address over --rate-limit. Clients resend a dropped arrival after their timeout
+bool AcceptArrival(Worker * worker, bool shed, const struct sockaddr * client_address, socklen_t client_address_length)
+{
+    if (shed)
+    {
+        AddToCounter(worker->shard.arrivals_shed, 1);
+        return false;
+    }
+
+    if (rate_limit > 0 && !TakeToken(worker, client_address, client_address_length, NowMicroseconds()))
+    {
+        AddToCounter(worker->shard.arrivals_rate_limited, 1);
+        return false;
+    }
+
+    return true;
+}
+
+// Hashes the part of a client address that tells clients apart. For IP clients that is the host alone, whatever
+// the port, so a client cannot get around its limit by opening more sockets. Never returns 0
+uint64_t ClientAddressHash(const struct sockaddr * address, socklen_t address_length)
+{
+    const unsigned char * bytes = (const unsigned char *) address;
+    size_t length = address_length;
+    if (address->sa_family == AF_INET)
+    {
+        bytes = (const unsigned char *) &((const struct sockaddr_in *) address)->sin_addr;
+        length = sizeof(struct in_addr);
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        bytes = (const unsigned char *) &((const struct sockaddr_in6 *) address)->sin6_addr;
+        length = sizeof(struct in6_addr);
+    }
+
+    uint64_t hash = 14695981039346656037ULL ^ address->sa_family;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash | 1;
+}
+
+// Takes a token from the bucket of the client's address, after filling the bucket up for the time since it was
+// last used. Returns false when the bucket is empty. now is in microseconds
+bool TakeToken(Worker * worker, const struct sockaddr * client_address, socklen_t client_address_length, uint64_t now)
+{
+    uint64_t hash = ClientAddressHash(client_address, client_address_length);
+    unsigned int mask = (1U << RATE_LIMIT_BITS) - 1;
+    unsigned int slot = (hash * 0x9E3779B97F4A7C15ULL) >> (64 - RATE_LIMIT_BITS);
+
+    RateBucket * bucket = NULL;
+    RateBucket * stalest = NULL;
+    for (int i = 0; i < RATE_LIMIT_PROBES && bucket == NULL; i++)
+    {
+        RateBucket& candidate = worker->rate_buckets[(slot + i) & mask];
+        if (candidate.address_hash == hash)
+        {
+            bucket = &candidate;
+        }
+        else if (stalest == NULL || candidate.last_refill < stalest->last_refill)
+        {
+            stalest = &candidate;
+        }
+    }
+
+    if (bucket == NULL)
+    {
+        bucket = stalest;
+        bucket->address_hash = hash;
+        bucket->tokens = rate_burst;
+    }
+    else if (now > bucket->last_refill)
+    {
+        bucket->tokens = min(rate_burst, bucket->tokens + (now - bucket->last_refill) * rate_limit / 1000000.0);
+    }
+    bucket->last_refill = now;
+
+    if (bucket->tokens < 1)
+    {
+        return false;
+    }
+
+    bucket->tokens -= 1;
+    return true;
+}
+
+// The io_uring version of epoll_wait(): submits what the worker queued, waits for completions and runs the
+// datagrams they carry, then returns the epoll events of the other descriptors. Those are only polled when the
+// ring's poll on the epoll descriptor fired, or when the last poll may have left events behind
+int WaitUring(Worker * worker, struct epoll_event * events, int timeout)
+{
+    static thread_local vector<struct io_uring_cqe> completions;
+    Uring& uring = *worker->uring;
+
+    completions.clear();
+    completions.swap(worker->deferred_completions);
+
+    bool epoll_ready = worker->epoll_pending;
+    bool have_work = epoll_ready || !completions.empty();
+    if (uring.Enter(have_work ? 0 : 1, have_work ? 0 : timeout) < 0)
+    {
+        return -1;
+    }
+
+    struct io_uring_cqe completion;
+    while (uring.NextCompletion(completion))
+    {
+        completions.push_back(completion);
+    }
+
+    // Like a full recvmmsg() batch, a wakeup's worth of datagrams or a receive out of buffers may have left a long
+    // queue behind
+    if (shed_percent > 0)
+    {
+        int receives[MAX_SOCKETS] = { 0 };
+        for (size_t i = 0; i < completions.size(); i++)
+        {
+            if ((completions[i].user_data & ~0xFFFFFFFFULL) == UringReceive)
+            {
+                receives[(uint32_t) completions[i].user_data] += completions[i].res == -ENOBUFS ? MAX_DATAGRAMS_PER_WAKEUP : 1;
+            }
+        }
+
+        for (int index = 0; index < worker->socket_count; index++)
+        {
+            worker->shedding[index] = receives[index] >= MAX_DATAGRAMS_PER_WAKEUP && ReceiveQueueDeep(worker->sockets[index]);
+        }
+    }
+
+    uint64_t received = 0;
+    for (size_t i = 0; i < completions.size() && !serverFinished; i++)
+    {
+        uint64_t request = completions[i].user_data & ~0xFFFFFFFFULL;
+        if (request == UringReceive)
+        {
+            received += completions[i].res >= 0;
+            ReceiveUringDatagram(worker, completions[i]);
+        }
+        else if (request == UringPoll)
+        {
+            epoll_ready = true;
+            if (!(completions[i].flags & IORING_CQE_F_MORE))
+            {
+                uring.PollMultishot(worker->epoll_fd, UringPoll);
+            }
+        }
+    }
+
+    AddToCounter(worker->shard.messages_received, received);
+
+    int ready_count = epoll_ready ? epoll_wait(worker->epoll_fd, events, MAX_EVENTS_PER_WAKEUP, 0) : 0;
+    worker->epoll_pending = ready_count > 0;
+    return ready_count;
+}
+
+// Runs the datagram of a multishot receive's completion, and gives its buffer back. A receive that stopped (the
+// buffers ran out) is queued again, and gets buffers again once this wakeup has returned them
+void ReceiveUringDatagram(Worker * worker, const struct io_uring_cqe& completion)
+{
+    Uring& uring = *worker->uring;
+    int index = (uint32_t) completion.user_data;
+
+    if (completion.res < 0 && completion.res != -ENOBUFS)
+    {
+        fprintf(stderr, "io_uring receive failed: %s\n", strerror(-completion.res));
+        exit(1);
+    }
+
+    if (!(completion.flags & IORING_CQE_F_MORE))
+    {
+        uring.ReceiveMultishot(worker->sockets[index], &worker->receive_headers[index], UringReceive | index);
+    }
+
+    if (completion.res < 0 || !(completion.flags & IORING_CQE_F_BUFFER))
+    {
+        return;
+    }
+
+    // The buffer holds the receive's header, the address in a sockaddr_storage and the datagram
+    unsigned int buffer_id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    char * buffer = uring.Buffer(buffer_id);
+    const struct io_uring_recvmsg_out * header = (const struct io_uring_recvmsg_out *) buffer;
+    char * address = buffer + sizeof(struct io_uring_recvmsg_out);
+    char * message = address + sizeof(sockaddr_storage);
+    size_t length = min((size_t) header->payloadlen, (size_t) (buffer + completion.res - message));
+    socklen_t address_length = min((socklen_t) header->namelen, (socklen_t) sizeof(sockaddr_storage));
+
+    ReceiveDatagram(worker, worker->sockets[index], message, length, (struct sockaddr *) address, address_length, worker->shedding[index]);
+    uring.ReturnBuffer(buffer_id);
+}
+
+// Sends a batch of ACKs through the ring: one submission for the whole batch, then waits for the sends to
+// complete, since the batch buffers are reused by the next wakeup. Completions of the receives that come in
+// meanwhile are kept for the next WaitUring(). Like sendmmsg(), an ACK the socket cannot take is dropped
+int SendUring(Worker * worker, int socket, vector<struct mmsghdr>& headers)
+{
+    Uring& uring = *worker->uring;
+    int outstanding = 0;
+    int error = 0;
+
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        // A full submission queue is submitted, and the rest of the batch goes in the next submission
+        while (!uring.SendMessage(socket, &headers[i].msg_hdr, MSG_DONTWAIT, UringSend))
+        {
+            if (uring.Enter(0, 0) < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+        }
+        outstanding++;
+    }
+
+    while (outstanding > 0)
+    {
+        if (uring.Enter(1, -1) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+
+        struct io_uring_cqe completion;
+        while (uring.NextCompletion(completion))
+        {
+            if (completion.user_data != UringSend)
+            {
+                worker->deferred_completions.push_back(completion);
+                continue;
+            }
+
+            outstanding--;
+            if (completion.res < 0 && IsDestinationError(-completion.res))
+            {
+                AddToCounter(worker->shard.acks_dropped, 1);
+            }
+            else if (completion.res < 0 && error == 0)
+            {
+                error = -completion.res;
+            }
+        }
+    }
+
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Tells the send errors that are about one datagram's destination rather than the socket: the client's queue is
+// full, its Unix socket is gone, or nothing listens at or routes to its address. Only that client misses its ACK
+bool IsDestinationError(int error)
+{
+    return error == EAGAIN || error == EWOULDBLOCK || error == ENOENT || error == ECONNREFUSED || error == EHOSTUNREACH ||
+        error == ENETUNREACH || error == EHOSTDOWN || error == ENETDOWN || error == EADDRNOTAVAIL || error == EACCES || error == EPERM;
+}
+
+// Runs a request against its plaza if this worker owns the plaza, and hands it off to the owner otherwise
+void DispatchRequest(Worker * worker, int socket, const PlazaMessage * request, struct sockaddr * client_addr, socklen_t addr_len)
+{
+    if (IsExitMessage(request->type))
+    {
+        shouldExit = true;
+        return;
+    }
+
+    // Any worker can answer a stats query, the stats are read from every worker
+    if (IsStatsQuery(request->type))
+    {
+        if (IsLocalAddress(client_addr) && SendStats(socket, client_addr, addr_len) < 0)
+        {
+            fprintf(stderr, "SendStats() failed: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    // A stray message, an ACK sent back say, must not take the server down
+    if (!IsKnownMessage(request->type))
+    {
+        AddToCounter(worker->shard.messages_unknown, 1);
+        return;
+    }
+
+    int owner = PlazaId(request) % workers.size();
+    if (owner != worker->id)
+    {
+        HandOffRequest(workers[owner], socket, request, client_addr, addr_len);
+        return;
+    }
+
+    if (IsArrivalMessage(request->type))
+    {
+        if (HandleArrivalMessage(worker->shard, socket, request, client_addr, addr_len) < 0)
+        {
+            fprintf(stderr, "HandleArrivalMessage() failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    else
+    {
+        if (HandleDepatureMessage(worker->shard, socket, request, client_addr, addr_len) < 0)
+        {
+            fprintf(stderr, "HandleDepatureMessage() failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // No more clients to process
+        if (shouldExit && AllPlazasEmpty())
+        {
+            StopWorkers();
+        }
+    }
+}
+
+// Queues a copy of the request in the owner's inbox, and wakes the owner up if the inbox was empty
+void HandOffRequest(Worker * owner, int socket, const PlazaMessage * request, struct sockaddr * client_addr, socklen_t addr_len)
+{
+    HandOff hand_off;
+    memcpy(&hand_off.message, request, sizeof(PlazaMessage));
+    hand_off.socket = socket;
+    hand_off.length = addr_len;
+    memcpy(&hand_off.address, client_addr, addr_len);
+
+    bool was_empty;
+    {
+        lock_guard<mutex> lock(owner->inbox_lock);
+        was_empty = owner->inbox.empty();
+        owner->inbox.push_back(hand_off);
+    }
+
+    uint64_t wakeup = 1;
+    if (was_empty && write(owner->inbox_fd, &wakeup, sizeof(wakeup)) < 0)
+    {
+        fprintf(stderr, "write() failed to wake up worker %d: %s\n", owner->id, strerror(errno));
+    }
+}
+
+void DrainInbox(Worker * worker)
+{
+    static thread_local vector<HandOff> hand_offs;
+
+    uint64_t wakeups;
+    if (read(worker->inbox_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+    {
+        fprintf(stderr, "read() failed on the inbox: %s\n", strerror(errno));
+    }
+
+    {
+        lock_guard<mutex> lock(worker->inbox_lock);
+        hand_offs.swap(worker->inbox);
+    }
+
+    for (size_t i = 0; i < hand_offs.size() && !serverFinished; i++)
+    {
+        HandOff& hand_off = hand_offs[i];
+
+        // A reply for one of this worker's connections, from the worker owning the plaza
+        if (hand_off.message.type == PLAZA_ENTRY_ACK || hand_off.message.type == PLAZA_DEPARTURE_ACK || hand_off.message.type == PLAZA_REJECT)
+        {
+            QueueAck(hand_off.socket, &hand_off.message, sizeof(PlazaMessage), (struct sockaddr *) &hand_off.address, hand_off.length);
+            continue;
+        }
+
+        DispatchRequest(worker, hand_off.socket, &hand_off.message, (struct sockaddr *) &hand_off.address, hand_off.length);
+    }
+
+    hand_offs.clear();
+}
+
+// Steers datagrams on the socket's SO_REUSEPORT group to the socket of the worker that owns their plaza. Sockets
+// join the group in worker order, so the filter returns plaza id % workers. Version 1 messages are too short for
+// the load, which makes the filter return 0: worker 0, the owner of plaza 0
+int AttachPlazaSteering(int socket, int worker_count)
+{
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, PLAZA_ID_OFFSET },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) worker_count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+
+    struct sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    // Without the filter the kernel spreads clients by address, and the workers hand messages off instead
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0)
+    {
+        fprintf(stderr, "setsockopt() Error attaching the plaza steering filter: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Each shard's occupant count is written only by its owner, so reading them all is a snapshot good enough to tell
+// the last departure after the exit message
+bool AllPlazasEmpty()
+{
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        if (workers[w]->shard.occupants.load(memory_order_relaxed) > 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Finishes the server and wakes up every worker blocked in epoll_wait()
+void StopWorkers()
+{
+    serverFinished = true;
+
+    uint64_t wakeup = 1;
+    if (write(wakeup_fd, &wakeup, sizeof(wakeup)) < 0)
+    {
+        fprintf(stderr, "write() failed to wake up the workers: %s\n", strerror(errno));
+    }
+}
+
+// Measures arrivals per second through the plaza state machine, without sockets or logging, for 1, 2, 4, ... up to
+// max_threads threads. Each thread owns a shard of BENCHMARK_PLAZAS plazas, like a worker, and sends a random mix,
+// three Montagues to one Capulet (or the given number of families in equal parts), to random plazas while keeping
+// BENCHMARK_OCCUPANTS people inside. Every plaza has to end up empty.
+// Time is counted in arrivals, so the wait-time columns (p99 per family) are in arrivals too and show the fairness
+// of the admission policy
+int BenchmarkPlazaState(int max_threads, int families)
+{
+    fprintf(stdout, "%8s %14s %12s %12s %12s\n", "threads", "arrivals/s", "waited", "p99 M wait", "p99 C wait");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        atomic<unsigned long> waited_total(0);
+        atomic<bool> failed(false);
+        vector<thread> benchmark_threads;
+        vector<PlazaShard *> shards;
+
+        for (int t = 0; t < threads; t++)
+        {
+            shards.push_back(new PlazaShard);
+            InitializeShard(*shards[t], MAX_WAITERS);
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (int t = 0; t < threads; t++)
+        {
+            benchmark_threads.push_back(thread([t, families, &waited_total, &failed, &shards]()
+            {
+                PlazaShard& shard = *shards[t];
+
+                ClientAddress client;
+                memset(&client, 0, sizeof(client));
+                uint64_t random = 0x9E3779B97F4A7C15ULL * (t + 1);
+                unsigned long waited = 0;
+
+                // People in the plazas, oldest first, as (plaza id, family)
+                deque<pair<uint32_t, PlazaFamily> > inside;
+
+                for (int i = 0; i <= BENCHMARK_OPERATIONS; i++)
+                {
+                    bool admitted = false;
+                    if (i < BENCHMARK_OPERATIONS)
+                    {
+                        random ^= random << 13;
+                        random ^= random >> 7;
+                        random ^= random << 17;
+
+                        uint32_t plaza_id = (random >> 8) % BENCHMARK_PLAZAS;
+                        PlazaFamily family = families > 2 ? (PlazaFamily) (1 + (random >> 40) % families) :
+                            (random & 3) ? Montague : Capulet;
+                        client.person_id = random;
+
+                        ArrivalResult result = ArriveAtPlaza(shard, FindPlaza(shard, plaza_id), family, client, i);
+                        if (result == Admitted)
+                        {
+                            inside.push_back(make_pair(plaza_id, family));
+                            admitted = true;
+                        }
+                        waited += result == Waiting;
+                    }
+
+                    // The oldest people leave, one for each arrival that did not get in and as many as it takes to
+                    // bring the plazas back to BENCHMARK_OCCUPANTS people. Whoever their departures let in joins
+                    // the people inside. After the last arrival everybody leaves
+                    while (!inside.empty() && (!admitted || inside.size() > (i < BENCHMARK_OPERATIONS ? BENCHMARK_OCCUPANTS : 0)))
+                    {
+                        admitted = true;
+                        pair<uint32_t, PlazaFamily> person = inside.front();
+                        inside.pop_front();
+
+                        WaiterQueue released;
+                        PlazaFamily released_family = DepartFromPlaza(shard, FindPlaza(shard, person.first), person.second, released, i);
+                        for (unsigned int j = 0; j < released.count; j++)
+                        {
+                            inside.push_back(make_pair(person.first, released_family));
+                        }
+                        ReleaseWaiters(shard, released);
+                    }
+                }
+
+                for (size_t p = 0; p < shard.plazas.size(); p++)
+                {
+                    if (shard.plazas[p].state != 0 || shard.plazas[p].first_family != NO_FAMILY_QUEUE)
+                    {
+                        failed = true;
+                    }
+                }
+
+                if (shard.free_waiters.count != shard.waiter_pool.size() || shard.occupants.load() != 0)
+                {
+                    failed = true;
+                }
+
+                waited_total += waited;
+            }));
+        }
+
+        for (int t = 0; t < threads; t++)
+        {
+            benchmark_threads[t].join();
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        HistogramSnapshot wait_histograms[Capulet + 1];
+        memset(wait_histograms, 0, sizeof(wait_histograms));
+        for (int t = 0; t < threads; t++)
+        {
+            for (int family = Montague; family <= Capulet; family++)
+            {
+                AddHistogram(wait_histograms[family], shards[t]->family_stats[family].waits);
+            }
+            delete shards[t];
+        }
+
+        if (failed)
+        {
+            fprintf(stderr, "The plazas were not left empty after the benchmark\n");
+            return -1;
+        }
+
+        fprintf(stdout, "%8d %14.0f %12lu %12lu %12lu\n", threads, threads * (double) BENCHMARK_OPERATIONS / seconds, waited_total.load(),
+            HistogramPercentile(wait_histograms[Montague], 0.99), HistogramPercentile(wait_histograms[Capulet], 0.99));
+    }
+
+    return 0;
+}
+
+// Creates a non-blocking UDP socket bound to PORTNUM for the given address family (AF_INET or AF_INET6).
+// The port is shared with the sockets of the other workers through SO_REUSEPORT
+int OpenInetSocket(int address_family, int type, bool announce)
+{
+    socklen_t addrlen;
+    sockaddr_storage server_addr;
+    memset(&server_addr, 0, sizeof(server_addr)); // clear out address
+
+    //create socket
+    int s = socket(address_family, type | SOCK_NONBLOCK, 0);
+    if (s < 0) 
+    {
+        fprintf(stderr, "socket() Socket was not created: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // ensure that the same IP address can be reused after for the socket in a single terminal instance
+    const int optVal = 1;
+    const socklen_t optLen = sizeof(optVal);
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void*)&optVal, optLen) != 0) 
+    {
+        fprintf(stderr, "setsockopt() Error setting reuse-address option: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void*)&optVal, optLen) != 0)
+    {
+        fprintf(stderr, "setsockopt() Error setting reuse-port option: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    //server socket properties
+    if (address_family == AF_INET6)
+    {
+        // Leave IPv4 traffic to the IPv4 socket, both are bound to the same port
+        if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&optVal, optLen) != 0)
+        {
+            fprintf(stderr, "setsockopt() Error setting IPv6-only option: %s\n", strerror(errno));
+            close(s);
+            return -1;
+        }
+
+        struct sockaddr_in6 * server_addr6 = (struct sockaddr_in6 *) &server_addr;
+        server_addr6->sin6_family = AF_INET6;
+        server_addr6->sin6_port = htons(PORTNUM);
+        server_addr6->sin6_addr = in6addr_any;
+        addrlen = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        struct sockaddr_in * server_addr4 = (struct sockaddr_in *) &server_addr;
+        server_addr4->sin_family = AF_INET;
+        server_addr4->sin_port = htons(PORTNUM);
+        server_addr4->sin_addr.s_addr = INADDR_ANY;
+        addrlen = sizeof(struct sockaddr_in);
+    }
+
+    // bind() associate socket with port on the machine
+    if (bind(s, (struct sockaddr *) &server_addr, addrlen) < 0) 
+    {
+        fprintf(stderr, "bind() Error binding server: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (type == SOCK_STREAM && listen(s, TCP_BACKLOG) < 0)
+    {
+        fprintf(stderr, "listen() failed: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    // retrieve resolved server socket information
+    if (getsockname(s, (struct sockaddr *) &server_addr, &addrlen) < 0) 
+    {
+        fprintf(stderr, "getsockname() failed to get port number: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    in_port_t port = address_family == AF_INET6 ? ((struct sockaddr_in6 *) &server_addr)->sin6_port : ((struct sockaddr_in *) &server_addr)->sin_port;
+    if (announce)
+    {
+        fprintf(stdout, "The assigned %s%s port is %d\n", address_family == AF_INET6 ? "IPv6" : "IPv4", type == SOCK_STREAM ? " TCP" : "", ntohs(port));
+    }
+
+    return s;
+}
+
+// Creates a non-blocking Unix datagram socket bound to the given path, for clients on the same machine.
+// Those clients have to bind their own socket to a path to receive replies
+int OpenUnixSocket(const char * path)
+{
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+
+    int s = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (s < 0)
+    {
+        fprintf(stderr, "socket() Unix socket was not created: %s\n", strerror(errno));
+        return -1;
+    }
+
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+
+    // Remove the socket file left behind by a previous run
+    unlink(path);
+
+    if (bind(s, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0)
+    {
+        fprintf(stderr, "bind() Error binding Unix socket: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    fprintf(stdout, "The Unix socket path is %s\n", path);
+
+    return s;
+}
+
+// Parses a text protocol message ("A Romeo Montague [plaza]") into a binary message. The person id is the hash of
+// the name, and the name is kept for logging. The plaza id defaults to plaza 0
+const PlazaMessage * ParseTextMessage(const char * text, PlazaMessage * message)
+{
+    static thread_local istringstream input_stream;
+    char message_type;
+    string person;
+    string family;
+    uint32_t plaza_id;
+
+    input_stream.clear();
+    input_stream.str(text);
+    input_stream >> message_type;
+    if (IsStatsQuery(message_type))
+    {
+        EncodePlazaMessage(message, message_type, NoFamily, 0, 0);
+        return message;
+    }
+
+    input_stream >> person >> family;
+    if (!input_stream)
+    {
+        return NULL;
+    }
+
+    if (!(input_stream >> plaza_id) || plaza_id == NO_PLAZA)
+    {
+        plaza_id = 0;
+    }
+
+    uint64_t person_id = PlazaPersonIdFromName(person);
+    EncodePlazaMessage(message, message_type, PlazaFamilyFromName(family), person_id, 0, plaza_id);
+
+    if (IsArrivalMessage(message_type))
+    {
+        lock_guard<mutex> lock(person_names_lock);
+        person_names[person_id] = person;
+    }
+
+    return message;
+}
+
+string PersonName(uint64_t person_id)
+{
+    lock_guard<mutex> lock(person_names_lock);
+    map<uint64_t, string>::iterator it = person_names.find(person_id);
+    if (it != person_names.end())
+    {
+        return it->second;
+    }
+
+    return "#" + to_string(person_id);
+}
+
+bool IsArrivalMessage(char message_type)
+{
+    return toupper(message_type) == 'A';
+}
+
+bool IsDepatureMessage(char message_type)
+{
+    return toupper(message_type) == 'D';
+}
+
+bool IsExitMessage(char message_type)
+{
+    return toupper(message_type) == 'X';
+}
+
+bool IsStatsQuery(char message_type)
+{
+    return toupper(message_type) == PLAZA_STATS_QUERY;
+}
+
+// The message types a client sends the server. Replies like the ACKs are not among them
+bool IsKnownMessage(char message_type)
+{
+    return IsArrivalMessage(message_type) || IsDepatureMessage(message_type) || IsExitMessage(message_type) || IsStatsQuery(message_type);
+}
+
+// Queues a person event for the log writer if the log level asks for it. Never blocks: when the thread's ring is
+// full the record is dropped and counted. Returns false when the event is not going to be logged
+bool LogPersonEvent(uint32_t plaza_id, PlazaFamily family, uint64_t person_id, LogEvent event)
+{
+    int level = event == PersonArrives ? LogDebug : LogInfo;
+    if (log_level.load(memory_order_relaxed) < level)
+    {
+        return false;
+    }
+
+    LogRing * ring = ThreadLogRing();
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    if (tail - ring->head.load(memory_order_acquire) == LOG_RING_SIZE)
+    {
+        AddToCounter(ring->dropped, 1);
+        return false;
+    }
+
+    LogRecord& record = ring->records[tail & (LOG_RING_SIZE - 1)];
+    record.time = NowMicroseconds();
+    record.person_id = person_id;
+    record.plaza_id = plaza_id;
+    record.family = family;
+    record.event = event;
+    ring->tail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+// The text protocol's names are needed until the person's last event has been written, so the log writer forgets
+// them. People whose departure is not logged are forgotten right away
+void ForgetPersonName(uint64_t person_id)
+{
+    if (use_text_protocol)
+    {
+        lock_guard<mutex> lock(person_names_lock);
+        person_names.erase(person_id);
+    }
+}
+
+LogRing * ThreadLogRing()
+{
+    static thread_local LogRing * ring = NULL;
+    if (ring == NULL)
+    {
+        ring = new LogRing();
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+
+        lock_guard<mutex> lock(log_rings_lock);
+        log_rings.push_back(ring);
+    }
+
+    return ring;
+}
+
+// Log writer thread: takes what is in every ring, puts it in time order, and writes it out in one go. Sleeps a
+// little when there is nothing to write, so the workers never have to wake it up
+void WriteLog()
+{
+    const char * event_names[] = { "arrives", "enters the plaza", "leaves the plaza", "is evicted from the plaza" };
+    vector<LogRecord> records;
+    string text;
+
+    while (true)
+    {
+        bool finished = logFinished;
+        records.clear();
+
+        {
+            lock_guard<mutex> lock(log_rings_lock);
+            for (size_t r = 0; r < log_rings.size(); r++)
+            {
+                LogRing * ring = log_rings[r];
+                uint64_t head = ring->head.load(memory_order_relaxed);
+                uint64_t tail = ring->tail.load(memory_order_acquire);
+                for (; head != tail; head++)
+                {
+                    records.push_back(ring->records[head & (LOG_RING_SIZE - 1)]);
+                }
+                ring->head.store(head, memory_order_release);
+            }
+        }
+
+        // The rings were read one after the other, so records of different threads only sort out within a batch
+        stable_sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+
+        text.clear();
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            LogRecord& record = records[i];
+            if (record.plaza_id != 0)
+            {
+                text += "Plaza " + to_string(record.plaza_id) + ": ";
+            }
+            text += string(PlazaFamilyName(record.family)) + " " + PersonName(record.person_id) + " " + event_names[record.event] + "\n";
+
+            if (record.event == PersonLeaves || record.event == PersonIsEvicted)
+            {
+                ForgetPersonName(record.person_id);
+            }
+        }
+
+        if (!text.empty())
+        {
+            cout << text << flush;
+        }
+        else if (finished)
+        {
+            return;
+        }
+        else
+        {
+            this_thread::sleep_for(chrono::milliseconds(LOG_IDLE_SLEEP));
+        }
+    }
+}
+
+uint64_t DroppedLogRecords()
+{
+    lock_guard<mutex> lock(log_rings_lock);
+    uint64_t dropped = 0;
+    for (size_t r = 0; r < log_rings.size(); r++)
+    {
+        dropped += log_rings[r]->dropped.load(memory_order_relaxed);
+    }
+
+    return dropped;
+}
+
+// SIGUSR1 and SIGUSR2 handler. Only changes an atomic, which is safe in a signal handler
+void ChangeLogLevel(int signal_number)
+{
+    int level = log_level.load(memory_order_relaxed);
+    if (signal_number == SIGUSR1 && level < LogDebug)
+    {
+        log_level.store(level + 1, memory_order_relaxed);
+    }
+    else if (signal_number == SIGUSR2 && level > LogQuiet)
+    {
+        log_level.store(level - 1, memory_order_relaxed);
+    }
+}
+
+unsigned int PlazaOccupants(uint32_t state)
+{
+    return state & ((1U << OCCUPANT_BITS) - 1);
+}
+
+PlazaFamily PlazaInsideFamily(uint32_t state)
+{
+    return (PlazaFamily) (state >> FAMILY_SHIFT);
+}
+
+uint32_t MakePlazaState(unsigned int occupants, PlazaFamily family)
+{
+    assert(occupants < (1U << OCCUPANT_BITS) && "Too many people in the plaza");
+    return occupants == 0 ? 0 : occupants | ((uint32_t) family << FAMILY_SHIFT);
+}
+
+uint64_t NowMicroseconds()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t NowMilliseconds()
+{
+    return NowMicroseconds() / 1000;
+}
+
+// Sets up an empty plaza table and links the whole waiter pool into the free list
+void InitializeShard(PlazaShard& shard, unsigned int waiter_capacity)
+{
+    Plaza empty_plaza;
+    memset(&empty_plaza, 0, sizeof(empty_plaza));
+    empty_plaza.id = NO_PLAZA;
+    empty_plaza.first_family = empty_plaza.last_family = NO_FAMILY_QUEUE;
+
+    shard.plaza_bits = 0;
+    while ((1U << shard.plaza_bits) < INITIAL_PLAZA_SLOTS)
+    {
+        shard.plaza_bits++;
+    }
+    shard.plazas.assign(1U << shard.plaza_bits, empty_plaza);
+    shard.plaza_count = 0;
+
+    shard.waiter_pool.resize(waiter_capacity);
+    for (unsigned int i = 0; i < waiter_capacity; i++)
+    {
+        shard.waiter_pool[i].next = i + 1 < waiter_capacity ? (int) i + 1 : NO_WAITER;
+    }
+
+    shard.free_waiters.head = 0;
+    shard.free_waiters.tail = waiter_capacity - 1;
+    shard.free_waiters.count = waiter_capacity;
+
+    shard.family_queues.resize(waiter_capacity);
+    for (unsigned int i = 0; i < waiter_capacity; i++)
+    {
+        shard.family_queues[i].next = i + 1 < waiter_capacity ? (int) i + 1 : NO_FAMILY_QUEUE;
+    }
+    shard.free_family_queues = 0;
+
+    shard.family_queue_bits = 0;
+    while ((1U << shard.family_queue_bits) < 2 * waiter_capacity)
+    {
+        shard.family_queue_bits++;
+    }
+    shard.family_queue_table.assign(1U << shard.family_queue_bits, NO_FAMILY_QUEUE);
+    shard.occupants = 0;
+    for (int family = NoFamily; family <= Capulet; family++)
+    {
+        ClearHistogram(shard.family_stats[family].waits);
+        ClearHistogram(shard.family_stats[family].stays);
+        ClearHistogram(shard.family_stats[family].queue_lengths);
+        shard.family_stats[family].waiting = 0;
+    }
+    shard.messages_received = 0;
+    shard.messages_unknown = 0;
+    shard.messages_malformed = 0;
+    shard.arrivals_rejected = 0;
+    shard.arrivals_rate_limited = 0;
+    shard.arrivals_shed = 0;
+    shard.departures_unmatched = 0;
+    shard.acks_dropped = 0;
+
+    Session empty_session;
+    memset(&empty_session, 0, sizeof(empty_session));
+    empty_session.person_id = NO_PERSON;
+
+    shard.session_bits = 0;
+    while ((1U << shard.session_bits) < INITIAL_SESSION_SLOTS)
+    {
+        shard.session_bits++;
+    }
+    shard.sessions.assign(1U << shard.session_bits, empty_session);
+    shard.session_count = 0;
+    shard.timers = TimerWheel(TIMER_SLOTS, TIMER_TICK, NowMilliseconds());
+
+    shard.journal.fd = -1;
+    shard.journal.id = 0;
+    shard.journal.generation = 0;
+    shard.journal.lsn = 0;
+    shard.journal.records_since_snapshot = 0;
+    shard.journal.last_sync = 0;
+    shard.journal.unsynced = false;
+}
+
+// Returns the plaza with the given id, adding an empty one the first time the id is seen. The table doubles when
+// it is 3/4 full, which moves the plazas, so the returned reference is only good until the next call
+Plaza& FindPlaza(PlazaShard& shard, uint32_t plaza_id)
+{
+    // Fibonacci hashing spreads the ids of a shard, which all have the same remainder modulo the worker count
+    unsigned int mask = (1U << shard.plaza_bits) - 1;
+    unsigned int slot = (plaza_id * 0x9E3779B97F4A7C15ULL) >> (64 - shard.plaza_bits);
+
+    while (shard.plazas[slot].id != plaza_id)
+    {
+        if (shard.plazas[slot].id == NO_PLAZA)
+        {
+            if ((shard.plaza_count + 1) * 4 > shard.plazas.size() * 3)
+            {
+                vector<Plaza> old_plazas;
+                old_plazas.swap(shard.plazas);
+
+                Plaza empty_plaza;
+                memset(&empty_plaza, 0, sizeof(empty_plaza));
+                empty_plaza.id = NO_PLAZA;
+                empty_plaza.first_family = empty_plaza.last_family = NO_FAMILY_QUEUE;
+
+                shard.plaza_bits++;
+                shard.plazas.assign(1U << shard.plaza_bits, empty_plaza);
+                shard.plaza_count = 0;
+
+                for (size_t i = 0; i < old_plazas.size(); i++)
+                {
+                    if (old_plazas[i].id != NO_PLAZA)
+                    {
+                        FindPlaza(shard, old_plazas[i].id) = old_plazas[i];
+                    }
+                }
+
+                return FindPlaza(shard, plaza_id);
+            }
+
+            shard.plazas[slot].id = plaza_id;
+            shard.plazas[slot].first_family = shard.plazas[slot].last_family = NO_FAMILY_QUEUE;
+            shard.plaza_count++;
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return shard.plazas[slot];
+}
+
+// Returns the plaza with the given id, or NULL if the id has not been seen. Unlike FindPlaza() it never adds a
+// plaza, so requests that cannot change an empty plaza do not grow the table
+Plaza * LookupPlaza(PlazaShard& shard, uint32_t plaza_id)
+{
+    unsigned int mask = (1U << shard.plaza_bits) - 1;
+    unsigned int slot = (plaza_id * 0x9E3779B97F4A7C15ULL) >> (64 - shard.plaza_bits);
+
+    while (shard.plazas[slot].id != plaza_id)
+    {
+        if (shard.plazas[slot].id == NO_PLAZA)
+        {
+            return NULL;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return &shard.plazas[slot];
+}
+
+// Only the shard's owner writes its occupant count, so a plain load and store keep it without a locked instruction
+void CountOccupants(PlazaShard& shard, long change)
+{
+    shard.occupants.store(shard.occupants.load(memory_order_relaxed) + change, memory_order_relaxed);
+}
+
+// Montagues and Capulets have stats of their own, the other families share a slot
+FamilyStats& StatsOf(PlazaShard& shard, PlazaFamily family)
+{
+    return shard.family_stats[family <= Capulet ? family : OTHER_FAMILIES];
+}
+
+unsigned int FamilyQueueSlot(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family)
+{
+    return ((((uint64_t) plaza_id << 8) | family) * 0x9E3779B97F4A7C15ULL) >> (64 - shard.family_queue_bits);
+}
+
+// Returns the queue of the family's people waiting for the plaza, or NULL when none of them is waiting
+FamilyQueue * FindFamilyQueue(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family)
+{
+    unsigned int mask = (1U << shard.family_queue_bits) - 1;
+    for (unsigned int slot = FamilyQueueSlot(shard, plaza_id, family); shard.family_queue_table[slot] != NO_FAMILY_QUEUE; slot = (slot + 1) & mask)
+    {
+        FamilyQueue& queue = shard.family_queues[shard.family_queue_table[slot]];
+        if (queue.plaza_id == plaza_id && queue.family == family)
+        {
+            return &queue;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the family's queue for the plaza, or NULL when none of them is waiting. The ends of the line are looked at
+// first, so with two families waiting or fewer the hash table is never needed
+FamilyQueue * WaitingFamily(PlazaShard& shard, Plaza& plaza, PlazaFamily family)
+{
+    if (plaza.first_family == NO_FAMILY_QUEUE)
+    {
+        return NULL;
+    }
+
+    FamilyQueue& first = shard.family_queues[plaza.first_family];
+    FamilyQueue& last = shard.family_queues[plaza.last_family];
+    if (first.family == family)
+    {
+        return &first;
+    }
+    else if (last.family == family)
+    {
+        return &last;
+    }
+    else if (plaza.first_family == plaza.last_family || first.next == plaza.last_family)
+    {
+        return NULL;
+    }
+
+    return FindFamilyQueue(shard, plaza.id, family);
+}
+
+// Takes an empty queue for the family off the free list and puts it last in line for the plaza. Returns NULL when
+// the pool is exhausted, which only happens together with the waiter pool
+FamilyQueue * AddFamilyQueue(PlazaShard& shard, Plaza& plaza, PlazaFamily family)
+{
+    int index = shard.free_family_queues;
+    if (index == NO_FAMILY_QUEUE)
+    {
+        return NULL;
+    }
+
+    FamilyQueue& queue = shard.family_queues[index];
+    shard.free_family_queues = queue.next;
+    queue.plaza_id = plaza.id;
+    queue.family = family;
+    queue.waiters.head = queue.waiters.tail = NO_WAITER;
+    queue.waiters.count = 0;
+
+    unsigned int mask = (1U << shard.family_queue_bits) - 1;
+    unsigned int slot = FamilyQueueSlot(shard, plaza.id, family);
+    while (shard.family_queue_table[slot] != NO_FAMILY_QUEUE)
+    {
+        slot = (slot + 1) & mask;
+    }
+    shard.family_queue_table[slot] = index;
+
+    queue.previous = plaza.last_family;
+    queue.next = NO_FAMILY_QUEUE;
+    if (plaza.last_family == NO_FAMILY_QUEUE)
+    {
+        plaza.first_family = index;
+    }
+    else
+    {
+        shard.family_queues[plaza.last_family].next = index;
+    }
+    plaza.last_family = index;
+
+    return &queue;
+}
+
+// Takes the queue out of the plaza's line
+void UnlinkFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue)
+{
+    if (queue.previous == NO_FAMILY_QUEUE)
+    {
+        plaza.first_family = queue.next;
+    }
+    else
+    {
+        shard.family_queues[queue.previous].next = queue.next;
+    }
+
+    if (queue.next == NO_FAMILY_QUEUE)
+    {
+        plaza.last_family = queue.previous;
+    }
+    else
+    {
+        shard.family_queues[queue.next].previous = queue.previous;
+    }
+}
+
+// Puts an unlinked queue back in the plaza's line: last, or under strict order behind the queues whose first
+// waiter arrived before its own. The walk starts at the back, where a queue cut short by a release belongs
+void LinkFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue)
+{
+    int index = &queue - &shard.family_queues[0];
+    int previous = plaza.last_family;
+    if (admission_policy == StrictOrder)
+    {
+        uint64_t arrival = shard.waiter_pool[queue.waiters.head].client.arrival_time;
+        while (previous != NO_FAMILY_QUEUE &&
+            shard.waiter_pool[shard.family_queues[previous].waiters.head].client.arrival_time > arrival)
+        {
+            previous = shard.family_queues[previous].previous;
+        }
+    }
+
+    queue.previous = previous;
+    queue.next = previous == NO_FAMILY_QUEUE ? plaza.first_family : shard.family_queues[previous].next;
+    if (previous == NO_FAMILY_QUEUE)
+    {
+        plaza.first_family = index;
+    }
+    else
+    {
+        shard.family_queues[previous].next = index;
+    }
+
+    if (queue.next == NO_FAMILY_QUEUE)
+    {
+        plaza.last_family = index;
+    }
+    else
+    {
+        shard.family_queues[queue.next].previous = index;
+    }
+}
+
+// Takes an empty queue out of the plaza's line and the table, shifting the rest of its probe run back like
+// RemoveSession(), and returns it to the free list
+void RemoveFamilyQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue)
+{
+    int index = &queue - &shard.family_queues[0];
+    UnlinkFamilyQueue(shard, plaza, queue);
+
+    unsigned int mask = (1U << shard.family_queue_bits) - 1;
+    unsigned int hole = FamilyQueueSlot(shard, queue.plaza_id, queue.family);
+    while (shard.family_queue_table[hole] != index)
+    {
+        hole = (hole + 1) & mask;
+    }
+
+    for (unsigned int next = (hole + 1) & mask; shard.family_queue_table[next] != NO_FAMILY_QUEUE; next = (next + 1) & mask)
+    {
+        FamilyQueue& moved = shard.family_queues[shard.family_queue_table[next]];
+        unsigned int home = FamilyQueueSlot(shard, moved.plaza_id, moved.family);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            shard.family_queue_table[hole] = shard.family_queue_table[next];
+            hole = next;
+        }
+    }
+    shard.family_queue_table[hole] = NO_FAMILY_QUEUE;
+
+    queue.next = shard.free_family_queues;
+    shard.free_family_queues = index;
+}
+
+// Somebody of another family than the given one is waiting for the plaza
+bool OthersWaiting(PlazaShard& shard, Plaza& plaza, PlazaFamily family)
+{
+    return plaza.first_family != NO_FAMILY_QUEUE &&
+        (plaza.first_family != plaza.last_family || shard.family_queues[plaza.first_family].family != family);
+}
+
+// The family in the plaza has used up its batch or its time slice
+bool TurnIsOver(Plaza& plaza, uint64_t now)
+{
+    return (max_batch > 0 && plaza.turn_admissions >= max_batch) ||
+        (time_slice > 0 && (uint32_t) (now / 1000) - plaza.turn_start >= time_slice);
+}
+
+// Nobody gets ahead of a waiting person of their own family, nor into a full plaza. Otherwise a family can walk into
+// an empty plaza, or into a plaza it already holds unless the admission policy makes it wait for the others
+bool CanEnterPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, uint64_t now)
+{
+    unsigned int occupants = PlazaOccupants(plaza.state);
+    if ((occupants > 0 && PlazaInsideFamily(plaza.state) != family) || (plaza_capacity > 0 && occupants >= plaza_capacity))
+    {
+        return false;
+    }
+
+    if (WaitingFamily(shard, plaza, family) != NULL)
+    {
+        return false;
+    }
+
+    if (occupants == 0 || !OthersWaiting(shard, plaza, family))
+    {
+        return true;
+    }
+
+    return admission_policy == Greedy && !TurnIsOver(plaza, now);
+}
+
+void StartTurn(Plaza& plaza, PlazaFamily family, unsigned int admissions, uint64_t now)
+{
+    plaza.state = MakePlazaState(admissions, family);
+    plaza.turn_admissions = admissions;
+    plaza.turn_start = now / 1000;
+}
+
+// Lets the person in when the admission policy allows it, and otherwise queues a copy of the client's address until
+// the plaza is handed over to the person's family. now is in microseconds
+ArrivalResult ArriveAtPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, ClientAddress& client, uint64_t now)
+{
+    client.arrival_time = now;
+
+    if (CanEnterPlaza(shard, plaza, family, now))
+    {
+        if (PlazaOccupants(plaza.state) == 0)
+        {
+            StartTurn(plaza, family, 1, now);
+        }
+        else
+        {
+            plaza.state = MakePlazaState(PlazaOccupants(plaza.state) + 1, family);
+            plaza.turn_admissions++;
+        }
+
+        CountOccupants(shard, 1);
+        RecordValue(StatsOf(shard, family).waits, 0);
+        return Admitted;
+    }
+
+    FamilyQueue * queue = EnqueueWaiter(shard, plaza, family);
+    if (queue == NULL)
+    {
+        return TurnedAway;
+    }
+
+    RecordValue(StatsOf(shard, family).queue_lengths, queue->waiters.count - 1);
+    AddToCounter(StatsOf(shard, family).waiting, 1);
+
+    shard.waiter_pool[queue->waiters.tail].client = client;
+    return Waiting;
+}
+
+// Cuts the first waiters off the queue into released: at most limit of them (0 for no limit), and only those that
+// arrived before arrived_before. A queue left empty is removed. A queue with people left goes back in line, unless
+// it keeps its place (which under strict order is where its new first waiter belongs)
+void ReleaseFromQueue(PlazaShard& shard, Plaza& plaza, FamilyQueue& queue, unsigned int limit, uint64_t arrived_before, bool keep_place, WaiterQueue& released, uint64_t now)
+{
+    PlazaFamily family = queue.family;
+    WaiterQueue& waiters = queue.waiters;
+
+    released.head = waiters.head;
+    int last = NO_WAITER;
+    for (int i = waiters.head; i != NO_WAITER; i = shard.waiter_pool[i].next)
+    {
+        ClientAddress& client = shard.waiter_pool[i].client;
+        if ((limit > 0 && released.count == limit) || client.arrival_time > arrived_before)
+        {
+            break;
+        }
+
+        RecordValue(StatsOf(shard, family).waits, now - client.arrival_time);
+        released.count++;
+        last = i;
+    }
+
+    assert(released.count > 0 && "The next family should have someone to let in");
+    released.tail = last;
+    waiters.head = shard.waiter_pool[last].next;
+    waiters.count -= released.count;
+    shard.waiter_pool[last].next = NO_WAITER;
+    AddToCounter(StatsOf(shard, family).waiting, -(int64_t) released.count);
+
+    if (waiters.head == NO_WAITER)
+    {
+        waiters.tail = NO_WAITER;
+        RemoveFamilyQueue(shard, plaza, queue);
+    }
+    else if (!keep_place || admission_policy == StrictOrder)
+    {
+        UnlinkFamilyQueue(shard, plaza, queue);
+        LinkFamilyQueue(shard, plaza, queue);
+    }
+}
+
+// Takes the person out of the plaza. The departure that empties the plaza starts the turn of the family first in
+// line (the second if the first is the departing family's, unless under strict order): it lets in its waiters, up
+// to the batch limit and the capacity and, under strict order, only those that arrived before the first waiter of
+// the family after it. In a plaza with a capacity, the person's place goes to the next waiter of the family inside
+// when that waiter could walk in now. The people let in are handed back in released so the caller can send their
+// ACKs (and then return them with ReleaseWaiters()). Returns their family
+PlazaFamily DepartFromPlaza(PlazaShard& shard, Plaza& plaza, PlazaFamily family, WaiterQueue& released, uint64_t now)
+{
+    assert(PlazaOccupants(plaza.state) > 0 && PlazaInsideFamily(plaza.state) == family && L"The person should be in the plaza");
+
+    released.head = released.tail = NO_WAITER;
+    released.count = 0;
+
+    unsigned int occupants = PlazaOccupants(plaza.state) - 1;
+    plaza.state = MakePlazaState(occupants, family);
+    CountOccupants(shard, -1);
+
+    if (plaza.first_family == NO_FAMILY_QUEUE)
+    {
+        return NoFamily;
+    }
+
+    if (occupants > 0)
+    {
+        FamilyQueue * queue = plaza_capacity > 0 ? WaitingFamily(shard, plaza, family) : NULL;
+        if (queue == NULL || (OthersWaiting(shard, plaza, family) && (admission_policy != Greedy || TurnIsOver(plaza, now))))
+        {
+            return NoFamily;
+        }
+
+        ReleaseFromQueue(shard, plaza, *queue, 1, UINT64_MAX, true, released, now);
+        plaza.state = MakePlazaState(occupants + 1, family);
+        plaza.turn_admissions++;
+        CountOccupants(shard, 1);
+        return family;
+    }
+
+    // The families take turns: unless people get in in arrival order, a family that just had the plaza goes after
+    // the next family in line
+    FamilyQueue * first = &shard.family_queues[plaza.first_family];
+    if (admission_policy != StrictOrder && first->family == family && first->next != NO_FAMILY_QUEUE)
+    {
+        first = &shard.family_queues[first->next];
+    }
+
+    FamilyQueue& queue = *first;
+    PlazaFamily next = queue.family;
+    uint64_t arrived_before = admission_policy == StrictOrder && queue.next != NO_FAMILY_QUEUE ?
+        shard.waiter_pool[shard.family_queues[queue.next].waiters.head].client.arrival_time : UINT64_MAX;
+    unsigned int limit = max_batch;
+    if (plaza_capacity > 0 && (limit == 0 || plaza_capacity < limit))
+    {
+        limit = plaza_capacity;
+    }
+
+    ReleaseFromQueue(shard, plaza, queue, limit, arrived_before, false, released, now);
+
+    StartTurn(plaza, next, released.count, now);
+    CountOccupants(shard, released.count);
+    return next;
+}
+
+// Counters and histograms have a single writer, so a plain load and store is enough and cheaper than fetch_add()
+void AddToCounter(atomic<uint64_t>& counter, int64_t change)
+{
+    counter.store(counter.load(memory_order_relaxed) + change, memory_order_relaxed);
+}
+
+void ClearHistogram(Histogram& histogram)
+{
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        histogram.buckets[b] = 0;
+    }
+    histogram.count = 0;
+    histogram.sum = 0;
+    histogram.max = 0;
+}
+
+int HistogramBucket(uint64_t value)
+{
+    if (value < (1ULL << HISTOGRAM_SUB_BITS))
+    {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+// The largest value that falls into the bucket
+uint64_t HistogramBucketLimit(int bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    {
+        return bucket;
+    }
+
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (exponent - HISTOGRAM_SUB_BITS);
+    return ((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket) * width + width - 1;
+}
+
+void RecordValue(Histogram& histogram, uint64_t value)
+{
+    AddToCounter(histogram.buckets[HistogramBucket(value)], 1);
+    AddToCounter(histogram.count, 1);
+    AddToCounter(histogram.sum, value);
+    if (value > histogram.max.load(memory_order_relaxed))
+    {
+        histogram.max.store(value, memory_order_relaxed);
+    }
+}
+
+// Adds a histogram that may be being recorded into to the snapshot. The fields are read one at a time, so a
+// snapshot taken while the owner records can be off by the values recorded meanwhile
+void AddHistogram(HistogramSnapshot& total, const Histogram& histogram)
+{
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        total.buckets[b] += histogram.buckets[b].load(memory_order_relaxed);
+    }
+    total.count += histogram.count.load(memory_order_relaxed);
+    total.sum += histogram.sum.load(memory_order_relaxed);
+    total.max = max(total.max, histogram.max.load(memory_order_relaxed));
+}
+
+// Upper bound of the bucket holding the given fraction of the values
+uint64_t HistogramPercentile(const HistogramSnapshot& histogram, double fraction)
+{
+    uint64_t rank = (uint64_t) (fraction * histogram.count);
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+    {
+        seen += histogram.buckets[b];
+        if (seen > rank || (seen > 0 && seen == histogram.count))
+        {
+            return min(HistogramBucketLimit(b), histogram.max);
+        }
+    }
+
+    return histogram.max;
+}
+
+// The stats slots in the order they are reported
+const int stats_slots[] = { Montague, Capulet, OTHER_FAMILIES };
+
+string StatsSlotName(int slot)
+{
+    return slot == OTHER_FAMILIES ? "Others" : PlazaFamilyName((PlazaFamily) slot);
+}
+
+void PrintWaitHistograms(HistogramSnapshot * histograms, const char * unit)
+{
+    const char * policy_names[] = { "greedy", "turns", "fifo" };
+    cout << "Wait times to enter a plaza (policy " << policy_names[admission_policy] << ", max batch " << max_batch
+        << ", time slice " << time_slice << " ms, capacity " << plaza_capacity << ")" << endl;
+
+    for (size_t slot = 0; slot < sizeof(stats_slots) / sizeof(stats_slots[0]); slot++)
+    {
+        HistogramSnapshot& histogram = histograms[stats_slots[slot]];
+        if (stats_slots[slot] == OTHER_FAMILIES && histogram.count == 0)
+        {
+            continue;
+        }
+
+        cout << StatsSlotName(stats_slots[slot]) << ": " << histogram.count << " admitted, p50 <= "
+            << HistogramPercentile(histogram, 0.5) << " " << unit << ", p99 <= " << HistogramPercentile(histogram, 0.99) << " " << unit
+            << ", max " << histogram.max << " " << unit << endl;
+
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        {
+            if (histogram.buckets[b] > 0)
+            {
+                cout << "    <= " << HistogramBucketLimit(b) << " " << unit << ": " << histogram.buckets[b] << endl;
+            }
+        }
+    }
+}
+
+// Stats are only given out on the Unix socket and loopback
+bool IsLocalAddress(const struct sockaddr * address)
+{
+    if (address->sa_family == AF_UNIX)
+    {
+        return true;
+    }
+    else if (address->sa_family == AF_INET)
+    {
+        return (ntohl(((const struct sockaddr_in *) address)->sin_addr.s_addr) >> 24) == 127;
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        const struct in6_addr * ipv6_address = &((const struct sockaddr_in6 *) address)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(ipv6_address) ||
+            (IN6_IS_ADDR_V4MAPPED(ipv6_address) && ipv6_address->s6_addr[12] == 127);
+    }
+
+    return false;
+}
+
+string HistogramJson(const HistogramSnapshot& histogram)
+{
+    ostringstream json;
+    json << "{\"count\":" << histogram.count
+        << ",\"mean\":" << (histogram.count > 0 ? histogram.sum / histogram.count : 0)
+        << ",\"p50\":" << HistogramPercentile(histogram, 0.5)
+        << ",\"p90\":" << HistogramPercentile(histogram, 0.9)
+        << ",\"p99\":" << HistogramPercentile(histogram, 0.99)
+        << ",\"p999\":" << HistogramPercentile(histogram, 0.999)
+        << ",\"max\":" << histogram.max << "}";
+    return json.str();
+}
+
+// Reads every worker's counters and histograms without stopping them. The recent message rate covers the time
+// since the previous stats query
+string StatsJson()
+{
+    const char * policy_names[] = { "greedy", "turns", "fifo" };
+    uint64_t now = NowMicroseconds();
+    uint64_t messages = 0, unknown = 0, malformed = 0;
+    uint64_t rejected = 0, rate_limited = 0, shed = 0, unmatched = 0, acks_dropped = 0;
+    uint64_t occupants = 0;
+    uint64_t waiting[Capulet + 1] = { 0 };
+    HistogramSnapshot histograms[Capulet + 1][3];
+    memset(histograms, 0, sizeof(histograms));
+
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        PlazaShard& shard = workers[w]->shard;
+        messages += shard.messages_received.load(memory_order_relaxed);
+        unknown += shard.messages_unknown.load(memory_order_relaxed);
+        malformed += shard.messages_malformed.load(memory_order_relaxed);
+        rejected += shard.arrivals_rejected.load(memory_order_relaxed);
+        rate_limited += shard.arrivals_rate_limited.load(memory_order_relaxed);
+        shed += shard.arrivals_shed.load(memory_order_relaxed);
+        unmatched += shard.departures_unmatched.load(memory_order_relaxed);
+        acks_dropped += shard.acks_dropped.load(memory_order_relaxed);
+        occupants += shard.occupants.load(memory_order_relaxed);
+        for (int family = NoFamily; family <= Capulet; family++)
+        {
+            FamilyStats& stats = shard.family_stats[family];
+            waiting[family] += stats.waiting.load(memory_order_relaxed);
+            AddHistogram(histograms[family][0], stats.waits);
+            AddHistogram(histograms[family][1], stats.stays);
+            AddHistogram(histograms[family][2], stats.queue_lengths);
+        }
+    }
+
+    double recent_rate;
+    {
+        lock_guard<mutex> lock(stats_lock);
+        recent_rate = (messages - last_stats_messages) * 1000000.0 / max<uint64_t>(now - last_stats_time, 1);
+        last_stats_time = now;
+        last_stats_messages = messages;
+    }
+
+    double uptime = (now - server_start) / 1000000.0;
+    ostringstream json;
+    json << "{\"uptime_s\":" << uptime
+        << ",\"policy\":\"" << policy_names[admission_policy] << "\""
+        << ",\"capacity\":" << plaza_capacity
+        << ",\"workers\":" << workers.size()
+        << ",\"messages_received\":" << messages
+        << ",\"messages_per_s\":" << (uint64_t) (messages / max(uptime, 0.000001))
+        << ",\"recent_messages_per_s\":" << (uint64_t) recent_rate
+        << ",\"messages_unknown\":" << unknown
+        << ",\"messages_malformed\":" << malformed
+        << ",\"arrivals_rejected\":" << rejected
+        << ",\"arrivals_rate_limited\":" << rate_limited
+        << ",\"arrivals_shed\":" << shed
+        << ",\"departures_unmatched\":" << unmatched
+        << ",\"acks_dropped\":" << acks_dropped
+        << ",\"occupants\":" << occupants
+        << ",\"log_records_dropped\":" << DroppedLogRecords()
+        << ",\"families\":{";
+
+    for (size_t slot = 0; slot < sizeof(stats_slots) / sizeof(stats_slots[0]); slot++)
+    {
+        int family = stats_slots[slot];
+        json << (slot == 0 ? "" : ",") << "\"" << StatsSlotName(family) << "\":{"
+            << "\"waiting\":" << waiting[family]
+            << ",\"wait_us\":" << HistogramJson(histograms[family][0])
+            << ",\"stay_us\":" << HistogramJson(histograms[family][1])
+            << ",\"queue_length\":" << HistogramJson(histograms[family][2]) << "}";
+    }
+
+    json << "}}\n";
+    return json.str();
+}
+
+// Answers a stats query with the stats as one JSON datagram
+int SendStats(int socket, struct sockaddr * client_address, socklen_t client_address_length)
+{
+    string json = StatsJson();
+    return sendto(socket, json.c_str(), json.length(), 0, client_address, client_address_length);
+}
+
+// Returns the person's session, or NULL when there is none and create is false. A new session is all zero apart
+// from the person id. The table doubles when it is 3/4 full, which moves the sessions, so the returned pointer is
+// only good until the next call that creates a session
+Session * FindSession(PlazaShard& shard, uint64_t person_id, bool create)
+{
+    unsigned int mask = (1U << shard.session_bits) - 1;
+    unsigned int slot = (person_id * 0x9E3779B97F4A7C15ULL) >> (64 - shard.session_bits);
+
+    while (shard.sessions[slot].person_id != person_id)
+    {
+        if (shard.sessions[slot].person_id == NO_PERSON)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+
+            if ((shard.session_count + 1) * 4 > shard.sessions.size() * 3)
+            {
+                vector<Session> old_sessions;
+                old_sessions.swap(shard.sessions);
+
+                Session empty_session;
+                memset(&empty_session, 0, sizeof(empty_session));
+                empty_session.person_id = NO_PERSON;
+
+                shard.session_bits++;
+                shard.sessions.assign(1U << shard.session_bits, empty_session);
+                shard.session_count = 0;
+
+                for (size_t i = 0; i < old_sessions.size(); i++)
+                {
+                    if (old_sessions[i].person_id != NO_PERSON)
+                    {
+                        *FindSession(shard, old_sessions[i].person_id, true) = old_sessions[i];
+                    }
+                }
+
+                return FindSession(shard, person_id, true);
+            }
+
+            memset(&shard.sessions[slot], 0, sizeof(Session));
+            shard.sessions[slot].person_id = person_id;
+            shard.session_count++;
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return &shard.sessions[slot];
+}
+
+// Removes the person's session, shifting the rest of its probe run back so lookups never need tombstones
+void RemoveSession(PlazaShard& shard, uint64_t person_id)
+{
+    unsigned int mask = (1U << shard.session_bits) - 1;
+    unsigned int hole = (person_id * 0x9E3779B97F4A7C15ULL) >> (64 - shard.session_bits);
+
+    while (shard.sessions[hole].person_id != person_id)
+    {
+        if (shard.sessions[hole].person_id == NO_PERSON)
+        {
+            return;
+        }
+
+        hole = (hole + 1) & mask;
+    }
+
+    for (unsigned int next = (hole + 1) & mask; shard.sessions[next].person_id != NO_PERSON; next = (next + 1) & mask)
+    {
+        // A session can move back into the hole when the hole is between its home slot and where it is now
+        unsigned int home = (shard.sessions[next].person_id * 0x9E3779B97F4A7C15ULL) >> (64 - shard.session_bits);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            shard.sessions[hole] = shard.sessions[next];
+            hole = next;
+        }
+    }
+
+    shard.sessions[hole].person_id = NO_PERSON;
+    shard.session_count--;
+}
+
+void ScheduleSession(PlazaShard& shard, Session& session, uint64_t deadline)
+{
+    session.deadline = deadline;
+    shard.timers.Schedule(session.person_id, deadline);
+}
+
+// Evicts the people whose lease ran out and forgets the sessions of people who left long enough ago. Timers for
+// deadlines that have since moved are ignored. Returns the number of people evicted, or -1 when an ACK failed
+int ExpireSessions(PlazaShard& shard, uint64_t now)
+{
+    static thread_local vector<TimerWheel::Timer> expired;
+    int evicted = 0;
+
+    expired.clear();
+    shard.timers.Advance(now, expired);
+
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        Session * session = FindSession(shard, expired[i].id, false);
+        if (session == NULL || session->deadline != expired[i].deadline)
+        {
+            continue;
+        }
+
+        if (session->state == Inside)
+        {
+            uint64_t person_id = session->person_id;
+            uint32_t plaza_id = session->plaza_id;
+            uint32_t sequence = session->last_sequence;
+            PlazaFamily family = session->family;
+            uint64_t time = NowMicroseconds();
+
+            AppendJournal(shard, JournalEviction, family, person_id, plaza_id, sequence, time, NULL, 0);
+
+            evicted++;
+            if (ApplyDeparture(shard, plaza_id, family, person_id, sequence, PersonIsEvicted, time) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (session->state == Departed)
+        {
+            RemoveSession(shard, session->person_id);
+        }
+    }
+
+    return evicted;
+}
+
+int HandleArrivalMessage(PlazaShard& shard, int socket, const PlazaMessage * message, struct sockaddr * _client_addr, socklen_t _client_addr_len)
+{
+    uint64_t person_id = PlazaPersonId(message);
+    uint32_t plaza_id = PlazaId(message);
+    uint32_t sequence = PlazaSequence(message);
+    PlazaFamily family = PlazaMessageFamily(message);
+
+    if (family == NoFamily)
+    {
+        AddToCounter(shard.messages_malformed, 1);
+        return 0;
+    }
+
+    // A retransmitted arrival: the client either missed its entry ACK, which is sent again, or is still waiting
+    bool has_session = sequence != 0 && person_id != NO_PERSON;
+    Session * session = has_session ? FindSession(shard, person_id, false) : NULL;
+    if (session != NULL && session->plaza_id == plaza_id && sequence <= session->last_sequence)
+    {
+        if (session->state == Inside && sequence == session->last_sequence)
+        {
+            return SendEntryAck(socket, message, _client_addr, _client_addr_len);
+        }
+
+        return 0;
+    }
+
+    LogPersonEvent(plaza_id, family, person_id, PersonArrives);
+
+    // keep a copy of the client's address to be used to notify the client
+    // when it is able to enter the plaza
+    ClientAddress client_addr;
+    client_addr.person_id = person_id;
+    client_addr.sequence = sequence;
+    client_addr.socket = socket;
+    client_addr.length = _client_addr_len;
+    client_addr.plaza_id = plaza_id;
+    memcpy(&client_addr.address, _client_addr, _client_addr_len);
+
+    uint64_t now = NowMicroseconds();
+    ArrivalResult result = ApplyArrival(shard, client_addr, family, now);
+
+    // Nobody hears about the arrival before the end of the wakeup, when the record is durable
+    if (result != TurnedAway)
+    {
+        AppendJournal(shard, JournalArrival, family, person_id, plaza_id, sequence, now, _client_addr, _client_addr_len);
+    }
+
+    if (result == Admitted)
+    {
+        LogPersonEvent(plaza_id, family, person_id, PersonEnters);
+        // Notify client right away
+        return SendEntryAck(socket, message, _client_addr, _client_addr_len);
+    }
+    else if (result == TurnedAway)
+    {
+        // No session is kept, so a late retransmission is taken as a new arrival and may find room
+        AddToCounter(shard.arrivals_rejected, 1);
+        return SendReject(socket, message, _client_addr, _client_addr_len);
+    }
+
+    // Otherwise at least one person of the other family is in the plaza, so this person will have to wait
+    // until the plaza is empty
+    return 0;
+}
+
+int HandleDepatureMessage(PlazaShard& shard, int socket, const PlazaMessage * message, struct sockaddr * _client_addr, socklen_t _client_addr_len)
+{
+    uint64_t person_id = PlazaPersonId(message);
+    uint32_t plaza_id = PlazaId(message);
+    uint32_t sequence = PlazaSequence(message);
+    PlazaFamily family = PlazaMessageFamily(message);
+
+    if (family == NoFamily)
+    {
+        AddToCounter(shard.messages_malformed, 1);
+        return 0;
+    }
+
+    bool has_session = sequence != 0 && person_id != NO_PERSON;
+    if (has_session)
+    {
+        // A retransmitted departure, or the departure of somebody already evicted, only gets its ACK again
+        Session * session = FindSession(shard, person_id, false);
+        if (session == NULL || session->plaza_id != plaza_id || session->state != Inside || sequence <= session->last_sequence)
+        {
+            if (session == NULL || session->state == Departed)
+            {
+                return SendDepartureAck(socket, message, _client_addr, _client_addr_len);
+            }
+
+            return 0;
+        }
+    }
+
+    // Without a session nothing vouches for the person being inside, and a departure from a plaza that does not
+    // hold the family would let the other family in while people are still there
+    Plaza * plaza = LookupPlaza(shard, plaza_id);
+    if (plaza == NULL || PlazaOccupants(plaza->state) == 0 || PlazaInsideFamily(plaza->state) != family)
+    {
+        AddToCounter(shard.departures_unmatched, 1);
+        return 0;
+    }
+
+    uint64_t now = NowMicroseconds();
+    AppendJournal(shard, JournalDeparture, family, person_id, plaza_id, sequence, now, NULL, 0);
+
+    if (ApplyDeparture(shard, plaza_id, family, person_id, sequence, PersonLeaves, now) < 0)
+    {
+        return -1;
+    }
+
+    return has_session ? SendDepartureAck(socket, message, _client_addr, _client_addr_len) : 0;
+}
+
+// Runs an arrival against its plaza and starts or updates the person's session. Shared by the live server and
+// the journal replay, so both build the same state. now is in microseconds
+ArrivalResult ApplyArrival(PlazaShard& shard, ClientAddress& client, PlazaFamily family, uint64_t now)
+{
+    ArrivalResult result = ArriveAtPlaza(shard, FindPlaza(shard, client.plaza_id), family, client, now);
+
+    if (client.sequence != 0 && client.person_id != NO_PERSON && result != TurnedAway)
+    {
+        Session * session = FindSession(shard, client.person_id, true);
+        session->plaza_id = client.plaza_id;
+        session->last_sequence = client.sequence;
+        session->family = family;
+        session->state = result == Admitted ? Inside : Waiting_To_Enter;
+        session->entered = result == Admitted ? now : 0;
+
+        // A deadline left over from an earlier visit must not fire for this one
+        session->deadline = 0;
+        if (result == Admitted && lease_seconds > 0)
+        {
+            ScheduleSession(shard, *session, now / 1000 + lease_seconds * 1000ULL);
+        }
+    }
+
+    return result;
+}
+
+// Ends the person's visit, by departure or eviction, and lets the next family in. now is in microseconds
+int ApplyDeparture(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family, uint64_t person_id, uint32_t sequence, LogEvent event, uint64_t now)
+{
+    Session * session = sequence != 0 && person_id != NO_PERSON ? FindSession(shard, person_id, false) : NULL;
+    if (session != NULL)
+    {
+        session->last_sequence = sequence;
+        session->state = Departed;
+        ScheduleSession(shard, *session, now / 1000 + SESSION_LINGER);
+    }
+
+    return LeavePlaza(shard, plaza_id, family, person_id, event, now);
+}
+
+// Takes the person out of the plaza. If the person was the last of the family in the plaza, the next family's
+// waiters get in, and their sessions start their leases
+int LeavePlaza(PlazaShard& shard, uint32_t plaza_id, PlazaFamily family, uint64_t person_id, LogEvent event, uint64_t now)
+{
+    Session * session = person_id != NO_PERSON ? FindSession(shard, person_id, false) : NULL;
+    if (session != NULL && session->entered != 0)
+    {
+        RecordValue(StatsOf(shard, family).stays, now - session->entered);
+        session->entered = 0;
+    }
+
+    WaiterQueue released;
+    PlazaFamily released_family = DepartFromPlaza(shard, FindPlaza(shard, plaza_id), family, released, now);
+    if (!LogPersonEvent(plaza_id, family, person_id, event))
+    {
+        ForgetPersonName(person_id);
+    }
+
+    if (released.count > 0)
+    {
+        uint64_t lease_end = now / 1000 + lease_seconds * 1000ULL;
+
+        for (int i = released.head; i != NO_WAITER; i = shard.waiter_pool[i].next)
+        {
+            ClientAddress& client = shard.waiter_pool[i].client;
+            LogPersonEvent(plaza_id, released_family, client.person_id, PersonEnters);
+
+            Session * session = client.sequence != 0 && client.person_id != NO_PERSON ? FindSession(shard, client.person_id, false) : NULL;
+            if (session != NULL && session->state == Waiting_To_Enter)
+            {
+                session->state = Inside;
+                session->entered = now;
+                if (lease_seconds > 0)
+                {
+                    ScheduleSession(shard, *session, lease_end);
+                }
+            }
+        }
+
+        SendEntryAcks(shard, released);
+        ReleaseWaiters(shard, released);
+    }
+
+    return 0;
+}
+
+// Queues the entry ACK for a client that got into the plaza right away. Text clients get the single 'E'
+// character, binary clients get an 'E' message echoing their person id, sequence number and plaza id
+int SendEntryAck(int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length)
+{
+    if (use_text_protocol)
+    {
+        QueueAck(socket, &ack_message, sizeof(char), client_address, client_address_length);
+        return 0;
+    }
+
+    PlazaMessage ack;
+    EncodePlazaMessage(&ack, ack_message, PlazaMessageFamily(message), PlazaPersonId(message), PlazaSequence(message), PlazaId(message));
+    QueueAck(socket, &ack, sizeof(ack), client_address, client_address_length);
+    return 0;
+}
+
+// Queues the confirmation of a departure to a client using sequence numbers, so it stops resending the departure
+int SendDepartureAck(int socket, const PlazaMessage * message, struct sockaddr * client_address, socklen_t client_address_length)
+{
+    PlazaMessage ack;
+    EncodePlazaMessage(&ack, PLAZA_DEPARTURE_ACK, PlazaMessageFamily(message), PlazaPersonId(message), PlazaSequence(message), PlazaId(message));
+    QueueAck(socket, &ack, sizeof(ack), client_address, client_address_length);
+    return 0;
+}
+
+// Queues the answer to an arrival there is no room for. Text clients get the single 'R' character, binary clients
+// an 'R' message echoing their person id, sequence number and plaza id
+int SendReject(int socket, const PlazaMessage * message, const struct sockaddr * client_address, socklen_t client_address_length)
+{
+    if (use_text_protocol)
+    {
+        char reject = PLAZA_REJECT;
+        QueueAck(socket, &reject, sizeof(char), client_address, client_address_length);
+        return 0;
+    }
+
+    PlazaMessage reject;
+    EncodePlazaMessage(&reject, PLAZA_REJECT, PlazaMessageFamily(message), PlazaPersonId(message), PlazaSequence(message), PlazaId(message));
+    QueueAck(socket, &reject, sizeof(reject), client_address, client_address_length);
+    return 0;
+}
+
+// Takes a waiter off the shard's free list and appends it to the family's queue for the plaza, which is put in line
+// if the family had nobody waiting. Returns the queue, the new waiter is its tail, or NULL when the pool is exhausted
+// or the queue is at --max-waiting
+FamilyQueue * EnqueueWaiter(PlazaShard& shard, Plaza& plaza, PlazaFamily family)
+{
+    vector<Waiter>& waiter_pool = shard.waiter_pool;
+    WaiterQueue& free_waiters = shard.free_waiters;
+
+    int index = free_waiters.head;
+    if (index == NO_WAITER)
+    {
+        return NULL;
+    }
+
+    FamilyQueue * family_queue = WaitingFamily(shard, plaza, family);
+    if (family_queue != NULL && max_waiting > 0 && family_queue->waiters.count >= max_waiting)
+    {
+        return NULL;
+    }
+    else if (family_queue == NULL)
+    {
+        family_queue = AddFamilyQueue(shard, plaza, family);
+    }
+    WaiterQueue& queue = family_queue->waiters;
+
+    free_waiters.head = waiter_pool[index].next;
+    if (free_waiters.head == NO_WAITER)
+    {
+        free_waiters.tail = NO_WAITER;
+    }
+    free_waiters.count--;
+
+    waiter_pool[index].next = NO_WAITER;
+    if (queue.tail == NO_WAITER)
+    {
+        queue.head = index;
+    }
+    else
+    {
+        waiter_pool[queue.tail].next = index;
+    }
+    queue.tail = index;
+    queue.count++;
+
+    return family_queue;
+}
+
+// Returns every waiter in the queue to the shard's free list in one splice and leaves the queue empty
+void ReleaseWaiters(PlazaShard& shard, WaiterQueue& queue)
+{
+    WaiterQueue& free_waiters = shard.free_waiters;
+
+    if (queue.head == NO_WAITER)
+    {
+        return;
+    }
+
+    if (free_waiters.tail == NO_WAITER)
+    {
+        free_waiters.head = queue.head;
+    }
+    else
+    {
+        shard.waiter_pool[free_waiters.tail].next = queue.head;
+    }
+    free_waiters.tail = queue.tail;
+    free_waiters.count += queue.count;
+
+    queue.head = queue.tail = NO_WAITER;
+    queue.count = 0;
+}
+
+// Queues the entry ACK for each waiter in the queue, to go out with the rest of the wakeup's ACKs
+int SendEntryAcks(PlazaShard& shard, WaiterQueue& queue)
+{
+    for (int i = queue.head; i != NO_WAITER; i = shard.waiter_pool[i].next)
+    {
+        ClientAddress * client = &shard.waiter_pool[i].client;
+        if (use_text_protocol)
+        {
+            QueueAck(client->socket, &ack_message, sizeof(char), (struct sockaddr *) &client->address, client->length);
+            continue;
+        }
+
+        // The family is not needed by the client, it only matches the ACK against its person id
+        PlazaMessage ack;
+        EncodePlazaMessage(&ack, ack_message, NoFamily, client->person_id, client->sequence, client->plaza_id);
+        QueueAck(client->socket, &ack, sizeof(ack), (struct sockaddr *) &client->address, client->length);
+    }
+
+    return 0;
+}
+
+// The thread's ACKs waiting for the end of the wakeup
+vector<PendingAck>& PendingAcks()
+{
+    static thread_local vector<PendingAck> pending_acks;
+    return pending_acks;
+}
+
+void QueueAck(int socket, const void * ack, size_t ack_length, const struct sockaddr * client_address, socklen_t client_address_length)
+{
+    // A client restored from the journal whose transport is gone (no IPv6 this time) cannot be answered
+    if (socket < 0)
+    {
+        return;
+    }
+
+    PendingAck pending;
+    memcpy(&pending.message, ack, ack_length);
+    pending.length = ack_length;
+    pending.socket = socket;
+    pending.address_length = client_address_length;
+    memcpy(&pending.address, client_address, client_address_length);
+    PendingAcks().push_back(pending);
+}
+
+// Sends the wakeup's ACKs. Datagram ACKs are batched by socket, and each batch goes out with as few sendmmsg()
+// calls as possible (one, unless the batch exceeds MAX_DATAGRAMS_PER_SEND), or in one io_uring submission. ACKs
+// for TCP clients are appended to their connection, or handed to the worker serving it, and each connection is
+// written once. The batch buffers are static and keep their capacity, so a wakeup does not allocate once they
+// have grown
+int FlushAcks(Worker * worker)
+{
+    static thread_local vector<Connection *> written_connections;
+    static thread_local vector<struct mmsghdr> message_headers[MAX_WORKERS * MAX_SOCKETS];
+    static thread_local vector<struct iovec> message_iovecs[MAX_WORKERS * MAX_SOCKETS];
+    int batch_sockets[MAX_WORKERS * MAX_SOCKETS];
+    int batch_count = 0;
+
+    vector<PendingAck>& pending_acks = PendingAcks();
+    if (pending_acks.empty())
+    {
+        return 0;
+    }
+
+    // The ACK vector is complete now, so its addresses are stable
+    for (size_t i = 0; i < pending_acks.size(); i++)
+    {
+        PendingAck& pending = pending_acks[i];
+
+        if (pending.address.ss_family == AF_PLAZA_STREAM)
+        {
+            const StreamAddress * address = (const StreamAddress *) &pending.address;
+            if (address->worker != worker->id)
+            {
+                HandOffRequest(workers[address->worker], pending.socket, &pending.message, (struct sockaddr *) &pending.address, pending.address_length);
+                continue;
+            }
+
+            // The client may have hung up since, and its descriptor may even belong to a new connection
+            map<int, Connection *>::iterator connection = worker->connections.find(address->fd);
+            if (connection == worker->connections.end() || connection->second->id != address->connection_id)
+            {
+                continue;
+            }
+
+            vector<char>& output = connection->second->output;
+            if (output.empty())
+            {
+                written_connections.push_back(connection->second);
+            }
+            output.insert(output.end(), (char *) &pending.message, (char *) &pending.message + pending.length);
+            continue;
+        }
+
+        int batch = 0;
+        while (batch < batch_count && batch_sockets[batch] != pending.socket)
+        {
+            batch++;
+        }
+
+        if (batch == batch_count)
+        {
+            batch_sockets[batch_count++] = pending.socket;
+            message_headers[batch].clear();
+            message_iovecs[batch].clear();
+        }
+
+        struct iovec iov;
+        iov.iov_base = &pending.message;
+        iov.iov_len = pending.length;
+        message_iovecs[batch].push_back(iov);
+
+        struct mmsghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_hdr.msg_name = &pending.address;
+        header.msg_hdr.msg_namelen = pending.address_length;
+        message_headers[batch].push_back(header);
+    }
+
+    int ret_val = 0;
+    for (int batch = 0; batch < batch_count && ret_val >= 0; batch++)
+    {
+        int socket = batch_sockets[batch];
+        vector<struct mmsghdr>& headers = message_headers[batch];
+
+        for (size_t i = 0; i < headers.size(); i++)
+        {
+            headers[i].msg_hdr.msg_iov = &message_iovecs[batch][i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        if (worker->uring != NULL)
+        {
+            ret_val = SendUring(worker, socket, headers);
+            continue;
+        }
+
+        size_t sent_count = 0;
+        while (sent_count < headers.size())
+        {
+            unsigned int batch_size = min(headers.size() - sent_count, (size_t) MAX_DATAGRAMS_PER_SEND);
+            ret_val = sendmmsg(socket, &headers[sent_count], batch_size, 0);
+            if (ret_val < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                // The ACK at sent_count could not reach its client. Like any lost datagram, drop it and carry
+                // on with the rest of the batch
+                if (IsDestinationError(errno))
+                {
+                    AddToCounter(worker->shard.acks_dropped, 1);
+                    ret_val = 0;
+                    sent_count++;
+                    continue;
+                }
+
+                break;
+            }
+
+            sent_count += ret_val;
+        }
+    }
+
+    pending_acks.clear();
+
+    for (size_t i = 0; i < written_connections.size(); i++)
+    {
+        if (WriteConnection(worker, written_connections[i]) < 0)
+        {
+            CloseConnection(worker, written_connections[i]);
+        }
+    }
+    written_connections.clear();
+
+    return ret_val < 0 ? -1 : 0;
+}
+
+// Accepts every pending connection on the worker's listening socket
+void AcceptConnections(Worker * worker)
+{
+    while (true)
+    {
+        int fd = accept4(worker->tcp_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                fprintf(stderr, "accept4() failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        // Replies are small and latency is what they are for
+        const int optVal = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&optVal, sizeof(optVal));
+
+        Connection * connection = new Connection;
+        connection->fd = fd;
+        connection->id = ++last_connection_id;
+        memset(&connection->address, 0, sizeof(connection->address));
+        connection->address.family = AF_PLAZA_STREAM;
+        connection->address.worker = worker->id;
+        connection->address.fd = fd;
+        connection->address.connection_id = connection->id;
+        connection->output_start = 0;
+        connection->want_write = false;
+        connection->partial_length = 0;
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            fprintf(stderr, "epoll_ctl() failed to watch a connection: %s\n", strerror(errno));
+            close(fd);
+            delete connection;
+            continue;
+        }
+
+        worker->connections[fd] = connection;
+    }
+}
+
+// Reads what the connection has, up to the size of the worker's receive buffers, and runs every whole message in
+// it. The start of a message cut off by the end of the read is kept for the next one. Whatever is left in the
+// socket makes it readable again on the next wakeup. Returns -1 when the connection has to be closed
+int ReadConnection(Worker * worker, Connection * connection)
+{
+    char * buffer = worker->messages[0];
+    size_t length = connection->partial_length;
+    memcpy(buffer, connection->partial, length);
+
+    ssize_t received;
+    do
+    {
+        received = recv(connection->fd, buffer + length, sizeof(worker->messages) - length, MSG_DONTWAIT);
+    }
+    while (received < 0 && errno == EINTR);
+
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+
+    if (received <= 0)
+    {
+        return -1;
+    }
+
+    length += received;
+    size_t message_count = length / PLAZA_MESSAGE_SIZE;
+    AddToCounter(worker->shard.messages_received, message_count);
+
+    // The buffer is 8 byte aligned and so is every frame in it, so the messages are read in place
+    for (size_t i = 0; i < message_count && !serverFinished; i++)
+    {
+        const PlazaMessage * request = DecodePlazaMessage(buffer + i * PLAZA_MESSAGE_SIZE, PLAZA_MESSAGE_SIZE);
+        if (request == NULL)
+        {
+            // There is no finding the next frame in a stream once one is bad
+            fprintf(stderr, "Dropped a connection sending a malformed message\n");
+            return -1;
+        }
+
+        if (!IsKnownMessage(request->type))
+        {
+            AddToCounter(worker->shard.messages_unknown, 1);
+            fprintf(stderr, "Dropped a connection sending a message of unknown type %d\n", request->type);
+            return -1;
+        }
+
+        // Nothing is resent over TCP, so an arrival over the rate limit is rejected rather than dropped
+        struct sockaddr * address = (struct sockaddr *) &connection->address;
+        if (IsArrivalMessage(request->type) && !AcceptArrival(worker, false, address, sizeof(StreamAddress)))
+        {
+            SendReject(connection->fd, request, address, sizeof(StreamAddress));
+            continue;
+        }
+
+        DispatchRequest(worker, connection->fd, request, address, sizeof(StreamAddress));
+    }
+
+    connection->partial_length = length - message_count * PLAZA_MESSAGE_SIZE;
+    memcpy(connection->partial, buffer + message_count * PLAZA_MESSAGE_SIZE, connection->partial_length);
+    return 0;
+}
+
+// Writes as much of the connection's replies as the socket takes, and watches for EPOLLOUT while some are left.
+// Returns -1 when the connection has to be closed, also when the client stopped reading its replies
+int WriteConnection(Worker * worker, Connection * connection)
+{
+    while (connection->output_start < connection->output.size())
+    {
+        ssize_t sent = send(connection->fd, &connection->output[connection->output_start], connection->output.size() - connection->output_start, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
 
-            waitingMontagues.empty();
-            montague_client_addresses.empty(); // should already be empty right before this call
+            return -1;
         }
+
+        connection->output_start += sent;
     }
-    else
+
+    if (connection->output_start == connection->output.size())
+    {
+        connection->output.clear();
+        connection->output_start = 0;
+    }
+    else if (connection->output.size() - connection->output_start > MAX_CONNECTION_OUTPUT)
+    {
+        fprintf(stderr, "Dropped a connection that does not read its replies\n");
+        return -1;
+    }
+
+    bool want_write = !connection->output.empty();
+    if (want_write != connection->want_write)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | (want_write ? (uint32_t) EPOLLOUT : 0);
+        event.data.fd = connection->fd;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0)
+        {
+            return -1;
+        }
+        connection->want_write = want_write;
+    }
+
+    return 0;
+}
+
+// The people of a closed connection stay where they are until they are evicted, and their replies are dropped
+void CloseConnection(Worker * worker, Connection * connection)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    worker->connections.erase(connection->fd);
+    delete connection;
+}
+
+// Journal files are <directory>/plaza-<generation>-<worker id>.journal and .snapshot
+string JournalPath(uint32_t generation, int id, const char * suffix)
+{
+    return journal_directory + "/plaza-" + to_string(generation) + "-" + to_string(id) + "." + suffix;
+}
+
+bool WriteFully(int fd, const void * data, size_t length)
+{
+    const char * bytes = (const char *) data;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        bytes += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+// Returns 1 with the file's contents, 0 when there is no such file and -1 on errors
+int ReadWholeFile(const string& path, vector<char>& contents)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    contents.resize(status.st_size);
+    size_t done = 0;
+    while (done < contents.size())
+    {
+        ssize_t ret_val = read(fd, &contents[done], contents.size() - done);
+        if (ret_val < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ret_val <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        done += ret_val;
+    }
+
+    close(fd);
+    return 1;
+}
+
+// Makes the creation, renaming and removal of journal files durable
+int SyncJournalDirectory()
+{
+    int fd = open(journal_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int ret_val = fsync(fd);
+    close(fd);
+    return ret_val;
+}
+
+// Adds a record to the shard's journal. It reaches the disk with the rest of the wakeup's records in
+// CommitJournal()
+void AppendJournal(PlazaShard& shard, JournalRecordType type, PlazaFamily family, uint64_t person_id, uint32_t plaza_id, uint32_t sequence, uint64_t time, const struct sockaddr * address, socklen_t address_length)
+{
+    PlazaJournal& journal = shard.journal;
+    if (journal.fd < 0)
+    {
+        return;
+    }
+
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.lsn = ++journal.lsn;
+    record.time = time;
+    record.person_id = person_id;
+    record.plaza_id = plaza_id;
+    record.sequence = sequence;
+    record.type = type;
+    record.family = family;
+    record.address_length = address_length;
+    if (address != NULL)
+    {
+        memcpy(&record.address, address, address_length);
+    }
+
+    journal.pending.push_back(record);
+}
+
+// Group commit: writes the records of the wakeup with one write(), and syncs them with one fdatasync(). With
+// --sync-interval the sync waits until the interval has passed, and the ACKs do not wait for it
+int CommitJournal(PlazaShard& shard, uint64_t now)
+{
+    PlazaJournal& journal = shard.journal;
+    if (journal.fd < 0)
+    {
+        return 0;
+    }
+
+    if (!journal.pending.empty())
+    {
+        if (!WriteFully(journal.fd, journal.pending.data(), journal.pending.size() * sizeof(JournalRecord)))
+        {
+            return -1;
+        }
+
+        journal.records_since_snapshot += journal.pending.size();
+        journal.pending.clear();
+        journal.unsynced = true;
+    }
+
+    if (journal.unsynced && now >= journal.last_sync + sync_interval)
+    {
+        if (fdatasync(journal.fd) < 0)
+        {
+            return -1;
+        }
+
+        journal.unsynced = false;
+        journal.last_sync = now;
+    }
+
+    return 0;
+}
+
+// Snapshots a shard that has journaled JOURNAL_SNAPSHOT_RECORDS records since its last snapshot, which empties
+// its journal. Called once the wakeup's ACKs are sent, with nothing left pending
+int SnapshotIfDue(PlazaShard& shard)
+{
+    if (shard.journal.fd < 0 || shard.journal.records_since_snapshot < JOURNAL_SNAPSHOT_RECORDS)
+    {
+        return 0;
+    }
+
+    return WriteSnapshot(shard);
+}
+
+// Writes the shard's state up to its last journal record next to the journal, and empties the journal. The
+// snapshot replaces the previous one by a rename, so there always is a complete one. A crash before the journal is
+// emptied leaves records the snapshot already has, and recovery skips them by their numbers
+int WriteSnapshot(PlazaShard& shard)
+{
+    PlazaJournal& journal = shard.journal;
+    vector<Plaza> plazas;
+    vector<SnapshotWaiter> waiters;
+    vector<Session> sessions;
+
+    for (size_t i = 0; i < shard.plazas.size(); i++)
+    {
+        Plaza& plaza = shard.plazas[i];
+
+        // Empty plazas start over as new ones, so leaving them out is all the compaction there is
+        if (plaza.id == NO_PLAZA || (PlazaOccupants(plaza.state) == 0 && plaza.first_family == NO_FAMILY_QUEUE))
+        {
+            continue;
+        }
+
+        // The families in line order, so that queueing the waiters again restores the line
+        plazas.push_back(plaza);
+        for (int q = plaza.first_family; q != NO_FAMILY_QUEUE; q = shard.family_queues[q].next)
+        {
+            for (int w = shard.family_queues[q].waiters.head; w != NO_WAITER; w = shard.waiter_pool[w].next)
+            {
+                SnapshotWaiter waiter;
+                memset(&waiter, 0, sizeof(waiter));
+                waiter.plaza_id = plaza.id;
+                waiter.family = shard.family_queues[q].family;
+                waiter.client = shard.waiter_pool[w].client;
+                waiters.push_back(waiter);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < shard.sessions.size(); i++)
+    {
+        if (shard.sessions[i].person_id != NO_PERSON)
+        {
+            sessions.push_back(shard.sessions[i]);
+        }
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.lsn = journal.lsn;
+    header.worker_count = workers.size();
+    header.plaza_count = plazas.size();
+    header.waiter_count = waiters.size();
+    header.session_count = sessions.size();
+
+    string path = JournalPath(journal.generation, journal.id, "snapshot");
+    string temporary_path = path + ".tmp";
+    int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    bool written = WriteFully(fd, &header, sizeof(header)) &&
+        WriteFully(fd, plazas.data(), plazas.size() * sizeof(Plaza)) &&
+        WriteFully(fd, waiters.data(), waiters.size() * sizeof(SnapshotWaiter)) &&
+        WriteFully(fd, sessions.data(), sessions.size() * sizeof(Session)) &&
+        fdatasync(fd) == 0;
+    close(fd);
+
+    if (!written || rename(temporary_path.c_str(), path.c_str()) < 0 || SyncJournalDirectory() < 0)
+    {
+        return -1;
+    }
+
+    if (ftruncate(journal.fd, 0) < 0)
+    {
+        return -1;
+    }
+
+    journal.records_since_snapshot = 0;
+    return 0;
+}
+
+// The socket of the owner that reaches a client restored from the journal. Sockets are new after a restart, but
+// there is one per datagram transport, so the address family tells which one the client used
+int SocketForAddress(Worker * owner, int address_family)
+{
+    if (address_family == AF_INET6)
+    {
+        return owner->ipv6_socket;
+    }
+    else if (address_family == AF_UNIX)
+    {
+        return workers[0]->unix_socket;
+    }
+    else if (address_family == AF_PLAZA_STREAM)
+    {
+        // The connection did not survive the restart, the client reconnects and resends
+        return -1;
+    }
+
+    return owner->ipv4_socket;
+}
+
+// Loads a snapshot into the shards owning its plazas, which may be other shards than the one that wrote it when
+// the number of workers changed. Returns -1 when the snapshot is damaged
+int RestoreSnapshot(const vector<char>& contents, uint64_t& lsn)
+{
+    SnapshotHeader header;
+    if (contents.size() < sizeof(header))
+    {
+        return -1;
+    }
+
+    memcpy(&header, contents.data(), sizeof(header));
+    size_t expected_size = sizeof(header) + header.plaza_count * sizeof(Plaza) + header.waiter_count * sizeof(SnapshotWaiter) + header.session_count * sizeof(Session);
+    if (header.magic != SNAPSHOT_MAGIC || contents.size() != expected_size)
+    {
+        return -1;
+    }
+
+    const char * data = contents.data() + sizeof(header);
+    uint64_t now = NowMilliseconds();
+
+    for (uint32_t i = 0; i < header.plaza_count; i++, data += sizeof(Plaza))
+    {
+        Plaza saved;
+        memcpy(&saved, data, sizeof(saved));
+
+        PlazaShard& shard = workers[saved.id % workers.size()]->shard;
+        Plaza& plaza = FindPlaza(shard, saved.id);
+        plaza.state = saved.state;
+        plaza.turn_admissions = saved.turn_admissions;
+        plaza.turn_start = saved.turn_start;
+        CountOccupants(shard, PlazaOccupants(saved.state));
+    }
+
+    for (uint32_t i = 0; i < header.waiter_count; i++, data += sizeof(SnapshotWaiter))
+    {
+        SnapshotWaiter saved;
+        memcpy(&saved, data, sizeof(saved));
+
+        Worker * owner = workers[saved.plaza_id % workers.size()];
+        FamilyQueue * queue = EnqueueWaiter(owner->shard, FindPlaza(owner->shard, saved.plaza_id), saved.family);
+        if (queue == NULL)
+        {
+            fprintf(stderr, "The waiter pool is full, a waiting %s is not recovered\n", PlazaFamilyName(saved.family).c_str());
+            continue;
+        }
+
+        Waiter& waiter = owner->shard.waiter_pool[queue->waiters.tail];
+        waiter.client = saved.client;
+        waiter.client.socket = SocketForAddress(owner, saved.client.address.ss_family);
+        AddToCounter(StatsOf(owner->shard, saved.family).waiting, 1);
+    }
+
+    for (uint32_t i = 0; i < header.session_count; i++, data += sizeof(Session))
+    {
+        Session saved;
+        memcpy(&saved, data, sizeof(saved));
+
+        // Stays are measured on this run's clock, so a stay that started before the restart is not recorded
+        saved.entered = 0;
+
+        PlazaShard& shard = workers[saved.plaza_id % workers.size()]->shard;
+        Session * session = FindSession(shard, saved.person_id, true);
+        *session = saved;
+        if (session->deadline != 0)
+        {
+            // Deadlines are on the old run's clock: a lease restarts, a departed session lingers once more
+            ScheduleSession(shard, *session, now + (session->state == Inside ? lease_seconds * 1000ULL : SESSION_LINGER));
+        }
+    }
+
+    lsn = header.lsn;
+    return 0;
+}
+
+// Runs one journal record against the shard now owning its plaza, the same way the live server ran it: at the
+// record's time, which is on the old run's clock like the restored snapshot's turns and waiters
+void ReplayJournalRecord(const JournalRecord& record)
+{
+    Worker * owner = workers[record.plaza_id % workers.size()];
+    PlazaShard& shard = owner->shard;
+    uint64_t now = record.time;
+
+    if (record.type == JournalArrival)
+    {
+        ClientAddress client;
+        memset(&client, 0, sizeof(client));
+        client.person_id = record.person_id;
+        client.sequence = record.sequence;
+        client.socket = SocketForAddress(owner, record.address.ss_family);
+        client.length = record.address_length;
+        client.plaza_id = record.plaza_id;
+        memcpy(&client.address, &record.address, sizeof(client.address));
+
+        ApplyArrival(shard, client, record.family, now);
+        RescheduleReplayedSession(shard, record.person_id);
+        return;
+    }
+
+    // A departure from a plaza that does not hold the family is a record the replay cannot match, like one from a
+    // waiter the pool had no room for
+    Plaza * plaza = LookupPlaza(shard, record.plaza_id);
+    if (plaza == NULL || PlazaOccupants(plaza->state) == 0 || PlazaInsideFamily(plaza->state) != record.family)
+    {
+        return;
+    }
+
+    ApplyDeparture(shard, record.plaza_id, record.family, record.person_id, record.sequence, record.type == JournalEviction ? PersonIsEvicted : PersonLeaves, now);
+    RescheduleReplayedSession(shard, record.person_id);
+}
+
+// Moves the deadline a replayed record gave the person's session onto this run's clock, as for the sessions of the
+// snapshot: a lease restarts, a departed session lingers once more
+void RescheduleReplayedSession(PlazaShard& shard, uint64_t person_id)
+{
+    Session * session = person_id != NO_PERSON ? FindSession(shard, person_id, false) : NULL;
+    if (session != NULL && session->deadline != 0)
+    {
+        ScheduleSession(shard, *session, NowMilliseconds() + (session->state == Inside ? lease_seconds * 1000ULL : SESSION_LINGER));
+    }
+}
+
+// Rebuilds the plazas from the newest complete generation of snapshots and journals, then starts a new generation
+// from the rebuilt state and removes the old files. A generation is complete once every one of its workers has
+// written its first snapshot, so a crash at any point of the recovery leaves a complete generation behind
+int RecoverPlazas()
+{
+    uint64_t start = NowMicroseconds();
+
+    if (mkdir(journal_directory.c_str(), 0755) < 0 && errno != EEXIST)
     {
-        string message = "Invalid input. The family name is not recognized: " + family;
-        cout << message << endl;
-        assert(false && message.c_str());
+        fprintf(stderr, "Failed to create the journal directory %s: %s\n", journal_directory.c_str(), strerror(errno));
+        return -1;
+    }
+
+    DIR * directory = opendir(journal_directory.c_str());
+    if (directory == NULL)
+    {
+        fprintf(stderr, "Failed to open the journal directory %s: %s\n", journal_directory.c_str(), strerror(errno));
+        return -1;
+    }
+
+    map<uint32_t, vector<int> > snapshot_ids;   // the workers with a snapshot in each generation
+    vector<string> old_files;
+    uint32_t last_generation = 0;
+
+    struct dirent * entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        unsigned int generation;
+        int id;
+        int length = 0;
+        if (sscanf(entry->d_name, "plaza-%u-%d.%n", &generation, &id, &length) != 2 || length == 0)
+        {
+            continue;
+        }
+
+        old_files.push_back(entry->d_name);
+        last_generation = max(last_generation, (uint32_t) generation);
+        if (strcmp(entry->d_name + length, "snapshot") == 0)
+        {
+            snapshot_ids[generation].push_back(id);
+        }
+    }
+    closedir(directory);
+
+    // Find the newest complete generation
+    uint32_t recovered_generation = 0;
+    int recovered_workers = 0;
+    for (map<uint32_t, vector<int> >::reverse_iterator it = snapshot_ids.rbegin(); it != snapshot_ids.rend() && recovered_workers == 0; it++)
+    {
+        vector<char> contents;
+        SnapshotHeader header;
+        if (ReadWholeFile(JournalPath(it->first, 0, "snapshot"), contents) <= 0 || contents.size() < sizeof(header))
+        {
+            continue;
+        }
+        memcpy(&header, contents.data(), sizeof(header));
+
+        bool complete = header.magic == SNAPSHOT_MAGIC && header.worker_count > 0;
+        for (int id = 0; complete && id < (int) header.worker_count; id++)
+        {
+            complete = find(it->second.begin(), it->second.end(), id) != it->second.end();
+        }
+
+        if (complete)
+        {
+            recovered_generation = it->first;
+            recovered_workers = header.worker_count;
+        }
+    }
+
+    // The replay runs the live code, which must neither log nor journal. Its ACKs are dropped: clients still
+    // waiting for one resend their message and are answered from their session
+    int previous_log_level = log_level;
+    log_level = LogQuiet;
+
+    uint64_t last_lsn = 0;
+    unsigned long replayed_records = 0;
+    for (int id = 0; id < recovered_workers; id++)
+    {
+        vector<char> snapshot;
+        vector<char> journal;
+        uint64_t lsn = 0;
+
+        if (ReadWholeFile(JournalPath(recovered_generation, id, "snapshot"), snapshot) <= 0 || RestoreSnapshot(snapshot, lsn) < 0)
+        {
+            fprintf(stderr, "The snapshot %s is damaged\n", JournalPath(recovered_generation, id, "snapshot").c_str());
+            return -1;
+        }
+
+        if (ReadWholeFile(JournalPath(recovered_generation, id, "journal"), journal) < 0)
+        {
+            fprintf(stderr, "Failed to read the journal %s: %s\n", JournalPath(recovered_generation, id, "journal").c_str(), strerror(errno));
+            return -1;
+        }
+
+        uint64_t snapshot_lsn = lsn;
+        for (size_t offset = 0; offset + sizeof(JournalRecord) <= journal.size(); offset += sizeof(JournalRecord))
+        {
+            JournalRecord record;
+            memcpy(&record, &journal[offset], sizeof(record));
+
+            if (record.lsn <= snapshot_lsn)
+            {
+                continue;
+            }
+
+            // A record that was being written when the server stopped ends the journal
+            if (record.lsn != lsn + 1 || record.type < JournalArrival || record.type > JournalEviction ||
+                record.family == NoFamily || record.address_length > sizeof(sockaddr_storage))
+            {
+                break;
+            }
+
+            ReplayJournalRecord(record);
+            lsn = record.lsn;
+            replayed_records++;
+        }
+
+        last_lsn = max(last_lsn, lsn);
+    }
+
+    log_level = previous_log_level;
+    PendingAcks().clear();
+
+    // Start the new generation: an empty journal and a first snapshot per worker
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        PlazaJournal& journal = workers[w]->shard.journal;
+        journal.id = w;
+        journal.generation = last_generation + 1;
+        journal.lsn = last_lsn;
+        journal.last_sync = NowMilliseconds();
+
+        string path = JournalPath(journal.generation, w, "journal");
+        journal.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (journal.fd < 0 || WriteSnapshot(workers[w]->shard) < 0)
+        {
+            fprintf(stderr, "Failed to start the journal %s: %s\n", path.c_str(), strerror(errno));
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < old_files.size(); i++)
+    {
+        unlink((journal_directory + "/" + old_files[i]).c_str());
+    }
+    SyncJournalDirectory();
+
+    if (recovered_workers > 0)
+    {
+        unsigned long occupants = 0;
+        unsigned long waiting = 0;
+        for (size_t w = 0; w < workers.size(); w++)
+        {
+            occupants += workers[w]->shard.occupants;
+            for (int family = NoFamily; family <= Capulet; family++)
+            {
+                waiting += workers[w]->shard.family_stats[family].waiting;
+            }
+        }
+
+        fprintf(stdout, "Recovered %lu people in the plazas and %lu waiting from %s (%lu journal records) in %.1f ms\n",
+            occupants, waiting, journal_directory.c_str(), replayed_records, (NowMicroseconds() - start) / 1000.0);
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,104 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hashed timer wheel shared by the plaza server and client.
+//
+// Timers are (deadline, id) pairs dropped into the slot of their deadline tick, so scheduling is O(1) whatever
+// the number of timers. A timer whose deadline is more than one turn of the wheel away simply stays in its slot
+// until the turn it is due. There is no cancellation: owners keep their own deadline and ignore a timer that fires
+// for a deadline they have since moved
+
+#include <stdint.h>
+#include <vector>
+
+class TimerWheel
+{
+public:
+    struct Timer
+    {
+        uint64_t deadline;
+        uint64_t id;
+    };
+
+    // tick is the resolution of the wheel, in the same unit as the deadlines and the time passed to Advance()
+    TimerWheel(unsigned int slot_count, uint64_t tick, uint64_t now) :
+        m_slots(slot_count), m_tick(tick), m_current_tick(now / tick), m_timer_count(0)
+    {
+    }
+
+    void Schedule(uint64_t id, uint64_t deadline)
+    {
+        uint64_t deadline_tick = deadline / m_tick;
+
+        // A deadline in the past fires on the next Advance()
+        if (deadline_tick < m_current_tick)
+        {
+            deadline_tick = m_current_tick;
+        }
+
+        Timer timer;
+        timer.deadline = deadline;
+        timer.id = id;
+        m_slots[deadline_tick % m_slots.size()].push_back(timer);
+        m_timer_count++;
+    }
+
+    // Moves the wheel up to now and appends the timers that are due to expired
+    void Advance(uint64_t now, std::vector<Timer>& expired)
+    {
+        uint64_t now_tick = now / m_tick;
+        if (now_tick < m_current_tick)
+        {
+            return;
+        }
+
+        // Once a whole turn has passed every slot has been visited, the remaining ticks have nothing new
+        uint64_t last_tick = now_tick - m_current_tick >= m_slots.size() ? m_current_tick + m_slots.size() - 1 : now_tick;
+
+        for (uint64_t tick = m_current_tick; tick <= last_tick && m_timer_count > 0; tick++)
+        {
+            std::vector<Timer>& slot = m_slots[tick % m_slots.size()];
+
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < slot.size(); i++)
+            {
+                if (slot[i].deadline <= now)
+                {
+                    expired.push_back(slot[i]);
+                    m_timer_count--;
+                }
+                else
+                {
+                    slot[kept++] = slot[i];
+                }
+            }
+            slot.resize(kept);
+        }
+
+        m_current_tick = now_tick;
+    }
+
+    bool Empty() const
+    {
+        return m_timer_count == 0;
+    }
+
+    unsigned int Size() const
+    {
+        return m_timer_count;
+    }
+
+    // Time until the next tick, for the timeout of the event loop
+    uint64_t TimeToNextTick(uint64_t now) const
+    {
+        return (now / m_tick + 1) * m_tick - now;
+    }
+
+private:
+    std::vector<std::vector<Timer> > m_slots;
+    uint64_t m_tick;
+    uint64_t m_current_tick;
+    unsigned int m_timer_count;
+};
+
+#endif
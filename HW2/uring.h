@@ -0,0 +1,312 @@
+#ifndef URING_H
+#define URING_H
+
+// A minimal io_uring for the plaza server, on the raw system calls so the homework needs no liburing.
+//
+// It covers what the server asks of it: multishot receives into a ring of provided buffers, multishot polls,
+// sendmsg, and waiting for completions with a timeout. Multishot recvmsg needs Linux 6.0; Open() fails on kernels
+// without io_uring or without the features it checks, and the server then stays with epoll. Only one thread may
+// use a ring at a time, nothing in it is locked
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#define URING_BUFFER_GROUP  0
+
+class Uring
+{
+public:
+    Uring() :
+        m_fd(-1), m_ring(NULL), m_ring_size(0), m_sqes(NULL), m_sqes_size(0), m_buffers(NULL), m_buffer_ring(NULL),
+        m_buffer_count(0), m_buffer_size(0), m_buffer_tail(0)
+    {
+    }
+
+    ~Uring()
+    {
+        Close();
+    }
+
+    // Sets up a ring of the given number of submission entries, and buffer_count provided buffers of buffer_size
+    // bytes (buffer_count a power of two). The last byte of every buffer is left to the caller, for a terminating
+    // null character. Returns -1 with errno set when the kernel cannot do it
+    int Open(unsigned int entries, unsigned int buffer_count, unsigned int buffer_size)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        // Every multishot receive posts many completions for its one submission
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+
+        m_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0)
+        {
+            return -1;
+        }
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+        {
+            Close();
+            errno = ENOSYS;
+            return -1;
+        }
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        m_ring_size = sq_size > cq_size ? sq_size : cq_size;
+        m_ring = (char *) mmap(NULL, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = (struct io_uring_sqe *) mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_ring == MAP_FAILED || m_sqes == MAP_FAILED)
+        {
+            Close();
+            return -1;
+        }
+
+        m_sq_head = (unsigned int *) (m_ring + params.sq_off.head);
+        m_sq_tail = (unsigned int *) (m_ring + params.sq_off.tail);
+        m_sq_mask = *(unsigned int *) (m_ring + params.sq_off.ring_mask);
+        m_sq_array = (unsigned int *) (m_ring + params.sq_off.array);
+        m_sq_entries = params.sq_entries;
+        m_cq_head = (unsigned int *) (m_ring + params.cq_off.head);
+        m_cq_tail = (unsigned int *) (m_ring + params.cq_off.tail);
+        m_cq_mask = *(unsigned int *) (m_ring + params.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe *) (m_ring + params.cq_off.cqes);
+        m_local_tail = m_submitted_tail = *m_sq_tail;
+
+        // The buffers and the ring the kernel takes them from, both page aligned
+        m_buffer_count = buffer_count;
+        m_buffer_size = buffer_size;
+        m_buffers = (char *) mmap(NULL, (size_t) buffer_count * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        m_buffer_ring = (struct io_uring_buf_ring *) mmap(NULL, buffer_count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m_buffers == MAP_FAILED || m_buffer_ring == MAP_FAILED)
+        {
+            Close();
+            return -1;
+        }
+
+        struct io_uring_buf_reg registration;
+        memset(&registration, 0, sizeof(registration));
+        registration.ring_addr = (uint64_t) (uintptr_t) m_buffer_ring;
+        registration.ring_entries = buffer_count;
+        registration.bgid = URING_BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+        {
+            Close();
+            return -1;
+        }
+
+        for (unsigned int id = 0; id < buffer_count; id++)
+        {
+            ReturnBuffer(id);
+        }
+
+        return 0;
+    }
+
+    void Close()
+    {
+        if (m_buffer_ring != NULL && m_buffer_ring != MAP_FAILED)
+        {
+            munmap(m_buffer_ring, m_buffer_count * sizeof(struct io_uring_buf));
+        }
+        if (m_buffers != NULL && m_buffers != MAP_FAILED)
+        {
+            munmap(m_buffers, (size_t) m_buffer_count * m_buffer_size);
+        }
+        if (m_sqes != NULL && m_sqes != MAP_FAILED)
+        {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_ring != NULL && m_ring != MAP_FAILED)
+        {
+            munmap(m_ring, m_ring_size);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+
+        m_fd = -1;
+        m_ring = NULL;
+        m_sqes = NULL;
+        m_buffers = NULL;
+        m_buffer_ring = NULL;
+    }
+
+    // Queues a receive that keeps posting a completion per datagram, each into a provided buffer. The buffer holds
+    // a struct io_uring_recvmsg_out, then the address (header->msg_namelen bytes) and then the datagram. The
+    // header must stay valid while the receive runs. Returns false when the submission queue is full
+    bool ReceiveMultishot(int fd, struct msghdr * header, uint64_t user_data)
+    {
+        struct io_uring_sqe * sqe = NextSqe();
+        if (sqe == NULL)
+        {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) header;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Queues a poll that posts a completion every time the descriptor becomes readable
+    bool PollMultishot(int fd, uint64_t user_data)
+    {
+        struct io_uring_sqe * sqe = NextSqe();
+        if (sqe == NULL)
+        {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Queues a sendmsg(). The header and the data must stay valid until its completion
+    bool SendMessage(int fd, const struct msghdr * header, int flags, uint64_t user_data)
+    {
+        struct io_uring_sqe * sqe = NextSqe();
+        if (sqe == NULL)
+        {
+            return false;
+        }
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) header;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    // Submits the queued requests and waits until at least wait_count completions are there, or for timeout
+    // milliseconds (-1 for no limit). Returns -1 with errno set on errors; running out of time is not one
+    int Enter(unsigned int wait_count, int timeout)
+    {
+        __atomic_store_n(m_sq_tail, m_local_tail, __ATOMIC_RELEASE);
+        unsigned int to_submit = m_local_tail - m_submitted_tail;
+        if (to_submit == 0 && wait_count == 0)
+        {
+            return 0;
+        }
+
+        unsigned int flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+        struct __kernel_timespec time_limit;
+        struct io_uring_getevents_arg argument;
+        memset(&argument, 0, sizeof(argument));
+        if (wait_count > 0 && timeout >= 0)
+        {
+            time_limit.tv_sec = timeout / 1000;
+            time_limit.tv_nsec = (timeout % 1000) * 1000000LL;
+            argument.sigmask_sz = _NSIG / 8;
+            argument.ts = (uint64_t) (uintptr_t) &time_limit;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+
+        int submitted = syscall(__NR_io_uring_enter, m_fd, to_submit, wait_count, flags,
+            (flags & IORING_ENTER_EXT_ARG) ? &argument : NULL, sizeof(argument));
+        if (submitted < 0)
+        {
+            return errno == ETIME ? 0 : -1;
+        }
+
+        m_submitted_tail += submitted;
+        return 0;
+    }
+
+    // Takes the next completion off the completion queue. Returns false when there is none
+    bool NextCompletion(struct io_uring_cqe& completion)
+    {
+        unsigned int head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+
+        completion = m_cqes[head & m_cq_mask];
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    char * Buffer(unsigned int id)
+    {
+        return m_buffers + (size_t) id * m_buffer_size;
+    }
+
+    // Gives a buffer a receive completed into back to the kernel. Only the fields are written, the ring's tail
+    // shares the first entry with them. The entries are indexed by hand: compiled as C++, the header's flexible
+    // array sits behind an empty struct that takes up space, 8 bytes after the ring's start
+    void ReturnBuffer(unsigned int id)
+    {
+        struct io_uring_buf * buffer = (struct io_uring_buf *) m_buffer_ring + (m_buffer_tail & (m_buffer_count - 1));
+        buffer->addr = (uint64_t) (uintptr_t) Buffer(id);
+        buffer->len = m_buffer_size - 1;
+        buffer->bid = id;
+        m_buffer_tail++;
+        __atomic_store_n(&m_buffer_ring->tail, m_buffer_tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct io_uring_sqe * NextSqe()
+    {
+        if (m_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+        {
+            return NULL;
+        }
+
+        unsigned int index = m_local_tail & m_sq_mask;
+        struct io_uring_sqe * sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        m_local_tail++;
+        return sqe;
+    }
+
+    int m_fd;
+    char * m_ring;
+    size_t m_ring_size;
+    struct io_uring_sqe * m_sqes;
+    size_t m_sqes_size;
+
+    unsigned int * m_sq_head;
+    unsigned int * m_sq_tail;
+    unsigned int * m_sq_array;
+    unsigned int m_sq_mask;
+    unsigned int m_sq_entries;
+    unsigned int m_local_tail;          // submission entries filled in
+    unsigned int m_submitted_tail;      // submission entries the kernel has taken
+
+    unsigned int * m_cq_head;
+    unsigned int * m_cq_tail;
+    unsigned int m_cq_mask;
+    struct io_uring_cqe * m_cqes;
+
+    char * m_buffers;
+    struct io_uring_buf_ring * m_buffer_ring;
+    unsigned int m_buffer_count;
+    unsigned int m_buffer_size;
+    uint16_t m_buffer_tail;
+};
+
+#endif
@@ -7,21 +7,39 @@
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <semaphore.h>
+#include <pthread.h>
 #include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <iostream>
 #include <vector>
 #include <sstream>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 using namespace std;
 
-#define SHARED_MEMORY_MUTEX             "JP_Shared_Memory_Mutex"
-#define BRIDGE_OVERWEIGHT_LOCK_GUARD    "JP_BridgeOverweightLockGuard"
+#define LOCK_BENCHMARK_SEMAPHORE        "JP_Lock_Benchmark"
 
-#define SHM_SZ    2048
-#define MAX_WAITING_VEHICLES 100
+#define LOCK_BENCHMARK_OPERATIONS   1000000 // lock/unlock pairs per process in the --bench-lock benchmark
+
+#define SHM_SZ    sizeof(SharedBridge)
+#define MAX_WAITING_VEHICLES 1024   // slots of the waiting line, more vehicles wait for a slot to free up
+
+// The bridge's state word: the weight on the bridge in the low 48 bits, the waiting vehicles in the bits above
+#define BRIDGE_WEIGHT_BITS  48
+#define BRIDGE_WEIGHT_MASK  ((1ULL << BRIDGE_WEIGHT_BITS) - 1)
+#define ONE_WAITING_VEHICLE (1ULL << BRIDGE_WEIGHT_BITS)
 
 // Helper method to simulate time delay
 void Delay(double delayInSeconds)
@@ -46,42 +64,89 @@ struct BridgeStat
     long currentWeight;
 };
 
+// A vehicle waiting for room on the bridge, in a slot of the shared segment. It sleeps on its own futex word, and
+// the departing vehicle that makes room for it takes its weight onto the bridge, sets the word and wakes only it
+struct WaitingVehicle
+{
+    uint64_t ticket;        // place in the line, 0 for a free slot
+    long weight;
+    uint32_t admitted;      // 0 while waiting, 1 once on the bridge; the slot is freed by the vehicle itself
+};
+
+// The shared segment: the bridge and the line of vehicles waiting for it. The bridge is one 64 bit word, so vehicles
+// get on and off with a single atomic operation while nobody waits; the mutex guards the line, and changes to the
+// word while there is one
+struct SharedBridge
+{
+    pthread_mutex_t mutex;
+    uint64_t state;         // see BRIDGE_WEIGHT_BITS
+    uint64_t nextTicket;
+    uint32_t slotFreed;     // futex word, bumped when a slot is freed while vehicles wait for one
+    uint32_t lineFull;
+    WaitingVehicle line[MAX_WAITING_VEHICLES];
+};
+
+// The order waiting vehicles get onto the bridge in (--order):
+//  FifoOrder       the order they arrived in, a vehicle that does not fit holds up those behind it
+//  BestFitOrder    the heaviest vehicle that fits first, to keep the bridge as loaded as possible
+enum WaitingOrder
+{
+    FifoOrder,
+    BestFitOrder
+};
+
+WaitingOrder waitingOrder = FifoOrder;
+
+inline long BridgeWeight(uint64_t state)
+{
+    return state & BRIDGE_WEIGHT_MASK;
+}
+
+inline int WaitingVehicles(uint64_t state)
+{
+    return state >> BRIDGE_WEIGHT_BITS;
+}
+
+// Prints a vehicle's event and the bridge load in one write, so the lines of vehicles printing at the same time do
+// not get mixed up
+void PrintBridgeEvent(const string& vehicle_plate_no, const char * event, long load)
+{
+    ostringstream text;
+    text << "Vehicle with Plate #" << vehicle_plate_no << " " << event << endl;
+    text << "Bridge load: " << load << endl << endl;
+    cout << text.str() << flush;
+}
+
+// Sleeps while the word holds value. The futex is not a private one, since the word is in memory that the vehicle
+// processes share
+void FutexWait(uint32_t * word, uint32_t value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+void FutexWake(uint32_t * word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
 class ConcurrencyManager
 {
     int sharedMemorySegmentId;
+    pid_t ownerPid;         // the process that created the segment, the forked vehicles get a copy of the manager
 public:
-    sem_t * sharedMemoryMutex;
+    pthread_mutex_t * sharedMemoryMutex;
     void * sharedMemorySegment;
-    sem_t * overweightLockGuard;
 
     ConcurrencyManager()
     {
         sharedMemorySegment = NULL;
-        sharedMemoryMutex = SEM_FAILED;
-        overweightLockGuard = SEM_FAILED;
+        sharedMemoryMutex = NULL;
         sharedMemorySegmentId = -1;
+        ownerPid = 0;
     }
 
     int Initialize()
     {   
-        // Initalize shared memory mutex
-        sharedMemoryMutex = sem_open(SHARED_MEMORY_MUTEX, O_CREAT, 0600, 1);
-
-        if (sharedMemoryMutex == SEM_FAILED)
-        {
-            return -1;
-        }
-
-        // Initialize overweight lock guard
-        overweightLockGuard = sem_open(BRIDGE_OVERWEIGHT_LOCK_GUARD, O_CREAT, 0600, 0);
-
-        if (overweightLockGuard == SEM_FAILED)
-        {
-            return -1;
-        }
-
-        cout << "Initialized shared memory mutex" << endl;
-
         // Initialize shared memory segment
         key_t key = 987612345;
         sharedMemorySegmentId = shmget(key, SHM_SZ, 0600 | IPC_CREAT);
@@ -94,135 +159,736 @@ public:
         }
 
         cout << "Initialized shared memory segment" << endl << endl;
+        ownerPid = getpid();
 
         // Retrieve the shared segment
         sharedMemorySegment = shmat(sharedMemorySegmentId, 0, 0);
-        if (sharedMemorySegment == NULL)
+        if (sharedMemorySegment == (void *) -1)
         {
+            sharedMemorySegment = NULL;
             return -1;
         }
 
-        memset(sharedMemorySegment, 0, sizeof(BridgeStat));
+        memset(sharedMemorySegment, 0, sizeof(SharedBridge));
+
+        // Initalize shared memory mutex, in the segment itself
+        sharedMemoryMutex = &((SharedBridge *) sharedMemorySegment)->mutex;
+        if (InitializeSharedMutex(sharedMemoryMutex) < 0)
+        {
+            return -1;
+        }
+
+        cout << "Initialized shared memory mutex" << endl << endl;
 
         return 0;
     }
 
+    // Every process detaches. Only the one that created the segment destroys the mutex and removes the segment, once
+    // its vehicles are done; the segment is gone once the last process has detached
     ~ConcurrencyManager()
     {
-        if (sharedMemorySegmentId >= 0)
+        if (sharedMemorySegmentId < 0)
+        {
+            return;
+        }
+
+        if (getpid() == ownerPid)
         {
-            if (sharedMemorySegment != NULL)
+            if (sharedMemoryMutex != NULL)
             {
-                shmdt(sharedMemorySegment);
+                pthread_mutex_destroy(sharedMemoryMutex);
             }
 
-            sem_wait(sharedMemoryMutex);
             shmctl(sharedMemorySegmentId, IPC_RMID, NULL);
-            sem_post(sharedMemoryMutex);
         }
 
-        if (sharedMemoryMutex != SEM_FAILED)
+        if (sharedMemorySegment != NULL)
+        {
+            shmdt(sharedMemorySegment);
+        }
+    }
+
+    // Sets up a mutex the processes sharing the memory it is in can lock. It is robust: when its owner dies, the
+    // next process to lock it gets it with EOWNERDEAD instead of waiting forever
+    static int InitializeSharedMutex(pthread_mutex_t * mutex)
+    {
+        pthread_mutexattr_t attributes;
+        int result = pthread_mutexattr_init(&attributes);
+        if (result == 0)
+        {
+            result = pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        }
+        if (result == 0)
         {
-            sem_unlink(SHARED_MEMORY_MUTEX);
+            result = pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        }
+        if (result == 0)
+        {
+            result = pthread_mutex_init(mutex, &attributes);
         }
 
-        if (overweightLockGuard != SEM_FAILED)
+        pthread_mutexattr_destroy(&attributes);
+        if (result != 0)
         {
-            sem_unlink(BRIDGE_OVERWEIGHT_LOCK_GUARD);
+            errno = result;
+            return -1;
         }
+
+        return 0;
     }
 };
 
+// Holds a shared mutex for a scope. When the process holding it died, this one takes the mutex over, and recover
+// puts right what the dead process may have left half done. Without the mutex the vehicle cannot go on, so any
+// other failure ends the process
 class ScopedLock
 {
-    sem_t * semaphore;
+    pthread_mutex_t * mutex;
 public:
-    ScopedLock(sem_t * _semaphore)
+    ScopedLock(pthread_mutex_t * _mutex, void (*recover)(pthread_mutex_t *) = NULL)
     {
-        semaphore = _semaphore;
-        sem_wait(semaphore);
+        mutex = _mutex;
+        int result = pthread_mutex_lock(mutex);
+        if (result != 0 && result != EOWNERDEAD)
+        {
+            fprintf(stderr, "Failed to lock the shared mutex: %s\n", strerror(result));
+            exit(1);
+        }
+
+        if (result == EOWNERDEAD)
+        {
+            fprintf(stderr, "A process died holding a shared mutex, recovering it\n");
+            if (recover != NULL)
+            {
+                recover(mutex);
+            }
+            pthread_mutex_consistent(mutex);
+        }
     }
 
     ~ScopedLock()
     {
-        sem_post(semaphore);
+        pthread_mutex_unlock(mutex);
     }
 };
 
 long MaxWeight = 0;
 
-void EnterBridge(const ConcurrencyManager& concurrencyManager, int weight, string vehicle_plate_no)
-{   
-    bool canEnterBridge = false;
+// The admission rules. The forked and the in-process modes both decide with these, so they let the same vehicles
+// onto the bridge
 
+inline bool FitsOnBridge(long load, long weight)
+{
+    return load + weight <= MaxWeight;
+}
+
+// An arriving vehicle gets on right away only when its weight fits and nobody is waiting, so it cannot overtake
+// the line
+inline bool EntersOnArrival(long load, int waitingVehicles, long weight)
+{
+    return waitingVehicles == 0 && FitsOnBridge(load, weight);
+}
+
+// Whether a waiting vehicle goes onto the bridge before another one at the given load, in --order. Tickets give
+// their places in the line. The vehicle that goes first of them all is let in only if it fits
+inline bool AdmitsBefore(long weight, uint64_t ticket, long otherWeight, uint64_t otherTicket, long load)
+{
+    if (waitingOrder == FifoOrder)
     {
-        ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex);
-        BridgeStat * bridgeStat = (BridgeStat *) (concurrencyManager.sharedMemorySegment);
-        canEnterBridge = weight + bridgeStat->currentWeight <= MaxWeight && bridgeStat->waitingVehicles == 0;
+        return ticket < otherTicket;
+    }
 
-        if (canEnterBridge)
+    bool fits = FitsOnBridge(load, weight);
+    if (fits != FitsOnBridge(load, otherWeight))
+    {
+        return fits;
+    }
+
+    return weight > otherWeight || (weight == otherWeight && ticket < otherTicket);
+}
+
+// A vehicle of the in-process mode (--threads). It is not a process but a task: the pool runs its arrival and its
+// departure when they are due, and in between the vehicle is only an entry on the bridge or in its waiting line
+struct Vehicle
+{
+    string plateNo;
+    int weight;
+    int travelTime;     // seconds on the bridge
+};
+
+// Of the events due at the same time, departures go first, so the arrivals find the room they leave
+enum VehicleEvent
+{
+    VehicleLeaves,
+    VehicleArrives
+};
+
+struct ScheduledEvent
+{
+    chrono::steady_clock::time_point time;
+    VehicleEvent event;
+    int vehicle;
+
+    bool operator>(const ScheduledEvent& other) const
+    {
+        if (time != other.time)
         {
-            bridgeStat->currentWeight = bridgeStat->currentWeight + weight;
-            cout << "Vehicle with Plate #" << vehicle_plate_no << " started crossing the bridge" << endl;
-            cout << "Bridge load: " << bridgeStat->currentWeight << endl << endl;
-            return;
+            return time > other.time;
+        }
+
+        return event != other.event ? event > other.event : vehicle > other.vehicle;
+    }
+};
+
+// Runs the vehicles as tasks on a fixed pool of threads instead of a process each. The threads sleep until the
+// next event is due instead of spinning, and a vehicle that cannot enter the bridge waits in a line instead of
+// holding a thread, so a few threads carry any number of vehicles. Arrivals and departures decide who gets on with
+// the same admission rules as EnterBridge() and LeaveBridge()
+class VehicleEngine
+{
+    vector<Vehicle> vehicles;
+
+    mutex eventsLock;
+    condition_variable eventsChanged;
+    priority_queue<ScheduledEvent, vector<ScheduledEvent>, greater<ScheduledEvent> > events;
+    size_t vehiclesLeft;    // vehicles that have not left the bridge yet
+
+    mutex bridgeLock;
+    BridgeStat bridgeStat;
+    deque<int> waitingLine;
+
+public:
+    VehicleEngine()
+    {
+        vehiclesLeft = 0;
+        memset(&bridgeStat, 0, sizeof(bridgeStat));
+    }
+
+    // Adds a vehicle arriving at the given time. All vehicles are added before Run()
+    void AddVehicle(const string& plateNo, int weight, int travelTime, chrono::steady_clock::time_point arrival)
+    {
+        Vehicle vehicle;
+        vehicle.plateNo = plateNo;
+        vehicle.weight = weight;
+        vehicle.travelTime = travelTime;
+        vehicles.push_back(vehicle);
+        vehiclesLeft++;
+
+        Schedule(vehicles.size() - 1, VehicleArrives, arrival);
+    }
+
+    // Runs the vehicles on threadCount threads, and returns once the last one has left the bridge
+    void Run(int threadCount)
+    {
+        vector<thread> threads;
+        for (int i = 0; i < threadCount; i++)
+        {
+            threads.push_back(thread(&VehicleEngine::Work, this));
+        }
+
+        for (int i = 0; i < threadCount; i++)
+        {
+            threads[i].join();
+        }
+    }
+
+private:
+    void Schedule(int vehicle, VehicleEvent event, chrono::steady_clock::time_point time)
+    {
+        ScheduledEvent scheduled;
+        scheduled.time = time;
+        scheduled.vehicle = vehicle;
+        scheduled.event = event;
+
+        lock_guard<mutex> lock(eventsLock);
+        events.push(scheduled);
+        eventsChanged.notify_one();
+    }
+
+    // A pool thread: sleeps until the earliest event is due and runs it. The bridge lock is taken before the events
+    // lock is let go, so the events reach the bridge in the order they were due
+    void Work()
+    {
+        vector<int> entered;
+        unique_lock<mutex> lock(eventsLock);
+        while (vehiclesLeft > 0)
+        {
+            if (events.empty())
+            {
+                eventsChanged.wait(lock);
+                continue;
+            }
+
+            ScheduledEvent next = events.top();
+            if (next.time > chrono::steady_clock::now())
+            {
+                eventsChanged.wait_until(lock, next.time);
+                continue;
+            }
+
+            events.pop();
+            unique_lock<mutex> bridge(bridgeLock);
+            lock.unlock();
+
+            entered.clear();
+            if (next.event == VehicleArrives)
+            {
+                Arrive(next.vehicle, entered);
+            }
+            else
+            {
+                Leave(next.vehicle, entered);
+            }
+
+            bridge.unlock();
+            lock.lock();
+
+            // The vehicles that got on the bridge leave once they have crossed it
+            for (size_t i = 0; i < entered.size(); i++)
+            {
+                ScheduledEvent departure;
+                departure.time = next.time + chrono::seconds(vehicles[entered[i]].travelTime);
+                departure.event = VehicleLeaves;
+                departure.vehicle = entered[i];
+                events.push(departure);
+                eventsChanged.notify_one();
+            }
+
+            if (next.event == VehicleLeaves && --vehiclesLeft == 0)
+            {
+                eventsChanged.notify_all();
+            }
         }
     }
-    
-    while (!canEnterBridge)
+
+    // The bridge lock is held by the caller in Arrive(), Leave() and Enter(). The vehicles that got on the bridge are
+    // added to entered
+    void Arrive(int vehicle, vector<int>& entered)
     {
+        cout << "Vehicle with Plate #" << vehicles[vehicle].plateNo << " arrives at the bridge" << endl;
+        cout << "Bridge load: " << bridgeStat.currentWeight << endl << endl;
+
+        if (EntersOnArrival(bridgeStat.currentWeight, bridgeStat.waitingVehicles, vehicles[vehicle].weight))
+        {
+            Enter(vehicle, entered);
+        }
+        else
         {
-            ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex);
-            BridgeStat * bridgeStat = (BridgeStat *)(concurrencyManager.sharedMemorySegment);
-            bridgeStat->waitingVehicles = bridgeStat->waitingVehicles + 1;
+            bridgeStat.waitingVehicles++;
+            waitingLine.push_back(vehicle);
         }
+    }
 
-        sem_wait(concurrencyManager.overweightLockGuard);
+    void Leave(int vehicle, vector<int>& entered)
+    {
+        bridgeStat.currentWeight = bridgeStat.currentWeight - vehicles[vehicle].weight;
+        cout << "Vehicle with Plate #" << vehicles[vehicle].plateNo << " is leaving the bridge" << endl;
+        cout << "Bridge load: " << bridgeStat.currentWeight << endl << endl;
 
+        // The places in the line are the tickets
+        while (!waitingLine.empty())
         {
-            ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex);
-            BridgeStat * bridgeStat = (BridgeStat *) (concurrencyManager.sharedMemorySegment);
-            canEnterBridge = weight + bridgeStat->currentWeight <= MaxWeight;
+            deque<int>::iterator next = waitingLine.begin();
+            for (deque<int>::iterator i = next + 1; i != waitingLine.end(); i++)
+            {
+                uint64_t ticket = i - waitingLine.begin(), nextTicket = next - waitingLine.begin();
+                if (AdmitsBefore(vehicles[*i].weight, ticket, vehicles[*next].weight, nextTicket, bridgeStat.currentWeight))
+                {
+                    next = i;
+                }
+            }
 
-            if (canEnterBridge)
+            if (!FitsOnBridge(bridgeStat.currentWeight, vehicles[*next].weight))
             {
-                bridgeStat->waitingVehicles = bridgeStat->waitingVehicles - 1;
-                bridgeStat->currentWeight = bridgeStat->currentWeight + weight;
-                cout << "Vehicle with Plate #" << vehicle_plate_no << " started crossing the bridge" << endl;
-                cout << "Bridge load: " << bridgeStat->currentWeight << endl << endl;
+                break;
             }
+
+            int vehicle = *next;
+            waitingLine.erase(next);
+            bridgeStat.waitingVehicles--;
+            Enter(vehicle, entered);
         }
     }
 
+    void Enter(int vehicle, vector<int>& entered)
+    {
+        bridgeStat.currentWeight = bridgeStat.currentWeight + vehicles[vehicle].weight;
+        cout << "Vehicle with Plate #" << vehicles[vehicle].plateNo << " started crossing the bridge" << endl;
+        cout << "Bridge load: " << bridgeStat.currentWeight << endl << endl;
+
+        entered.push_back(vehicle);
+    }
+};
+
+// The fast path of EnterBridge(): puts the vehicle on the bridge with a compare-and-swap when its weight fits and
+// nobody is waiting. Returns false when it cannot enter now. state is the bridge after the attempt
+bool TryEnterBridge(SharedBridge * bridge, int weight, uint64_t& state)
+{
+    state = __atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE);
+    while (EntersOnArrival(BridgeWeight(state), WaitingVehicles(state), weight))
+    {
+        if (__atomic_compare_exchange_n(&bridge->state, &state, state + weight, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            state += weight;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// With the mutex held, either puts the vehicle on the bridge, when it fits and nobody is waiting, or counts it as
+// waiting and gives it a slot of the line, deciding with one compare-and-swap. A departure that makes room in between
+// makes the swap fail, so the vehicle never waits for room that is already there. Returns the slot, or NULL when
+// the vehicle entered (entered is set) or every slot is taken
+WaitingVehicle * JoinWaitingLine(SharedBridge * bridge, int weight, bool& entered, uint64_t& state)
+{
+    WaitingVehicle * slot = NULL;
+    for (int i = 0; i < MAX_WAITING_VEHICLES && slot == NULL; i++)
+    {
+        if (bridge->line[i].ticket == 0)
+        {
+            slot = &bridge->line[i];
+        }
+    }
+
+    state = __atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE);
+    while (true)
+    {
+        entered = EntersOnArrival(BridgeWeight(state), WaitingVehicles(state), weight);
+        if (!entered && slot == NULL)
+        {
+            bridge->lineFull = 1;
+            return NULL;
+        }
+
+        uint64_t next = state + (entered ? weight : ONE_WAITING_VEHICLE);
+        if (__atomic_compare_exchange_n(&bridge->state, &state, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            state = next;
+            break;
+        }
+    }
+
+    if (entered)
+    {
+        return NULL;
+    }
+
+    slot->ticket = ++bridge->nextTicket;
+    slot->weight = weight;
+    slot->admitted = 0;
+    return slot;
+}
+
+// Puts the waiting vehicles that fit on the bridge now, in --order, and wakes exactly those. The mutex is held.
+// Departures still take weight off the bridge meanwhile, and then the vehicle to let in is picked again
+void AdmitWaitingVehicles(SharedBridge * bridge)
+{
+    uint64_t state = __atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE);
+    while (WaitingVehicles(state) > 0)
+    {
+        WaitingVehicle * next = NULL;
+        for (int i = 0; i < MAX_WAITING_VEHICLES; i++)
+        {
+            WaitingVehicle * slot = &bridge->line[i];
+            if (slot->ticket == 0 || slot->admitted)
+            {
+                continue;
+            }
+
+            if (next == NULL || AdmitsBefore(slot->weight, slot->ticket, next->weight, next->ticket, BridgeWeight(state)))
+            {
+                next = slot;
+            }
+        }
+
+        if (next == NULL || !FitsOnBridge(BridgeWeight(state), next->weight))
+        {
+            break;
+        }
+
+        uint64_t admitted = state + next->weight - ONE_WAITING_VEHICLE;
+        if (!__atomic_compare_exchange_n(&bridge->state, &state, admitted, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        state = admitted;
+        __atomic_store_n(&next->admitted, 1, __ATOMIC_RELEASE);
+        FutexWake(&next->admitted, 1);
+    }
+}
+
+// Puts the bridge right after a vehicle died holding its mutex. The vehicle may have been between counting itself
+// as waiting and filling in its slot, or between making room and waking the vehicles that fit, so the waiting
+// vehicles are counted again and those that fit are let in. A dead vehicle's weight stays on the bridge, as it does
+// when it dies anywhere else
+void RecoverBridge(pthread_mutex_t * mutex)
+{
+    SharedBridge * bridge = (SharedBridge *) ((char *) mutex - offsetof(SharedBridge, mutex));
+
+    uint64_t waitingVehicles = 0;
+    for (int i = 0; i < MAX_WAITING_VEHICLES; i++)
+    {
+        waitingVehicles += bridge->line[i].ticket != 0 && !bridge->line[i].admitted;
+    }
+
+    uint64_t state = __atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&bridge->state, &state, (state & BRIDGE_WEIGHT_MASK) | (waitingVehicles << BRIDGE_WEIGHT_BITS),
+        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+    }
+
+    AdmitWaitingVehicles(bridge);
+}
+
+void EnterBridge(const ConcurrencyManager& concurrencyManager, int weight, string vehicle_plate_no)
+{   
+    SharedBridge * bridge = (SharedBridge *) (concurrencyManager.sharedMemorySegment);
+    uint64_t state;
+
+    // Nobody is waiting and the vehicle fits: it gets on without taking the mutex
+    if (TryEnterBridge(bridge, weight, state))
+    {
+        PrintBridgeEvent(vehicle_plate_no, "started crossing the bridge", BridgeWeight(state));
+        return;
+    }
+
+    WaitingVehicle * slot = NULL;
+    bool entered = false;
+    while (slot == NULL && !entered)
+    {
+        uint32_t slotFreed;
+        {
+            ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex, RecoverBridge);
+            slot = JoinWaitingLine(bridge, weight, entered, state);
+            slotFreed = bridge->slotFreed;
+        }
+
+        // Every slot is taken: wait for one to be freed and try again
+        if (slot == NULL && !entered)
+        {
+            FutexWait(&bridge->slotFreed, slotFreed);
+        }
+    }
+
+    if (entered)
+    {
+        PrintBridgeEvent(vehicle_plate_no, "started crossing the bridge", BridgeWeight(state));
+        return;
+    }
+
+    // The departure that makes room puts this vehicle's weight on the bridge before it wakes it up, so the vehicle
+    // only has to wait for its word to change
+    while (__atomic_load_n(&slot->admitted, __ATOMIC_ACQUIRE) == 0)
+    {
+        FutexWait(&slot->admitted, 0);
+    }
+
+    PrintBridgeEvent(vehicle_plate_no, "started crossing the bridge", BridgeWeight(__atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE)));
+
+    ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex, RecoverBridge);
+    slot->ticket = 0;
+    if (bridge->lineFull)
+    {
+        bridge->lineFull = 0;
+        bridge->slotFreed++;
+        FutexWake(&bridge->slotFreed, INT_MAX);
+    }
 }
 
+// Takes the vehicle's weight off the bridge with one atomic subtraction. Only when vehicles are waiting does it take
+// the mutex, to let in those that fit now. A vehicle counted as waiting after the subtraction saw the room it made
 void LeaveBridge(const ConcurrencyManager& concurrencyManager, int weight, string vehicle_plate_no)
 {
-    ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex);
-    BridgeStat * bridgeStat = (BridgeStat *)(concurrencyManager.sharedMemorySegment);
-    bridgeStat->currentWeight = bridgeStat->currentWeight - weight;
+    SharedBridge * bridge = (SharedBridge *) (concurrencyManager.sharedMemorySegment);
+    uint64_t state = __atomic_sub_fetch(&bridge->state, (uint64_t) weight, __ATOMIC_ACQ_REL);
+
+    PrintBridgeEvent(vehicle_plate_no, "is leaving the bridge", BridgeWeight(state));
+
+    if (WaitingVehicles(state) > 0)
+    {
+        ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex, RecoverBridge);
+        AdmitWaitingVehicles(bridge);
+    }
+}
+
+// The in-process mode: reads every vehicle first, each arriving the given number of seconds after the one before
+// it like in the forked mode, and then runs them on the thread pool
+int RunVehicleTasks(int threadCount)
+{
+    VehicleEngine engine;
+    chrono::steady_clock::time_point arrivalTime = chrono::steady_clock::now();
 
-    cout << "Vehicle with Plate #" << vehicle_plate_no << " is leaving the bridge" << endl;
-    cout << "Bridge load: " << bridgeStat->currentWeight << endl << endl;
+    string vehicle_plate_no;
+    int arrival, weight, bridge_travel_time;
+    cin >> vehicle_plate_no >> arrival >> weight >> bridge_travel_time;
 
-    // Signal if there are waiters
-    if (bridgeStat->waitingVehicles > 0)
+    while (cin)
     {
-        sem_post(concurrencyManager.overweightLockGuard);
+        if (weight > MaxWeight)
+        {
+            cout << "Vehicle with Plate #" << vehicle_plate_no << " is overweight and rejected from the bridge" << endl << endl;
+        }
+        else
+        {
+            arrivalTime += chrono::seconds(arrival);
+            engine.AddVehicle(vehicle_plate_no, weight, bridge_travel_time, arrivalTime);
+        }
+
+        cin >> vehicle_plate_no >> arrival >> weight >> bridge_travel_time;
+    }
+
+    engine.Run(threadCount);
+    return 0;
+}
+
+// What the --bench-lock processes share
+struct LockBenchmark
+{
+    pthread_mutex_t mutex;
+    long counter;
+};
+
+// Times a lock/unlock pair around a tiny critical section, with a named semaphore like the one ScopedLock used to
+// wait on and with the robust mutex it locks now, for 1 to maxProcesses processes taking the lock as fast as they can
+int BenchmarkLocks(int maxProcesses)
+{
+    int segmentId = shmget(IPC_PRIVATE, sizeof(LockBenchmark), 0600 | IPC_CREAT);
+    if (segmentId < 0)
+    {
+        fprintf(stderr, "Failed to create the benchmark's shared memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The segment goes away once the benchmark has detached it, the semaphore once it is closed
+    LockBenchmark * shared = (LockBenchmark *) shmat(segmentId, 0, 0);
+    shmctl(segmentId, IPC_RMID, NULL);
+    sem_t * semaphore = sem_open(LOCK_BENCHMARK_SEMAPHORE, O_CREAT, 0600, 1);
+    sem_unlink(LOCK_BENCHMARK_SEMAPHORE);
+    if (shared == (void *) -1 || semaphore == SEM_FAILED || ConcurrencyManager::InitializeSharedMutex(&shared->mutex) < 0)
+    {
+        fprintf(stderr, "Failed to set up the locks: %s\n", strerror(errno));
+        return -1;
+    }
+
+    const char * lockNames[] = { "semaphore", "mutex" };
+    cout << "processes   semaphore ns/lock   mutex ns/lock" << endl;
+    for (int processes = 1; processes <= maxProcesses; processes *= 2)
+    {
+        double nanoseconds[2];
+        for (int kind = 0; kind < 2; kind++)
+        {
+            shared->counter = 0;
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (int p = 0; p < processes; p++)
+            {
+                int pid = fork();
+                if (pid == 0)
+                {
+                    for (int i = 0; i < LOCK_BENCHMARK_OPERATIONS; i++)
+                    {
+                        if (kind == 0)
+                        {
+                            sem_wait(semaphore);
+                            shared->counter++;
+                            sem_post(semaphore);
+                        }
+                        else
+                        {
+                            ScopedLock lock(&shared->mutex);
+                            shared->counter++;
+                        }
+                    }
+
+                    _exit(0);
+                }
+                else if (pid < 0)
+                {
+                    fprintf(stderr, "Failed to fork new process: %s\n", strerror(errno));
+                    return -1;
+                }
+            }
+
+            while (wait(NULL) > 0)
+            {
+            }
+
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+            nanoseconds[kind] = elapsed / ((double) processes * LOCK_BENCHMARK_OPERATIONS);
+
+            if (shared->counter != (long) processes * LOCK_BENCHMARK_OPERATIONS)
+            {
+                fprintf(stderr, "The %s lost updates: %ld of %ld\n", lockNames[kind], shared->counter, (long) processes * LOCK_BENCHMARK_OPERATIONS);
+                return -1;
+            }
+        }
+
+        printf("%9d %19.1f %15.1f\n", processes, nanoseconds[0], nanoseconds[1]);
     }
+
+    sem_close(semaphore);
+    shmdt(shared);
+    return 0;
 }
 
 int main(int argc, char *argv [])
 {
-    if (argc != 2)
+    if (argc == 3 && strcmp(argv[1], "--bench-lock") == 0)
+    {
+        return BenchmarkLocks(atoi(argv[2])) < 0 ? 1 : 0;
+    }
+
+    // 0 forks a process per vehicle, anything else runs the vehicles as tasks on that many threads
+    int threadCount = 0;
+    int argument = 1;
+    for (; argument + 2 < argc; argument += 2)
     {
-        fprintf(stderr, "Usage: %s <max_weight>\n", argv[0]);
+        if (strcmp(argv[argument], "--threads") == 0)
+        {
+            threadCount = atoi(argv[argument + 1]);
+        }
+        else if (strcmp(argv[argument], "--order") == 0 && strcmp(argv[argument + 1], "fifo") == 0)
+        {
+            waitingOrder = FifoOrder;
+        }
+        else if (strcmp(argv[argument], "--order") == 0 && strcmp(argv[argument + 1], "best-fit") == 0)
+        {
+            waitingOrder = BestFitOrder;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argument != argc - 1 || threadCount < 0)
+    {
+        fprintf(stderr, "Usage: %s [--threads <workers>] [--order fifo|best-fit] <max_weight>\n"
+            "       %s --bench-lock <max processes>\n", argv[0], argv[0]);
         return 1;
     }
 
-    MaxWeight = strtoul(argv[1], NULL, 0);
+    MaxWeight = strtoul(argv[argument], NULL, 0);
 
     cout << "Max Weight: " << MaxWeight << endl << endl;
+    if (threadCount > 0)
+    {
+        return RunVehicleTasks(threadCount);
+    }
+
+    // The load shares the bridge's state word with the waiting vehicles
+    if ((unsigned long long) MaxWeight > BRIDGE_WEIGHT_MASK)
+    {
+        fprintf(stderr, "The max weight must not be over %llu\n", BRIDGE_WEIGHT_MASK);
+        return 1;
+    }
+
     ConcurrencyManager concurrencyManager;
     if (concurrencyManager.Initialize() < 0)
     {
@@ -230,6 +896,7 @@ int main(int argc, char *argv [])
         return 1;
     }
 
+    int exitCode = 0;
     string vehicle_plate_no;
     int arrival, weight, bridge_travel_time;
     cin >> vehicle_plate_no >> arrival >> weight >> bridge_travel_time;
@@ -246,12 +913,8 @@ int main(int argc, char *argv [])
             // Apply delay between arrivals if necessary
             Delay(arrival);
             
-            {
-                ScopedLock sharedMemoryMutex(concurrencyManager.sharedMemoryMutex);
-                BridgeStat * bridgeStat = (BridgeStat *)(concurrencyManager.sharedMemorySegment);
-                cout << "Vehicle with Plate #" << vehicle_plate_no << " arrives at the bridge" << endl;
-                cout << "Bridge load: " << bridgeStat->currentWeight << endl << endl;
-            }
+            SharedBridge * bridge = (SharedBridge *) (concurrencyManager.sharedMemorySegment);
+            PrintBridgeEvent(vehicle_plate_no, "arrives at the bridge", BridgeWeight(__atomic_load_n(&bridge->state, __ATOMIC_ACQUIRE)));
 
             // Fork a new process for each person arriving in the plaza
             int pid = fork();
@@ -271,8 +934,10 @@ int main(int argc, char *argv [])
             }
             else
             {
+                // The vehicles already on their way still use the mutex, so wait for them before it is destroyed
                 fprintf(stderr, "Failed to fork new process: %s\n", strerror(errno));
-                return 1;
+                exitCode = 1;
+                break;
             }
         }
     }
@@ -286,5 +951,5 @@ int main(int argc, char *argv [])
         }
     }
 
-    return 0;
+    return exitCode;
 }
\ No newline at end of file